@@ -0,0 +1,263 @@
+/*
+ * binder_latency.c
+ *
+ * Binder reply latency test for callers that lend their priority.  A
+ * server process with normal priority loopers takes the context manager
+ * role, a number of busy loop processes load every cpu, and a client
+ * thread with the given policy makes calls and measures the time to the
+ * reply.  The server replies with the policy and priority its thread
+ * ran the call at, so the priority inheritance rules can be checked:
+ *
+ *	fifo/rr	 the server thread runs the call at the caller's rt priority
+ *	other	 the server thread may get a lower nice value, never a higher one
+ *	batch	 as other; the server thread stays SCHED_OTHER
+ *	idle	 as other; the server thread stays SCHED_OTHER
+ *
+ * -P is the rt priority for fifo and rr, and the nice value otherwise.
+ * Run it as root with servicemanager stopped, e.g.
+ *
+ *	binder_latency -c fifo -P 50 -n 10000
+ *
+ * Compile with
+ *	gcc -I/usr/src/linux/drivers/staging/android binder_latency.c \
+ *		-o binder_latency -lpthread
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "binder_test.h"
+
+#ifndef SCHED_BATCH
+#define SCHED_BATCH	3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE	5
+#endif
+
+static const struct {
+	const char *name;
+	int policy;
+} policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+};
+
+static int loopers = 2;
+static int hogs = -1;
+static int count = 10000;
+static int interval_us = 1000;
+static int policy = SCHED_FIFO;
+static int prio = 50;
+
+struct observed {
+	int policy;
+	int prio;
+};
+
+static const char *policy_name(int p)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+		if (policies[i].policy == p)
+			return policies[i].name;
+	return "?";
+}
+
+static void report_priority(struct bt_txn *txn, void *arg)
+{
+	static __thread struct observed o;
+	struct sched_param param;
+
+	o.policy = sched_getscheduler(0);
+	if (o.policy == SCHED_FIFO || o.policy == SCHED_RR) {
+		sched_getparam(0, &param);
+		o.prio = param.sched_priority;
+	} else {
+		o.prio = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+	}
+	txn->reply = &o;
+	txn->reply_size = sizeof(o);
+}
+
+static void *looper(void *arg)
+{
+	bt_serve(*(int *)arg, BC_REGISTER_LOOPER, report_priority, NULL);
+	return NULL;
+}
+
+static void server(int ready)
+{
+	pthread_t thread;
+	int fd, i;
+
+	fd = bt_open();
+	bt_become_context_manager(fd, loopers);
+	for (i = 1; i < loopers; i++)
+		if (pthread_create(&thread, NULL, looper, &fd))
+			bt_die("pthread_create failed\n");
+	if (write(ready, "", 1) != 1)
+		bt_die("server: cannot report ready\n");
+	bt_serve(fd, BC_ENTER_LOOPER, report_priority, NULL);
+	exit(0);
+}
+
+static void hog(void)
+{
+	for (;;)
+		;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long ns_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000UL +
+	       now.tv_nsec - start->tv_nsec;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: binder_latency [-c other|fifo|rr|batch|idle] "
+		"[-P prio] [-n calls] [-i interval_us] [-l loopers] "
+		"[-b hogs]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sched_param param;
+	struct observed o;
+	struct timespec start;
+	unsigned long *lat, sum = 0;
+	unsigned long inherited = 0, lowered = 0;
+	pid_t server_pid, *hog_pid;
+	int pipefd[2];
+	size_t size;
+	unsigned int j;
+	char c;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "c:P:n:i:l:b:")) != -1) {
+		switch (opt) {
+		case 'c':
+			for (j = 0; j < sizeof(policies) / sizeof(policies[0]);
+			     j++)
+				if (!strcmp(optarg, policies[j].name))
+					break;
+			if (j == sizeof(policies) / sizeof(policies[0]))
+				usage();
+			policy = policies[j].policy;
+			break;
+		case 'P':
+			prio = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'i':
+			interval_us = atoi(optarg);
+			break;
+		case 'l':
+			loopers = atoi(optarg);
+			break;
+		case 'b':
+			hogs = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (count < 1 || loopers < 1 || interval_us < 0)
+		usage();
+	if (hogs < 0)
+		hogs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	lat = calloc(count, sizeof(*lat));
+	hog_pid = calloc(hogs + 1, sizeof(*hog_pid));
+	if (!lat || !hog_pid)
+		bt_die("out of memory\n");
+
+	if (pipe(pipefd))
+		bt_die("pipe: %s\n", strerror(errno));
+	server_pid = fork();
+	if (server_pid == 0)
+		server(pipefd[1]);
+	if (server_pid < 0 || read(pipefd[0], &c, 1) != 1)
+		bt_die("server did not start\n");
+	for (i = 0; i < hogs; i++) {
+		hog_pid[i] = fork();
+		if (hog_pid[i] == 0)
+			hog();
+	}
+
+	param.sched_priority = (policy == SCHED_FIFO ||
+				policy == SCHED_RR) ? prio : 0;
+	if (sched_setscheduler(0, policy, &param))
+		bt_die("sched_setscheduler: %s\n", strerror(errno));
+	if (policy == SCHED_OTHER && prio >= -20 && prio <= 19)
+		setpriority(PRIO_PROCESS, 0, prio);
+	mlockall(MCL_CURRENT | MCL_FUTURE);
+
+	i = bt_open();
+	for (j = 0; j < (unsigned int)count; j++) {
+		size = sizeof(o);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (bt_call(i, 1, 0, NULL, 0, &o, &size) || size != sizeof(o))
+			bt_die("call %u failed\n", j);
+		lat[j] = ns_since(&start);
+		sum += lat[j];
+
+		if (policy == SCHED_FIFO || policy == SCHED_RR) {
+			if (o.policy == policy && o.prio == prio)
+				inherited++;
+		} else if (o.policy != SCHED_OTHER || o.prio > 0) {
+			/* a non-rt caller must never lower the server */
+			lowered++;
+		}
+		if (interval_us)
+			usleep(interval_us);
+	}
+
+	for (i = 0; i < hogs; i++)
+		kill(hog_pid[i], SIGKILL);
+	kill(server_pid, SIGKILL);
+	while (wait(NULL) > 0)
+		;
+
+	qsort(lat, count, sizeof(*lat), cmp_ulong);
+	printf("%s prio %d, %d calls, %d hogs: latency us min %lu avg %lu "
+	       "p50 %lu p99 %lu max %lu\n", policy_name(policy), prio, count,
+	       hogs, lat[0] / 1000, sum / count / 1000,
+	       lat[count / 2] / 1000, lat[count * 99 / 100] / 1000,
+	       lat[count - 1] / 1000);
+	if (policy == SCHED_FIFO || policy == SCHED_RR)
+		printf("server ran %lu of %d calls at the caller's priority\n",
+		       inherited, count);
+	else
+		printf("server was demoted below SCHED_OTHER nice 0 in %lu of "
+		       "%d calls (last seen %s %d)\n", lowered, count,
+		       policy_name(o.policy), o.prio);
+
+	if (policy == SCHED_FIFO || policy == SCHED_RR)
+		return inherited != (unsigned long)count;
+	return lowered != 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * binder_stress.c
+ *
+ * Binder lock contention stress test.  A server process takes the
+ * context manager role and serves calls from a pool of looper threads,
+ * while a number of client processes, each with a number of threads,
+ * call it as fast as they can.  All calls go to the same node and the
+ * same target process, so they contend on its locks; a run with more
+ * client processes also contends on the driver's global state.  At the
+ * end the total and per-thread call rates are printed.
+ *
+ * Run it with servicemanager stopped, e.g. for a sweep:
+ *
+ *	for p in 1 2 4 8; do binder_stress -p $p -t 2 -d 5; done
+ *
+ * Compile with
+ *	gcc -I/usr/src/linux/drivers/staging/android binder_stress.c \
+ *		-o binder_stress -lpthread
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#include "binder_test.h"
+
+static int procs = 2;
+static int threads = 2;
+static int loopers = 4;
+static int duration = 5;
+static int oneway_percent;
+static size_t payload = 64;
+
+struct shared {
+	volatile int stop;
+	unsigned long calls[0];
+};
+
+static struct shared *shared;
+
+static void echo(struct bt_txn *txn, void *arg)
+{
+	txn->reply = (void *)txn->tr.data.ptr.buffer;
+	txn->reply_size = txn->tr.data_size;
+}
+
+static void *looper(void *arg)
+{
+	bt_serve(*(int *)arg, BC_REGISTER_LOOPER, echo, NULL);
+	return NULL;
+}
+
+static void server(int ready)
+{
+	pthread_t thread;
+	int fd, i;
+
+	fd = bt_open();
+	bt_become_context_manager(fd, loopers);
+	for (i = 1; i < loopers; i++)
+		if (pthread_create(&thread, NULL, looper, &fd))
+			bt_die("pthread_create failed\n");
+	if (write(ready, "", 1) != 1)
+		bt_die("server: cannot report ready\n");
+	bt_serve(fd, BC_ENTER_LOOPER, echo, NULL);
+	exit(0);
+}
+
+struct client {
+	int fd;
+	unsigned long *calls;
+	unsigned long failed;
+};
+
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	char data[BT_MAX_DATA], reply[BT_MAX_DATA];
+	unsigned long n = 0;
+	uint32_t flags;
+	size_t size;
+
+	memset(data, 0x5a, payload);
+	while (!shared->stop) {
+		flags = (int)(n % 100) < oneway_percent ? TF_ONE_WAY : 0;
+		size = sizeof(reply);
+		/* a full async queue fails one-way calls; count and go on */
+		if (bt_call(c->fd, 1, flags, data, payload, reply, &size))
+			c->failed++;
+		else
+			(*c->calls)++;
+		n++;
+	}
+	return NULL;
+}
+
+static void client(int id)
+{
+	pthread_t thread[threads];
+	struct client c[threads];
+	unsigned long failed = 0;
+	int fd, i;
+
+	fd = bt_open();
+	for (i = 0; i < threads; i++) {
+		c[i].fd = fd;
+		c[i].calls = &shared->calls[id * threads + i];
+		c[i].failed = 0;
+		if (pthread_create(&thread[i], NULL, client_thread, &c[i]))
+			bt_die("pthread_create failed\n");
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(thread[i], NULL);
+		failed += c[i].failed;
+	}
+	if (failed)
+		fprintf(stderr, "client %d: %lu calls failed\n", id, failed);
+	exit(0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: binder_stress [-p procs] [-t threads] "
+		"[-l loopers] [-s bytes] [-o oneway%%] [-d seconds]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long total = 0, min = ~0UL, max = 0;
+	struct timeval start, end;
+	pid_t server_pid;
+	int pipefd[2];
+	double secs;
+	char c;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "p:t:l:s:o:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			procs = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'l':
+			loopers = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 'o':
+			oneway_percent = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (procs < 1 || threads < 1 || loopers < 1 || duration < 1 ||
+	    payload > BT_MAX_DATA || oneway_percent < 0 ||
+	    oneway_percent > 100)
+		usage();
+
+	shared = mmap(NULL, sizeof(*shared) +
+		      procs * threads * sizeof(shared->calls[0]),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		bt_die("mmap: %s\n", strerror(errno));
+
+	if (pipe(pipefd))
+		bt_die("pipe: %s\n", strerror(errno));
+	server_pid = fork();
+	if (server_pid == 0)
+		server(pipefd[1]);
+	if (server_pid < 0 || read(pipefd[0], &c, 1) != 1)
+		bt_die("server did not start\n");
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < procs; i++) {
+		pid_t pid = fork();
+		if (pid == 0)
+			client(i);
+		if (pid < 0)
+			bt_die("fork: %s\n", strerror(errno));
+	}
+	sleep(duration);
+	shared->stop = 1;
+	for (i = 0; i < procs; i++)
+		wait(NULL);
+	gettimeofday(&end, NULL);
+
+	kill(server_pid, SIGKILL);
+	waitpid(server_pid, NULL, 0);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1e6;
+	for (i = 0; i < procs * threads; i++) {
+		total += shared->calls[i];
+		if (shared->calls[i] < min)
+			min = shared->calls[i];
+		if (shared->calls[i] > max)
+			max = shared->calls[i];
+	}
+	printf("procs %d threads %d loopers %d size %zu oneway %d%%: "
+	       "%.0f calls/s, %.2f us/call, per thread min %.0f max %.0f "
+	       "calls/s\n", procs, threads, loopers, payload, oneway_percent,
+	       total / secs, total ? secs * 1e6 * procs * threads / total : 0,
+	       min / secs, max / secs);
+
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * binder_test.h
+ *
+ * Minimal user space side of the binder protocol, shared by the binder
+ * test programs.  Only what is needed to make and serve plain calls to
+ * the context manager (handle 0) is here; there is no object or
+ * reference handling.
+ *
+ * The programs take the context manager role, so servicemanager (and
+ * with it the rest of Android) must not be running.
+ */
+
+#ifndef _BINDER_TEST_H
+#define _BINDER_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define __user
+#include "binder.h"
+
+#define BT_MAP_SIZE	(1024 * 1024)
+#define BT_MAX_DATA	4096
+
+#define bt_die(fmt, arg...)				\
+	do {						\
+		fprintf(stderr, fmt, ##arg);		\
+		exit(1);				\
+	} while (0)
+
+struct bt_txn {
+	struct binder_transaction_data tr;
+	/* filled in by the handler, sent back as the reply */
+	void *reply;
+	size_t reply_size;
+};
+
+typedef void (*bt_handler_t)(struct bt_txn *txn, void *arg);
+
+static int bt_open(void)
+{
+	struct binder_version vers;
+	void *map;
+	int fd;
+
+	fd = open("/dev/binder", O_RDWR);
+	if (fd < 0)
+		bt_die("open /dev/binder: %s\n", strerror(errno));
+	if (ioctl(fd, BINDER_VERSION, &vers) < 0 ||
+	    vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION)
+		bt_die("binder protocol version mismatch\n");
+	map = mmap(NULL, BT_MAP_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		bt_die("mmap /dev/binder: %s\n", strerror(errno));
+	return fd;
+}
+
+static int bt_write_read(int fd, void *wbuf, size_t wsize,
+			 void *rbuf, size_t rsize, size_t *rconsumed)
+{
+	struct binder_write_read bwr;
+	int ret;
+
+	bwr.write_size = wsize;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)wbuf;
+	bwr.read_size = rsize;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)rbuf;
+	do {
+		ret = ioctl(fd, BINDER_WRITE_READ, &bwr);
+	} while (ret < 0 && errno == EINTR);
+	if (rconsumed)
+		*rconsumed = bwr.read_consumed;
+	return ret;
+}
+
+static void bt_command(int fd, uint32_t cmd)
+{
+	if (bt_write_read(fd, &cmd, sizeof(cmd), NULL, 0, NULL) < 0)
+		bt_die("binder command %x: %s\n", cmd, strerror(errno));
+}
+
+static void bt_become_context_manager(int fd, size_t max_threads)
+{
+	if (ioctl(fd, BINDER_SET_MAX_THREADS, &max_threads) < 0)
+		bt_die("BINDER_SET_MAX_THREADS: %s\n", strerror(errno));
+	if (ioctl(fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		bt_die("BINDER_SET_CONTEXT_MGR: %s (is servicemanager "
+		       "running?)\n", strerror(errno));
+}
+
+/*
+ * Serve calls on the calling thread until the driver fails.  The
+ * buffer of each call is freed in the same write as its reply.
+ */
+static void bt_serve(int fd, uint32_t looper_cmd, bt_handler_t handler,
+		     void *arg)
+{
+	struct {
+		uint32_t free_cmd;
+		void *free_ptr;
+		uint32_t reply_cmd;
+		struct binder_transaction_data tr;
+	} __attribute__((packed)) out;
+	uint32_t rbuf[256];
+	size_t rsize;
+	char *ptr, *end;
+	uint32_t cmd;
+	struct bt_txn txn;
+
+	bt_command(fd, looper_cmd);
+	for (;;) {
+		if (bt_write_read(fd, NULL, 0, rbuf, sizeof(rbuf), &rsize) < 0)
+			return;
+		ptr = (char *)rbuf;
+		end = ptr + rsize;
+		while (ptr < end) {
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			if (cmd != BR_TRANSACTION) {
+				ptr += _IOC_SIZE(cmd);
+				continue;
+			}
+			memcpy(&txn.tr, ptr, sizeof(txn.tr));
+			ptr += sizeof(txn.tr);
+
+			txn.reply = NULL;
+			txn.reply_size = 0;
+			handler(&txn, arg);
+
+			out.free_cmd = BC_FREE_BUFFER;
+			out.free_ptr = (void *)txn.tr.data.ptr.buffer;
+			if (txn.tr.flags & TF_ONE_WAY) {
+				bt_write_read(fd, &out, sizeof(out.free_cmd) +
+					      sizeof(out.free_ptr),
+					      NULL, 0, NULL);
+				continue;
+			}
+			out.reply_cmd = BC_REPLY;
+			memset(&out.tr, 0, sizeof(out.tr));
+			out.tr.data_size = txn.reply_size;
+			out.tr.data.ptr.buffer = txn.reply;
+			bt_write_read(fd, &out, sizeof(out), NULL, 0, NULL);
+		}
+	}
+}
+
+/*
+ * Call the context manager and wait for the reply (or only for the
+ * driver's ack of a one-way call).  Up to *reply_size bytes of the reply
+ * are copied to reply.  Returns 0, or the BR_ code that failed the call.
+ */
+static uint32_t bt_call(int fd, uint32_t code, uint32_t flags,
+			const void *data, size_t size,
+			void *reply, size_t *reply_size)
+{
+	struct {
+		uint32_t cmd;
+		struct binder_transaction_data tr;
+	} __attribute__((packed)) out;
+	struct {
+		uint32_t cmd;
+		void *ptr;
+	} __attribute__((packed)) free_buf;
+	uint32_t rbuf[64];
+	struct binder_transaction_data tr;
+	size_t rsize, n;
+	char *ptr, *end;
+	uint32_t cmd;
+	int done = 0;
+
+	memset(&out, 0, sizeof(out));
+	out.cmd = BC_TRANSACTION;
+	out.tr.target.handle = 0;
+	out.tr.code = code;
+	out.tr.flags = flags;
+	out.tr.data_size = size;
+	out.tr.data.ptr.buffer = data;
+
+	if (bt_write_read(fd, &out, sizeof(out), rbuf, sizeof(rbuf),
+			  &rsize) < 0)
+		bt_die("BC_TRANSACTION: %s\n", strerror(errno));
+	for (;;) {
+		ptr = (char *)rbuf;
+		end = ptr + rsize;
+		while (ptr < end) {
+			memcpy(&cmd, ptr, sizeof(cmd));
+			ptr += sizeof(cmd);
+			switch (cmd) {
+			case BR_TRANSACTION_COMPLETE:
+				if (flags & TF_ONE_WAY)
+					done = 1;
+				break;
+			case BR_REPLY:
+				memcpy(&tr, ptr, sizeof(tr));
+				if (reply_size) {
+					n = tr.data_size < *reply_size ?
+					    tr.data_size : *reply_size;
+					memcpy(reply, tr.data.ptr.buffer, n);
+					*reply_size = n;
+				}
+				free_buf.cmd = BC_FREE_BUFFER;
+				free_buf.ptr = (void *)tr.data.ptr.buffer;
+				bt_write_read(fd, &free_buf, sizeof(free_buf),
+					      NULL, 0, NULL);
+				return 0;
+			case BR_DEAD_REPLY:
+			case BR_FAILED_REPLY:
+				return cmd;
+			}
+			ptr += _IOC_SIZE(cmd);
+		}
+		if (done)
+			return 0;
+		if (bt_write_read(fd, NULL, 0, rbuf, sizeof(rbuf), &rsize) < 0)
+			bt_die("binder read: %s\n", strerror(errno));
+	}
+}
+
+#endif /* _BINDER_TEST_H */
@@ -202,6 +202,44 @@ void flush_cpu_dcache(void *vaddr, u32 paddr, u32 length, bool inner_only,
 	}
 }
 
+void clean_cpu_dcache_all(bool inner_only)
+{
+	clean_inner_dcache_all();
+
+	/* There is no outer_cache.clean_all(), see clean_cpu_dcache */
+	if (!inner_only)
+		outer_cache.flush_all();
+}
+
+void flush_cpu_dcache_all(bool inner_only)
+{
+	if (!inner_only) {
+		/* See flush_cpu_dcache */
+		if (is_cache_exclusive())
+			panic("%s can't handle exclusive CPU caches\n",
+								__func__);
+
+		clean_inner_dcache_all();
+		outer_cache.flush_all();
+	}
+
+	flush_inner_dcache_all();
+}
+
+bool cpu_dcache_all_is_faster(u32 length, bool flush, bool inner_only)
+{
+	/*
+	 * The outer cache is the expensive one to walk in its entirety so
+	 * only its breakpoint matters when it's included.
+	 */
+	if (!inner_only)
+		return length >= outer_flush_breakpoint;
+	else if (flush)
+		return length >= inner_flush_breakpoint;
+	else
+		return length >= inner_clean_breakpoint;
+}
+
 bool speculative_data_prefetch(void)
 {
 	return true;
@@ -18,6 +18,7 @@
 void *cona_create(const char *name, phys_addr_t region_paddr,
 							size_t region_size);
 void *cona_alloc(void *instance, size_t size);
+void *cona_alloc_below(void *instance, size_t size, phys_addr_t limit);
 void cona_free(void *instance, void *alloc);
 phys_addr_t cona_get_alloc_paddr(void *alloc);
 void *cona_get_alloc_kaddr(void *instance, void *alloc);
@@ -68,6 +69,7 @@ static int __init setup_hwmem(void)
 
 	hwmem_mem_types[0].id = HWMEM_MEM_SCATTERED_SYS;
 	hwmem_mem_types[0].allocator_api.alloc = cona_alloc;
+	hwmem_mem_types[0].allocator_api.alloc_below = cona_alloc_below;
 	hwmem_mem_types[0].allocator_api.free = cona_free;
 	hwmem_mem_types[0].allocator_api.get_alloc_paddr =
 							cona_get_alloc_paddr;
@@ -10,6 +10,8 @@
  */
 
 #include <linux/hwmem.h>
+#include <linux/mm.h>
+#include <linux/io.h>
 
 #include <asm/pgtable.h>
 
@@ -19,14 +21,25 @@
 
 #define U32_MAX (~(u32)0)
 
+/* clean_cpu_dcache and flush_cpu_dcache */
+typedef void (*dcache_op_t)(void *vaddr, u32 paddr, u32 length,
+					bool inner_only, bool *everything);
+
 enum hwmem_alloc_flags cachi_get_cache_settings(
 			enum hwmem_alloc_flags requested_cache_settings);
 void cachi_set_pgprot_cache_options(enum hwmem_alloc_flags cache_settings,
 							pgprot_t *pgprot);
 
+static bool set_domain(struct cach_buf *buf, enum hwmem_access access,
+			enum hwmem_domain domain, struct hwmem_region *region);
+static u32 maintenance_length(struct cach_buf *buf, enum hwmem_access access,
+			enum hwmem_domain domain, struct hwmem_region *region,
+								bool *flush);
+static void cpu_cache_maintained(struct cach_buf *buf, bool flushed);
+
 static void sync_buf_pre_cpu(struct cach_buf *buf, enum hwmem_access access,
 						struct hwmem_region *region);
-static void sync_buf_post_cpu(struct cach_buf *buf,
+static bool sync_buf_post_cpu(struct cach_buf *buf,
 	enum hwmem_access next_access, struct hwmem_region *next_region);
 
 static void invalidate_cpu_cache(struct cach_buf *buf,
@@ -35,8 +48,16 @@ static void clean_cpu_cache(struct cach_buf *buf,
 					struct cach_range *range_2b_used);
 static void flush_cpu_cache(struct cach_buf *buf,
 					struct cach_range *range_2b_used);
+static void buf_dcache_op(struct cach_buf *buf, dcache_op_t op, u32 offset,
+					u32 length, bool *everything);
+
+static void null_dirty_ranges(struct cach_buf *buf);
+static void add_dirty_range(struct cach_buf *buf, struct cach_range *range);
+static u32 dirty_length(struct cach_buf *buf, struct cach_range *range);
 
 static void null_range(struct cach_range *range);
+static bool ranges_touch(struct cach_range *range_1,
+					struct cach_range *range_2);
 static void expand_range(struct cach_range *range,
 					struct cach_range *range_2_add);
 /*
@@ -57,6 +78,8 @@ static void align_range_up(struct cach_range *range, u32 alignment);
 static u32 range_length(struct cach_range *range);
 static void region_2_range(struct hwmem_region *region, u32 buffer_size,
 						struct cach_range *range);
+static struct hwmem_region *get_region(struct cach_buf *buf,
+	struct hwmem_region *region, struct hwmem_region *full_region);
 
 static void *offset_2_vaddr(struct cach_buf *buf, u32 offset);
 static u32 offset_2_paddr(struct cach_buf *buf, u32 offset);
@@ -75,6 +98,7 @@ void cach_init_buf(struct cach_buf *buf, enum hwmem_alloc_flags cache_settings,
 	buf->vstart = NULL;
 	buf->pstart = 0;
 	buf->size = size;
+	buf->pages = NULL;
 
 	buf->cache_settings = cachi_get_cache_settings(cache_settings);
 }
@@ -95,21 +119,26 @@ void cach_set_buf_addrs(struct cach_buf *buf, void* vaddr, u32 paddr)
 		buf->range_in_cpu_cache.end = buf->size;
 		align_range_up(&buf->range_in_cpu_cache,
 						get_dcache_granularity());
-		buf->range_dirty_in_cpu_cache.start = 0;
-		buf->range_dirty_in_cpu_cache.end = buf->size;
-		align_range_up(&buf->range_dirty_in_cpu_cache,
-						get_dcache_granularity());
+		null_dirty_ranges(buf);
+		add_dirty_range(buf, &buf->range_in_cpu_cache);
 	} else {
-		flush_cpu_dcache(buf->vstart, buf->pstart, buf->size, false,
-									&tmp);
+		buf_dcache_op(buf, flush_cpu_dcache, 0, buf->size, &tmp);
 		drain_cpu_write_buf();
 
 		null_range(&buf->range_in_cpu_cache);
-		null_range(&buf->range_dirty_in_cpu_cache);
+		null_dirty_ranges(buf);
 	}
 	null_range(&buf->range_invalid_in_cpu_cache);
 }
 
+void cach_set_buf_pages(struct cach_buf *buf, void *vaddr,
+						struct page **pages)
+{
+	buf->pages = pages;
+
+	cach_set_buf_addrs(buf, vaddr, page_to_phys(pages[0]));
+}
+
 void cach_set_pgprot_cache_options(struct cach_buf *buf, pgprot_t *pgprot)
 {
 	cachi_set_pgprot_cache_options(buf->cache_settings, pgprot);
@@ -118,32 +147,47 @@ void cach_set_pgprot_cache_options(struct cach_buf *buf, pgprot_t *pgprot)
 void cach_set_domain(struct cach_buf *buf, enum hwmem_access access,
 			enum hwmem_domain domain, struct hwmem_region *region)
 {
-	struct hwmem_region *__region;
-	struct hwmem_region full_region;
-
-	if (region != NULL) {
-		__region = region;
-	} else {
-		full_region.offset = 0;
-		full_region.count = 1;
-		full_region.start = 0;
-		full_region.end = buf->size;
-		full_region.size = buf->size;
+	if (set_domain(buf, access, domain, region))
+		drain_cpu_write_buf();
+}
 
-		__region = &full_region;
+void cach_set_domain_batch(struct cach_domain_op *ops, unsigned int num_ops)
+{
+	unsigned int i;
+	u32 length = 0;
+	bool flush = false;
+	bool inner_only = true;
+	bool drain = false;
+
+	for (i = 0; i < num_ops; i++) {
+		struct cach_domain_op *op = &ops[i];
+		u32 op_length = maintenance_length(op->buf, op->access,
+					op->domain, op->region, &flush);
+
+		length = min(length, U32_MAX - op_length) + op_length;
+		if (op_length > 0 && !(op->buf->cache_settings &
+					HWMEM_ALLOC_HINT_INNER_CACHE_ONLY))
+			inner_only = false;
 	}
 
-	switch (domain) {
-	case HWMEM_DOMAIN_SYNC:
-		sync_buf_post_cpu(buf, access, __region);
+	if (length > 0 && cpu_dcache_all_is_faster(length, flush,
+								inner_only)) {
+		if (flush)
+			flush_cpu_dcache_all(inner_only);
+		else
+			clean_cpu_dcache_all(inner_only);
 
-		break;
+		for (i = 0; i < num_ops; i++)
+			cpu_cache_maintained(ops[i].buf, flush);
+	}
 
-	case HWMEM_DOMAIN_CPU:
-		sync_buf_pre_cpu(buf, access, __region);
+	/* Whatever is left to do is now below the breakpoints */
+	for (i = 0; i < num_ops; i++)
+		drain |= set_domain(ops[i].buf, ops[i].access, ops[i].domain,
+								ops[i].region);
 
-		break;
-	}
+	if (drain)
+		drain_cpu_write_buf();
 }
 
 /*
@@ -197,6 +241,91 @@ bool __attribute__((weak)) speculative_data_prefetch(void)
 	return true;
 }
 
+/* Returns true if the CPU write buffer has to be drained */
+static bool set_domain(struct cach_buf *buf, enum hwmem_access access,
+			enum hwmem_domain domain, struct hwmem_region *region)
+{
+	struct hwmem_region full_region;
+
+	region = get_region(buf, region, &full_region);
+
+	switch (domain) {
+	case HWMEM_DOMAIN_SYNC:
+		return sync_buf_post_cpu(buf, access, region);
+
+	case HWMEM_DOMAIN_CPU:
+		sync_buf_pre_cpu(buf, access, region);
+
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * Number of bytes set_domain would clean or flush by range. <flush> is set if
+ * any of it has to be flushed rather than cleaned.
+ */
+static u32 maintenance_length(struct cach_buf *buf, enum hwmem_access access,
+			enum hwmem_domain domain, struct hwmem_region *region,
+								bool *flush)
+{
+	bool write = access & HWMEM_ACCESS_WRITE;
+	bool read = access & HWMEM_ACCESS_READ;
+	struct hwmem_region full_region;
+	struct cach_range region_range;
+	struct cach_range intersection;
+
+	if (!(buf->cache_settings & HWMEM_ALLOC_HINT_CACHED) ||
+							(!write && !read))
+		return 0;
+
+	region = get_region(buf, region, &full_region);
+	region_2_range(region, buf->size, &region_range);
+
+	switch (domain) {
+	case HWMEM_DOMAIN_SYNC:
+		if (write && !speculative_data_prefetch()) {
+			intersect_range(&buf->range_in_cpu_cache,
+						&region_range, &intersection);
+			if (is_non_empty_range(&intersection))
+				*flush = true;
+
+			return range_length(&intersection);
+		}
+
+		return dirty_length(buf, &region_range);
+
+	case HWMEM_DOMAIN_CPU:
+		if (!read && !(write && buf->cache_settings &
+						HWMEM_ALLOC_HINT_CACHE_WB))
+			return 0;
+
+		intersect_range(&buf->range_invalid_in_cpu_cache,
+						&region_range, &intersection);
+		if (is_non_empty_range(&intersection))
+			*flush = true;
+
+		return range_length(&intersection);
+	}
+
+	return 0;
+}
+
+/* Updates the tracking after the entire CPU cache has been maintained */
+static void cpu_cache_maintained(struct cach_buf *buf, bool flushed)
+{
+	if (!(buf->cache_settings & HWMEM_ALLOC_HINT_CACHED))
+		return;
+
+	if (flushed) {
+		if (!speculative_data_prefetch())
+			null_range(&buf->range_in_cpu_cache);
+		null_range(&buf->range_invalid_in_cpu_cache);
+	}
+	null_dirty_ranges(buf);
+}
+
 static void sync_buf_pre_cpu(struct cach_buf *buf, enum hwmem_access access,
 						struct hwmem_region *region)
 {
@@ -227,8 +356,7 @@ static void sync_buf_pre_cpu(struct cach_buf *buf, enum hwmem_access access,
 				intersect_range(&buf->range_in_cpu_cache,
 					&region_range, &dirty_range_addition);
 
-			expand_range(&buf->range_dirty_in_cpu_cache,
-							&dirty_range_addition);
+			add_dirty_range(buf, &dirty_range_addition);
 		}
 	}
 	if (buf->cache_settings & HWMEM_ALLOC_HINT_WRITE_COMBINE) {
@@ -237,7 +365,7 @@ static void sync_buf_pre_cpu(struct cach_buf *buf, enum hwmem_access access,
 	}
 }
 
-static void sync_buf_post_cpu(struct cach_buf *buf,
+static bool sync_buf_post_cpu(struct cach_buf *buf,
 	enum hwmem_access next_access, struct hwmem_region *next_region)
 {
 	bool write = next_access & HWMEM_ACCESS_WRITE;
@@ -245,7 +373,7 @@ static void sync_buf_post_cpu(struct cach_buf *buf,
 	struct cach_range region_range;
 
 	if (!write && !read)
-		return;
+		return false;
 
 	region_2_range(next_region, buf->size, &region_range);
 
@@ -269,10 +397,12 @@ static void sync_buf_post_cpu(struct cach_buf *buf,
 		clean_cpu_cache(buf, &region_range);
 
 	if (buf->in_cpu_write_buf) {
-		drain_cpu_write_buf();
-
 		buf->in_cpu_write_buf = false;
+
+		return true;
 	}
+
+	return false;
 }
 
 static void invalidate_cpu_cache(struct cach_buf *buf, struct cach_range *range)
@@ -292,17 +422,12 @@ static void invalidate_cpu_cache(struct cach_buf *buf, struct cach_range *range)
 		 * cache so we can use flush instead which is considerably
 		 * faster for large buffers.
 		 */
-		flush_cpu_dcache(
-				offset_2_vaddr(buf, intersection.start),
-				offset_2_paddr(buf, intersection.start),
-				range_length(&intersection),
-				buf->cache_settings &
-					HWMEM_ALLOC_HINT_INNER_CACHE_ONLY,
-							&flushed_everything);
+		buf_dcache_op(buf, flush_cpu_dcache, intersection.start,
+			range_length(&intersection), &flushed_everything);
 
 		if (flushed_everything) {
 			null_range(&buf->range_invalid_in_cpu_cache);
-			null_range(&buf->range_dirty_in_cpu_cache);
+			null_dirty_ranges(buf);
 		} else {
 			/*
 			 * No need to shrink range_in_cpu_cache as invalidate
@@ -315,30 +440,31 @@ static void invalidate_cpu_cache(struct cach_buf *buf, struct cach_range *range)
 	}
 }
 
+/* Only the parts of <range> the CPU has actually written to are cleaned */
 static void clean_cpu_cache(struct cach_buf *buf, struct cach_range *range)
 {
-	struct cach_range intersection;
+	unsigned int i;
 
-	intersect_range(&buf->range_dirty_in_cpu_cache, range, &intersection);
-	if (is_non_empty_range(&intersection)) {
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++) {
+		struct cach_range *dirty = &buf->range_dirty_in_cpu_cache[i];
+		struct cach_range intersection;
 		bool cleaned_everything;
 
-		expand_range_2_edge(&intersection,
-					&buf->range_dirty_in_cpu_cache);
-
-		clean_cpu_dcache(
-				offset_2_vaddr(buf, intersection.start),
-				offset_2_paddr(buf, intersection.start),
-				range_length(&intersection),
-				buf->cache_settings &
-					HWMEM_ALLOC_HINT_INNER_CACHE_ONLY,
-							&cleaned_everything);
-
-		if (cleaned_everything)
-			null_range(&buf->range_dirty_in_cpu_cache);
-		else
-			shrink_range(&buf->range_dirty_in_cpu_cache,
-								&intersection);
+		intersect_range(dirty, range, &intersection);
+		if (!is_non_empty_range(&intersection))
+			continue;
+
+		expand_range_2_edge(&intersection, dirty);
+
+		buf_dcache_op(buf, clean_cpu_dcache, intersection.start,
+			range_length(&intersection), &cleaned_everything);
+
+		if (cleaned_everything) {
+			null_dirty_ranges(buf);
+			break;
+		}
+
+		shrink_range(dirty, &intersection);
 	}
 }
 
@@ -352,24 +478,27 @@ static void flush_cpu_cache(struct cach_buf *buf, struct cach_range *range)
 
 		expand_range_2_edge(&intersection, &buf->range_in_cpu_cache);
 
-		flush_cpu_dcache(
-				offset_2_vaddr(buf, intersection.start),
-				offset_2_paddr(buf, intersection.start),
-				range_length(&intersection),
-				buf->cache_settings &
-					HWMEM_ALLOC_HINT_INNER_CACHE_ONLY,
-							&flushed_everything);
+		buf_dcache_op(buf, flush_cpu_dcache, intersection.start,
+			range_length(&intersection), &flushed_everything);
 
 		if (flushed_everything) {
 			if (!speculative_data_prefetch())
 				null_range(&buf->range_in_cpu_cache);
-			null_range(&buf->range_dirty_in_cpu_cache);
+			null_dirty_ranges(buf);
 			null_range(&buf->range_invalid_in_cpu_cache);
 		} else {
+			unsigned int i;
+
 			if (!speculative_data_prefetch())
 				shrink_range(&buf->range_in_cpu_cache,
 							 &intersection);
-			shrink_range(&buf->range_dirty_in_cpu_cache,
+			/*
+			 * The dirty ranges lie inside range_in_cpu_cache and
+			 * intersection reaches one of its edges so this never
+			 * splits a dirty range.
+			 */
+			for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++)
+				shrink_range(&buf->range_dirty_in_cpu_cache[i],
 								&intersection);
 			shrink_range(&buf->range_invalid_in_cpu_cache,
 								&intersection);
@@ -377,12 +506,134 @@ static void flush_cpu_cache(struct cach_buf *buf, struct cach_range *range)
 	}
 }
 
+/*
+ * The inner cache is maintained on virtual addresses but the outer cache on
+ * physical ones so buffers made up of pages have to be maintained one
+ * physically contiguous run at a time.
+ */
+static void buf_dcache_op(struct cach_buf *buf, dcache_op_t op, u32 offset,
+					u32 length, bool *everything)
+{
+	bool inner_only = buf->cache_settings &
+					HWMEM_ALLOC_HINT_INNER_CACHE_ONLY;
+	bool flush = op == flush_cpu_dcache;
+	u32 end = offset + length;
+
+	if (buf->pages == NULL) {
+		op(offset_2_vaddr(buf, offset), offset_2_paddr(buf, offset),
+					length, inner_only, everything);
+		return;
+	}
+
+	/* Don't let lots of small runs add up to more than a full op */
+	if (cpu_dcache_all_is_faster(length, flush, inner_only)) {
+		if (flush)
+			flush_cpu_dcache_all(inner_only);
+		else
+			clean_cpu_dcache_all(inner_only);
+		*everything = true;
+		return;
+	}
+
+	*everything = false;
+	while (offset < end && !*everything) {
+		u32 paddr = offset_2_paddr(buf, offset);
+		u32 run_end = min_t(u32, end, (offset & PAGE_MASK) +
+								PAGE_SIZE);
+
+		while (run_end < end && offset_2_paddr(buf, run_end) ==
+						paddr + (run_end - offset))
+			run_end = min_t(u32, end, run_end + PAGE_SIZE);
+
+		op(offset_2_vaddr(buf, offset), paddr, run_end - offset,
+						inner_only, everything);
+
+		offset = run_end;
+	}
+}
+
+static void null_dirty_ranges(struct cach_buf *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++)
+		null_range(&buf->range_dirty_in_cpu_cache[i]);
+}
+
+static void add_dirty_range(struct cach_buf *buf, struct cach_range *range)
+{
+	struct cach_range *dirty = buf->range_dirty_in_cpu_cache;
+	struct cach_range new_range = *range;
+	unsigned int i;
+	unsigned int closest = 0;
+	u32 closest_gap = U32_MAX;
+
+	if (!is_non_empty_range(range))
+		return;
+
+	/* Absorb all ranges the new one overlaps or touches */
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++) {
+		if (is_non_empty_range(&dirty[i]) &&
+					ranges_touch(&dirty[i], &new_range)) {
+			expand_range(&new_range, &dirty[i]);
+			null_range(&dirty[i]);
+		}
+	}
+
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++) {
+		if (!is_non_empty_range(&dirty[i])) {
+			dirty[i] = new_range;
+			return;
+		}
+	}
+
+	/* No free entry, merge with the closest range */
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++) {
+		u32 gap;
+
+		if (dirty[i].end < new_range.start)
+			gap = new_range.start - dirty[i].end;
+		else
+			gap = dirty[i].start - new_range.end;
+
+		if (gap < closest_gap) {
+			closest = i;
+			closest_gap = gap;
+		}
+	}
+
+	expand_range(&dirty[closest], &new_range);
+}
+
+static u32 dirty_length(struct cach_buf *buf, struct cach_range *range)
+{
+	unsigned int i;
+	u32 length = 0;
+
+	for (i = 0; i < CACH_MAX_DIRTY_RANGES; i++) {
+		struct cach_range intersection;
+
+		intersect_range(&buf->range_dirty_in_cpu_cache[i], range,
+								&intersection);
+		length += range_length(&intersection);
+	}
+
+	return length;
+}
+
 static void null_range(struct cach_range *range)
 {
 	range->start = U32_MAX;
 	range->end = 0;
 }
 
+static bool ranges_touch(struct cach_range *range_1,
+					struct cach_range *range_2)
+{
+	return range_1->start <= range_2->end &&
+					range_2->start <= range_1->end;
+}
+
 static void expand_range(struct cach_range *range,
 						struct cach_range *range_2_add)
 {
@@ -473,6 +724,22 @@ static void region_2_range(struct hwmem_region *region, u32 buffer_size,
 	align_range_up(range, get_dcache_granularity());
 }
 
+/* NULL means the entire buffer, <full_region> is used to describe it */
+static struct hwmem_region *get_region(struct cach_buf *buf,
+	struct hwmem_region *region, struct hwmem_region *full_region)
+{
+	if (region != NULL)
+		return region;
+
+	full_region->offset = 0;
+	full_region->count = 1;
+	full_region->start = 0;
+	full_region->end = buf->size;
+	full_region->size = buf->size;
+
+	return full_region;
+}
+
 static void *offset_2_vaddr(struct cach_buf *buf, u32 offset)
 {
 	return (void *)((u32)buf->vstart + offset);
@@ -480,6 +747,10 @@ static void *offset_2_vaddr(struct cach_buf *buf, u32 offset)
 
 static u32 offset_2_paddr(struct cach_buf *buf, u32 offset)
 {
+	if (buf->pages != NULL)
+		return page_to_phys(buf->pages[offset >> PAGE_SHIFT]) +
+						(offset & ~PAGE_MASK);
+
 	return buf->pstart + offset;
 }
 
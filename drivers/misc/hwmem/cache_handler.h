@@ -26,6 +26,12 @@
  * datatypes.
  */
 
+/*
+ * Number of separate ranges a buffer's dirty data in the CPU cache is
+ * tracked as. When more are needed the closest ones are merged.
+ */
+#define CACH_MAX_DIRTY_RANGES 4
+
 struct cach_range {
 	u32 start; /* Inclusive */
 	u32 end; /* Exclusive */
@@ -38,24 +44,45 @@ struct cach_buf {
 	void *vstart;
 	u32 pstart;
 	u32 size;
+	/* NULL if the buffer is physically contiguous */
+	struct page **pages;
 
 	/* Remaining hints are active */
 	enum hwmem_alloc_flags cache_settings;
 
 	bool in_cpu_write_buf;
 	struct cach_range range_in_cpu_cache;
-	struct cach_range range_dirty_in_cpu_cache;
+	/* Disjoint, in no particular order, unused entries are null ranges */
+	struct cach_range range_dirty_in_cpu_cache[CACH_MAX_DIRTY_RANGES];
 	struct cach_range range_invalid_in_cpu_cache;
 };
 
+struct cach_domain_op {
+	struct cach_buf *buf;
+	enum hwmem_access access;
+	enum hwmem_domain domain;
+	struct hwmem_region *region;
+};
+
 void cach_init_buf(struct cach_buf *buf,
 			enum hwmem_alloc_flags cache_settings, u32 size);
 
 void cach_set_buf_addrs(struct cach_buf *buf, void* vaddr, u32 paddr);
 
+/* For buffers made up of individual pages, <vaddr> must be contiguous */
+void cach_set_buf_pages(struct cach_buf *buf, void *vaddr,
+						struct page **pages);
+
 void cach_set_pgprot_cache_options(struct cach_buf *buf, pgprot_t *pgprot);
 
 void cach_set_domain(struct cach_buf *buf, enum hwmem_access access,
 			enum hwmem_domain domain, struct hwmem_region *region);
 
+/*
+ * Same as calling cach_set_domain for each op except that the cache is
+ * maintained in its entirety, once, if the ops combined cover enough memory
+ * for that to be faster, and the CPU write buffer is drained only once.
+ */
+void cach_set_domain_batch(struct cach_domain_op *ops, unsigned int num_ops);
+
 #endif /* _CACHE_HANDLER_H_ */
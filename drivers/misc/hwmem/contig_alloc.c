@@ -12,6 +12,8 @@
 #include <linux/kernel.h>
 #include <linux/err.h>
 #include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/rbtree.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
 #include <linux/debugfs.h>
@@ -24,6 +26,8 @@
 
 struct alloc {
 	struct list_head list;
+	/* Only valid when !in_use, free allocs are indexed by size */
+	struct rb_node free_node;
 
 	bool in_use;
 	phys_addr_t paddr;
@@ -39,7 +43,10 @@ struct instance {
 	void *region_kaddr;
 	size_t region_size;
 
+	/* All allocs, used and free, sorted on address */
 	struct list_head alloc_list;
+	/* Free allocs sorted on size and then address */
+	struct rb_root free_tree;
 
 #ifdef CONFIG_DEBUG_FS
 	struct inode *debugfs_inode;
@@ -48,6 +55,7 @@ struct instance {
 	int cona_status_max_cont;
 	int cona_status_max_check;
 	int cona_status_biggest_free;
+	int cona_status_free_blocks;
 	int cona_status_printed;
 #endif /* #ifdef CONFIG_DEBUG_FS */
 };
@@ -59,6 +67,7 @@ static DEFINE_MUTEX(lock);
 void *cona_create(const char *name, phys_addr_t region_paddr,
 							size_t region_size);
 void *cona_alloc(void *instance, size_t size);
+void *cona_alloc_below(void *instance, size_t size, phys_addr_t limit);
 void cona_free(void *instance, void *alloc);
 phys_addr_t cona_get_alloc_paddr(void *alloc);
 void *cona_get_alloc_kaddr(void *instance, void *alloc);
@@ -66,10 +75,16 @@ size_t cona_get_alloc_size(void *alloc);
 
 static int init_alloc_list(struct instance *instance);
 static void clean_alloc_list(struct instance *instance);
+static void insert_free_alloc(struct instance *instance,
+							struct alloc *alloc);
+static void remove_free_alloc(struct instance *instance,
+							struct alloc *alloc);
 static struct alloc *find_free_alloc_bestfit(struct instance *instance,
 								size_t size);
-static struct alloc *split_allocation(struct alloc *alloc,
-							size_t new_alloc_size);
+static struct alloc *find_free_alloc_lowest(struct instance *instance,
+					size_t size, phys_addr_t limit);
+static struct alloc *take_allocation(struct instance *instance,
+					struct alloc *alloc, size_t size);
 static phys_addr_t get_alloc_offset(struct instance *instance,
 							struct alloc *alloc);
 
@@ -103,6 +118,7 @@ void *cona_create(const char *name, phys_addr_t region_paddr,
 	instance->region_kaddr = vm_area->addr;
 
 	INIT_LIST_HEAD(&instance->alloc_list);
+	instance->free_tree = RB_ROOT;
 	ret = init_alloc_list(instance);
 	if (ret < 0)
 		goto init_alloc_list_failed;
@@ -139,19 +155,33 @@ void *cona_alloc(void *instance, size_t size)
 	alloc = find_free_alloc_bestfit(instance_l, size);
 	if (IS_ERR(alloc))
 		goto out;
-	if (size < alloc->size) {
-		alloc = split_allocation(alloc, size);
-		if (IS_ERR(alloc))
-			goto out;
-	} else {
-		alloc->in_use = true;
-	}
-#ifdef CONFIG_DEBUG_FS
-	instance_l->cona_status_max_cont += alloc->size;
-	instance_l->cona_status_max_check =
-					max(instance_l->cona_status_max_check,
-					instance_l->cona_status_max_cont);
-#endif /* #ifdef CONFIG_DEBUG_FS */
+	alloc = take_allocation(instance_l, alloc, size);
+
+out:
+	mutex_unlock(&lock);
+
+	return alloc;
+}
+
+/*
+ * Allocates the lowest addressed block of <size> bytes that ends at or below
+ * <limit>. Used by hwmem to slide movable allocs towards the start of the
+ * region and thereby merge the holes between them.
+ */
+void *cona_alloc_below(void *instance, size_t size, phys_addr_t limit)
+{
+	struct instance *instance_l = (struct instance *)instance;
+	struct alloc *alloc;
+
+	if (size == 0)
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&lock);
+
+	alloc = find_free_alloc_lowest(instance_l, size, limit);
+	if (IS_ERR(alloc))
+		goto out;
+	alloc = take_allocation(instance_l, alloc, size);
 
 out:
 	mutex_unlock(&lock);
@@ -176,6 +206,7 @@ void cona_free(void *instance, void *alloc)
 	other = list_entry(alloc_l->list.prev, struct alloc, list);
 	if ((alloc_l->list.prev != &instance_l->alloc_list) &&
 							!other->in_use) {
+		remove_free_alloc(instance_l, other);
 		other->size += alloc_l->size;
 		list_del(&alloc_l->list);
 		kfree(alloc_l);
@@ -184,10 +215,12 @@ void cona_free(void *instance, void *alloc)
 	other = list_entry(alloc_l->list.next, struct alloc, list);
 	if ((alloc_l->list.next != &instance_l->alloc_list) &&
 							!other->in_use) {
+		remove_free_alloc(instance_l, other);
 		alloc_l->size += other->size;
 		list_del(&other->list);
 		kfree(other);
 	}
+	insert_free_alloc(instance_l, alloc_l);
 
 	mutex_unlock(&lock);
 }
@@ -239,6 +272,7 @@ static int init_alloc_list(struct instance *instance)
 								PAGE_SIZE;
 			alloc->in_use = false;
 			list_add_tail(&alloc->list, &instance->alloc_list);
+			insert_free_alloc(instance, alloc);
 			curr_pos = alloc->paddr + alloc->size;
 		}
 
@@ -269,6 +303,7 @@ static int init_alloc_list(struct instance *instance)
 	alloc->size = region_end - curr_pos;
 	alloc->in_use = false;
 	list_add_tail(&alloc->list, &instance->alloc_list);
+	insert_free_alloc(instance, alloc);
 
 	return 0;
 
@@ -288,45 +323,108 @@ static void clean_alloc_list(struct instance *instance)
 
 		kfree(i);
 	}
+	instance->free_tree = RB_ROOT;
 }
 
+static void insert_free_alloc(struct instance *instance, struct alloc *alloc)
+{
+	struct rb_node **new = &instance->free_tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*new) {
+		struct alloc *i = rb_entry(*new, struct alloc, free_node);
+
+		parent = *new;
+		if (alloc->size < i->size || (alloc->size == i->size &&
+						alloc->paddr < i->paddr))
+			new = &(*new)->rb_left;
+		else
+			new = &(*new)->rb_right;
+	}
+
+	rb_link_node(&alloc->free_node, parent, new);
+	rb_insert_color(&alloc->free_node, &instance->free_tree);
+}
+
+static void remove_free_alloc(struct instance *instance, struct alloc *alloc)
+{
+	rb_erase(&alloc->free_node, &instance->free_tree);
+}
+
+/* Smallest free alloc that fits, lowest address among equals */
 static struct alloc *find_free_alloc_bestfit(struct instance *instance,
 								size_t size)
 {
-	size_t best_diff = ~(size_t)0;
-	struct alloc *alloc = NULL, *i;
+	struct rb_node *node = instance->free_tree.rb_node;
+	struct alloc *alloc = NULL;
 
-	list_for_each_entry(i, &instance->alloc_list, list) {
-		size_t diff = i->size - size;
-		if (i->in_use || i->size < size)
-			continue;
-		if (diff < best_diff) {
+	while (node) {
+		struct alloc *i = rb_entry(node, struct alloc, free_node);
+
+		if (i->size >= size) {
 			alloc = i;
-			best_diff = diff;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
 		}
 	}
 
 	return alloc != NULL ? alloc : ERR_PTR(-ENOMEM);
 }
 
-static struct alloc *split_allocation(struct alloc *alloc,
-							size_t new_alloc_size)
+static struct alloc *find_free_alloc_lowest(struct instance *instance,
+					size_t size, phys_addr_t limit)
+{
+	struct alloc *i;
+
+	list_for_each_entry(i, &instance->alloc_list, list) {
+		if (i->paddr + size > limit)
+			break;
+		if (!i->in_use && i->size >= size)
+			return i;
+	}
+
+	return ERR_PTR(-ENOMEM);
+}
+
+/*
+ * Marks the first <size> bytes of the free alloc as used, splitting off the
+ * remainder as a new free alloc if necessary.
+ */
+static struct alloc *take_allocation(struct instance *instance,
+					struct alloc *alloc, size_t size)
 {
 	struct alloc *new_alloc;
 
-	new_alloc = kzalloc(sizeof(struct alloc), GFP_KERNEL);
-	if (new_alloc == NULL)
-		return ERR_PTR(-ENOMEM);
+	if (size < alloc->size) {
+		new_alloc = kzalloc(sizeof(struct alloc), GFP_KERNEL);
+		if (new_alloc == NULL)
+			return ERR_PTR(-ENOMEM);
 
-	new_alloc->in_use = true;
-	new_alloc->paddr = alloc->paddr;
-	new_alloc->size = new_alloc_size;
-	alloc->size -= new_alloc_size;
-	alloc->paddr += new_alloc_size;
+		remove_free_alloc(instance, alloc);
+
+		new_alloc->in_use = true;
+		new_alloc->paddr = alloc->paddr;
+		new_alloc->size = size;
+		alloc->size -= size;
+		alloc->paddr += size;
+
+		list_add_tail(&new_alloc->list, &alloc->list);
+		insert_free_alloc(instance, alloc);
+
+		alloc = new_alloc;
+	} else {
+		remove_free_alloc(instance, alloc);
+		alloc->in_use = true;
+	}
 
-	list_add_tail(&new_alloc->list, &alloc->list);
+#ifdef CONFIG_DEBUG_FS
+	instance->cona_status_max_cont += alloc->size;
+	instance->cona_status_max_check = max(instance->cona_status_max_check,
+					instance->cona_status_max_cont);
+#endif /* #ifdef CONFIG_DEBUG_FS */
 
-	return new_alloc;
+	return alloc;
 }
 
 static phys_addr_t get_alloc_offset(struct instance *instance,
@@ -370,6 +468,7 @@ static int print_alloc(struct instance *instance, struct alloc *alloc,
 				instance->cona_status_used += alloc->size;
 			} else {
 				instance->cona_status_free += alloc->size;
+				instance->cona_status_free_blocks++;
 			}
 		}
 
@@ -406,6 +505,16 @@ static int print_alloc_status(struct instance *instance, char **buf,
 {
 	int ret;
 	int i;
+	/*
+	 * Share of the free memory that can not be handed out as one
+	 * allocation, 0% means all free memory is contiguous.
+	 */
+	int fragmentation = 0;
+
+	if (instance->cona_status_free > 0)
+		fragmentation = 100 - (int)div_u64(
+				(u64)instance->cona_status_biggest_free * 100,
+				instance->cona_status_free);
 
 	for (i = 0; i < 2; i++) {
 		size_t buf_size_l;
@@ -416,13 +525,17 @@ static int print_alloc_status(struct instance *instance, char **buf,
 
 		ret = snprintf(*buf, buf_size_l, "Overall peak usage:\t%10u "
 				"(%dMB)\nCurrent max usage:\t%10u (%dMB)\n"
-				"Current biggest free:\t%10d (%dMB)\n",
+				"Current biggest free:\t%10d (%dMB)\n"
+				"Free blocks:\t\t%10d\n"
+				"Fragmentation:\t\t%10d%%\n",
 				instance->cona_status_max_check,
 				instance->cona_status_max_check/1024/1024,
 				instance->cona_status_max_cont,
 				instance->cona_status_max_cont/1024/1024,
 				instance->cona_status_biggest_free,
-				instance->cona_status_biggest_free/1024/1024);
+				instance->cona_status_biggest_free/1024/1024,
+				instance->cona_status_free_blocks,
+				fragmentation);
 
 		if (ret < 0)
 			return -ENOMSG;
@@ -523,6 +636,7 @@ static int debugfs_allocs_read(struct file *file, char __user *buf,
 		instance->cona_status_free = 0;
 		instance->cona_status_used = 0;
 		instance->cona_status_biggest_free = 0;
+		instance->cona_status_free_blocks = 0;
 	}
 
 	bytes_read = (size_t)(local_buf_pos - local_buf);
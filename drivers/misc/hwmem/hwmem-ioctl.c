@@ -20,12 +20,14 @@
 #include <linux/hwmem.h>
 #include <linux/device.h>
 #include <linux/sched.h>
+#include <linux/poll.h>
 
 static int hwmem_open(struct inode *inode, struct file *file);
 static int hwmem_ioctl_mmap(struct file *file, struct vm_area_struct *vma);
 static int hwmem_release_fop(struct inode *inode, struct file *file);
 static long hwmem_ioctl(struct file *file, unsigned int cmd,
 	unsigned long arg);
+static unsigned int hwmem_poll(struct file *file, poll_table *wait);
 static unsigned long hwmem_get_unmapped_area(struct file *file,
 	unsigned long addr, unsigned long len, unsigned long pgoff,
 	unsigned long flags);
@@ -34,6 +36,7 @@ static const struct file_operations hwmem_fops = {
 	.open = hwmem_open,
 	.mmap = hwmem_ioctl_mmap,
 	.unlocked_ioctl = hwmem_ioctl,
+	.poll = hwmem_poll,
 	.release = hwmem_release_fop,
 	.get_unmapped_area = hwmem_get_unmapped_area,
 };
@@ -48,8 +51,41 @@ struct hwmem_file {
 	struct mutex lock;
 	struct idr idr; /* id -> struct hwmem_alloc*, ref counted */
 	struct hwmem_alloc *fd_alloc; /* Ref counted */
+	struct list_head pins; /* struct hwmem_file_pin */
 };
 
+/*
+ * Pins made through this file, so that it can only undo its own pins and
+ * they are dropped when the id is released or the file closed.
+ */
+struct hwmem_file_pin {
+	struct list_head list;
+	s32 id;
+	struct hwmem_alloc *alloc;
+	unsigned int cnt;
+};
+
+static struct hwmem_file_pin *find_pin(struct hwmem_file *hwfile, s32 id)
+{
+	struct hwmem_file_pin *fpin;
+
+	list_for_each_entry(fpin, &hwfile->pins, list) {
+		if (fpin->id == id)
+			return fpin;
+	}
+
+	return NULL;
+}
+
+static void drop_pins(struct hwmem_file_pin *fpin)
+{
+	while (fpin->cnt-- > 0)
+		hwmem_unpin(fpin->alloc);
+
+	list_del(&fpin->list);
+	kfree(fpin);
+}
+
 static s32 create_id(struct hwmem_file *hwfile, struct hwmem_alloc *alloc)
 {
 	int id, ret;
@@ -132,6 +168,7 @@ static int alloc_fd(struct hwmem_file *hwfile, struct hwmem_alloc_request *req)
 static int release(struct hwmem_file *hwfile, s32 id)
 {
 	struct hwmem_alloc *alloc;
+	struct hwmem_file_pin *fpin;
 
 	if (id == 0)
 		return -EINVAL;
@@ -140,6 +177,10 @@ static int release(struct hwmem_file *hwfile, s32 id)
 	if (IS_ERR(alloc))
 		return PTR_ERR(alloc);
 
+	fpin = find_pin(hwfile, id);
+	if (fpin != NULL)
+		drop_pins(fpin);
+
 	remove_id(hwfile, id);
 	hwmem_release(alloc);
 
@@ -176,7 +217,7 @@ static int pin(struct hwmem_file *hwfile, struct hwmem_pin_request *req)
 {
 	int ret;
 	struct hwmem_alloc *alloc;
-	enum hwmem_mem_type mem_type;
+	struct hwmem_file_pin *fpin;
 	struct hwmem_mem_chunk mem_chunk;
 	size_t mem_chunk_length = 1;
 
@@ -184,13 +225,25 @@ static int pin(struct hwmem_file *hwfile, struct hwmem_pin_request *req)
 	if (IS_ERR(alloc))
 		return PTR_ERR(alloc);
 
-	hwmem_get_info(alloc, NULL, &mem_type, NULL);
-	if (mem_type != HWMEM_MEM_CONTIGUOUS_SYS)
-		return -EINVAL;
+	fpin = find_pin(hwfile, req->id);
+	if (fpin == NULL) {
+		fpin = kzalloc(sizeof(*fpin), GFP_KERNEL);
+		if (fpin == NULL)
+			return -ENOMEM;
+
+		fpin->id = req->id;
+		fpin->alloc = alloc;
+		list_add_tail(&fpin->list, &hwfile->pins);
+	}
 
 	ret = hwmem_pin(alloc, &mem_chunk, &mem_chunk_length);
-	if (ret < 0)
+	if (ret < 0) {
+		if (fpin->cnt == 0)
+			drop_pins(fpin);
 		return ret;
+	}
+
+	fpin->cnt++;
 
 	req->phys_addr = mem_chunk.paddr;
 
@@ -200,12 +253,20 @@ static int pin(struct hwmem_file *hwfile, struct hwmem_pin_request *req)
 static int unpin(struct hwmem_file *hwfile, s32 id)
 {
 	struct hwmem_alloc *alloc;
+	struct hwmem_file_pin *fpin;
 
 	alloc = resolve_id(hwfile, id);
 	if (IS_ERR(alloc))
 		return PTR_ERR(alloc);
 
+	/* Unpins without a matching pin used to be no-ops, keep ignoring them */
+	fpin = find_pin(hwfile, id);
+	if (fpin == NULL)
+		return 0;
+
 	hwmem_unpin(alloc);
+	if (--fpin->cnt == 0)
+		drop_pins(fpin);
 
 	return 0;
 }
@@ -335,6 +396,7 @@ static int hwmem_open(struct inode *inode, struct file *file)
 
 	idr_init(&hwfile->idr);
 	mutex_init(&hwfile->lock);
+	INIT_LIST_HEAD(&hwfile->pins);
 	file->private_data = hwfile;
 
 	return 0;
@@ -372,6 +434,11 @@ static int hwmem_release_idr_for_each_wrapper(int id, void *ptr, void *data)
 static int hwmem_release_fop(struct inode *inode, struct file *file)
 {
 	struct hwmem_file *hwfile = (struct hwmem_file *)file->private_data;
+	struct hwmem_file_pin *fpin;
+	struct hwmem_file_pin *tmp;
+
+	list_for_each_entry_safe(fpin, tmp, &hwfile->pins, list)
+		drop_pins(fpin);
 
 	idr_for_each(&hwfile->idr, hwmem_release_idr_for_each_wrapper, NULL);
 	idr_remove_all(&hwfile->idr);
@@ -493,6 +560,23 @@ static long hwmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	return ret;
 }
 
+static unsigned int hwmem_poll(struct file *file, poll_table *wait)
+{
+	unsigned int ret;
+	struct hwmem_file *hwfile = (struct hwmem_file *)file->private_data;
+
+	mutex_lock(&hwfile->lock);
+
+	if (hwfile->fd_alloc)
+		ret = hwmem_fence_poll(hwfile->fd_alloc, file, wait);
+	else
+		ret = POLLERR;
+
+	mutex_unlock(&hwfile->lock);
+
+	return ret;
+}
+
 static unsigned long hwmem_get_unmapped_area(struct file *file,
 	unsigned long addr, unsigned long len, unsigned long pgoff,
 	unsigned long flags)
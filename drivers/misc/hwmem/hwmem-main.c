@@ -28,10 +28,17 @@
 #include <linux/io.h>
 #include <linux/kallsyms.h>
 #include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include "cache_handler.h"
 
 #define S32_MAX 2147483647
 
+#define POOL_BUCKET_BITS 4
+
 struct hwmem_alloc_threadg_info {
 	struct list_head list;
 
@@ -49,11 +56,38 @@ struct hwmem_alloc {
 	struct hwmem_mem_type_struct *mem_type;
 
 	void *allocator_hndl;
+	/* Scattered allocs are made up of pages instead of allocator memory */
+	struct page **pages;
+	unsigned int num_pages;
 	phys_addr_t paddr;
 	void *kaddr;
 	size_t size;
 	s32 name;
 
+	/* Pinned, kmapped or mmapped allocs must stay where they are */
+	int pin_cnt;
+	atomic_t mmap_cnt;
+
+	/* Compaction, see compact_allocs() */
+	bool moving;
+	unsigned int compact_gen;
+
+	/*
+	 * Hardware operations in flight, signalled from drivers' completion
+	 * handlers so fence_lock must be taken with interrupts disabled.
+	 */
+	spinlock_t fence_lock;
+	unsigned int pending_reads;
+	unsigned int pending_writes;
+	wait_queue_head_t fence_wq;
+	/* Released with operations in flight, waits on busy_list */
+	bool released_busy;
+
+	/* Buffer pool, only valid while the alloc is in the pool */
+	struct list_head pool_lru;
+	bool pool_clean;
+	bool pool_clearing; /* Being cleared by pool_clear_work, leave alone */
+
 	/* Access control */
 	enum hwmem_access default_access;
 	struct list_head threadg_info_list;
@@ -74,6 +108,41 @@ static LIST_HEAD(alloc_list);
 static DEFINE_IDR(global_idr);
 static DEFINE_MUTEX(lock);
 
+/*
+ * Released buffers that were never given a global name are kept in a pool,
+ * hashed on size, so that the next allocation of the same size and flags can
+ * skip the allocator and the kernel mapping. Pooled buffers are cleared by
+ * pool_clear_work before they are handed out again. The pool is capped by
+ * pool_max_size; the shrinker only gives back buffers made up of system
+ * pages, as freeing contiguous memory does not help system memory pressure.
+ *
+ * Buffers released while the hardware still accesses them wait on busy_list
+ * until their last fence is signalled, and are only then pooled or freed.
+ */
+static struct list_head pool_buckets[1 << POOL_BUCKET_BITS];
+static LIST_HEAD(pool_lru);
+static size_t pool_size;
+static unsigned int pool_count;
+static unsigned int pool_pages; /* System pages held by pooled buffers */
+static LIST_HEAD(busy_list);
+
+static unsigned int pool_max_size = 32 * 1024 * 1024;
+module_param(pool_max_size, uint, 0644);
+MODULE_PARM_DESC(pool_max_size, "Max bytes of released buffers kept for reuse");
+
+static void pool_clear_work_func(struct work_struct *work);
+static DECLARE_WORK(pool_clear_work, pool_clear_work_func);
+
+/* Serializes compaction passes, taken before lock */
+static DEFINE_MUTEX(compact_lock);
+static unsigned int compact_gen;
+static DECLARE_WAIT_QUEUE_HEAD(move_wq);
+
+/* Used if the integration doesn't provide any scattered memory */
+static struct hwmem_mem_type_struct scattered_sys_mem_type = {
+	.id = HWMEM_MEM_SCATTERED_SYS,
+};
+
 static void vm_open(struct vm_area_struct *vma);
 static void vm_close(struct vm_area_struct *vma);
 static struct vm_operations_struct vm_ops = {
@@ -82,6 +151,8 @@ static struct vm_operations_struct vm_ops = {
 };
 
 static void kunmap_alloc(struct hwmem_alloc *alloc);
+static bool fence_idle(struct hwmem_alloc *alloc, enum hwmem_access access);
+static void release_alloc(struct hwmem_alloc *alloc);
 
 /* Helpers */
 
@@ -139,6 +210,84 @@ static void clear_alloc_mem(struct hwmem_alloc *alloc)
 	memset(alloc->kaddr, 0, alloc->size);
 }
 
+static int alloc_page_list(struct hwmem_alloc *alloc, size_t size)
+{
+	unsigned int i;
+
+	alloc->num_pages = size >> PAGE_SHIFT;
+	alloc->pages = kzalloc(sizeof(struct page *) * alloc->num_pages,
+							GFP_KERNEL);
+	if (alloc->pages == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < alloc->num_pages; i++) {
+		alloc->pages[i] = alloc_page(GFP_HIGHUSER | __GFP_NOWARN);
+		if (alloc->pages[i] == NULL)
+			return -ENOMEM;
+	}
+
+	alloc->paddr = page_to_phys(alloc->pages[0]);
+	alloc->size = size;
+
+	return 0;
+}
+
+static void free_page_list(struct hwmem_alloc *alloc)
+{
+	unsigned int i;
+
+	if (alloc->pages == NULL)
+		return;
+
+	for (i = 0; i < alloc->num_pages; i++) {
+		if (alloc->pages[i] != NULL)
+			__free_page(alloc->pages[i]);
+	}
+
+	kfree(alloc->pages);
+	alloc->pages = NULL;
+	alloc->num_pages = 0;
+}
+
+/*
+ * Fills in at most <mem_chunks_length> mem chunks and returns how many are
+ * needed to describe the entire alloc.
+ */
+static u32 get_mem_chunks(struct hwmem_alloc *alloc,
+		struct hwmem_mem_chunk *mem_chunks, u32 mem_chunks_length)
+{
+	unsigned int i;
+	u32 num_chunks = 0;
+
+	if (alloc->pages == NULL) {
+		if (mem_chunks_length >= 1) {
+			mem_chunks[0].paddr = alloc->paddr;
+			mem_chunks[0].size = alloc->size;
+		}
+
+		return 1;
+	}
+
+	for (i = 0; i < alloc->num_pages; i++) {
+		phys_addr_t paddr = page_to_phys(alloc->pages[i]);
+
+		if (i > 0 && page_to_phys(alloc->pages[i - 1]) + PAGE_SIZE ==
+								paddr) {
+			if (num_chunks <= mem_chunks_length)
+				mem_chunks[num_chunks - 1].size += PAGE_SIZE;
+			continue;
+		}
+
+		if (num_chunks < mem_chunks_length) {
+			mem_chunks[num_chunks].paddr = paddr;
+			mem_chunks[num_chunks].size = PAGE_SIZE;
+		}
+		num_chunks++;
+	}
+
+	return num_chunks;
+}
+
 static void destroy_alloc(struct hwmem_alloc *alloc)
 {
 	list_del(&alloc->list);
@@ -152,6 +301,8 @@ static void destroy_alloc(struct hwmem_alloc *alloc)
 
 	kunmap_alloc(alloc);
 
+	free_page_list(alloc);
+
 	if (!IS_ERR_OR_NULL(alloc->allocator_hndl))
 		alloc->mem_type->allocator_api.free(
 					alloc->mem_type->allocator_instance,
@@ -166,14 +317,21 @@ static int kmap_alloc(struct hwmem_alloc *alloc)
 	pgprot_t pgprot;
 	void *alloc_kaddr;
 
+	pgprot = PAGE_KERNEL;
+	cach_set_pgprot_cache_options(&alloc->cach_buf, &pgprot);
+
+	if (alloc->pages != NULL) {
+		alloc->kaddr = vmap(alloc->pages, alloc->num_pages, VM_MAP,
+									pgprot);
+
+		return alloc->kaddr != NULL ? 0 : -ENOMEM;
+	}
+
 	alloc_kaddr = alloc->mem_type->allocator_api.get_alloc_kaddr(
 		alloc->mem_type->allocator_instance, alloc->allocator_hndl);
 	if (IS_ERR(alloc_kaddr))
 		return PTR_ERR(alloc_kaddr);
 
-	pgprot = PAGE_KERNEL;
-	cach_set_pgprot_cache_options(&alloc->cach_buf, &pgprot);
-
 	ret = ioremap_page_range((unsigned long)alloc_kaddr,
 		(unsigned long)alloc_kaddr + alloc->size, alloc->paddr, pgprot);
 	if (ret < 0) {
@@ -192,11 +350,381 @@ static void kunmap_alloc(struct hwmem_alloc *alloc)
 	if (alloc->kaddr == NULL)
 		return;
 
-	unmap_kernel_range((unsigned long)alloc->kaddr, alloc->size);
+	if (alloc->pages != NULL)
+		vunmap(alloc->kaddr);
+	else
+		unmap_kernel_range((unsigned long)alloc->kaddr, alloc->size);
 
 	alloc->kaddr = NULL;
 }
 
+/* Resets the cache state of a kmapped alloc as if it was newly allocated */
+static void init_alloc_cach_buf(struct hwmem_alloc *alloc)
+{
+	cach_init_buf(&alloc->cach_buf, alloc->flags, alloc->size);
+	if (alloc->pages != NULL)
+		cach_set_buf_pages(&alloc->cach_buf, alloc->kaddr,
+								alloc->pages);
+	else
+		cach_set_buf_addrs(&alloc->cach_buf, alloc->kaddr,
+								alloc->paddr);
+}
+
+/*
+ * Only allocs whose physical address nobody can know are moved: not pinned,
+ * kmapped or mmapped, not named, as importers may pin them, and with no
+ * hardware operation in flight.
+ */
+static bool is_movable(struct hwmem_alloc *alloc)
+{
+	return alloc->pages == NULL &&
+		alloc->mem_type->allocator_api.alloc_below != NULL &&
+		alloc->pin_cnt == 0 && atomic_read(&alloc->mmap_cnt) == 0 &&
+		alloc->name == 0 && !alloc->moving &&
+		fence_idle(alloc, HWMEM_ACCESS_WRITE);
+}
+
+/* Waits for compaction to finish copying <alloc>, lock must be held */
+static void wait_moved(struct hwmem_alloc *alloc)
+{
+	while (alloc->moving) {
+		mutex_unlock(&lock);
+		wait_event(move_wq, !alloc->moving);
+		mutex_lock(&lock);
+	}
+}
+
+/*
+ * Moves the alloc to a lower address if there is room for it there. The copy
+ * is made without lock, meanwhile everything that could hand out or change
+ * the contents of the alloc waits in wait_moved(). The new physical address
+ * is simply picked up by the next hwmem_pin.
+ */
+static int move_alloc(struct hwmem_alloc *alloc)
+{
+	int ret;
+	struct hwmem_allocator_api *api = &alloc->mem_type->allocator_api;
+	void *instance = alloc->mem_type->allocator_instance;
+	void *old_hndl = alloc->allocator_hndl;
+	phys_addr_t old_paddr = alloc->paddr;
+	void *old_kaddr = alloc->kaddr;
+	void *new_hndl;
+
+	new_hndl = api->alloc_below(instance, alloc->size, alloc->paddr);
+	if (IS_ERR(new_hndl))
+		return PTR_ERR(new_hndl);
+
+	/* Make sure we copy what the hardware wrote last */
+	cach_set_domain(&alloc->cach_buf, HWMEM_ACCESS_READ, HWMEM_DOMAIN_CPU,
+									NULL);
+
+	alloc->allocator_hndl = new_hndl;
+	alloc->paddr = api->get_alloc_paddr(new_hndl);
+	alloc->kaddr = NULL;
+
+	ret = kmap_alloc(alloc);
+	if (ret < 0)
+		goto kmap_alloc_failed;
+
+	cach_init_buf(&alloc->cach_buf, alloc->flags, alloc->size);
+	cach_set_buf_addrs(&alloc->cach_buf, alloc->kaddr, alloc->paddr);
+	cach_set_domain(&alloc->cach_buf, HWMEM_ACCESS_WRITE,
+						HWMEM_DOMAIN_CPU, NULL);
+
+	alloc->moving = true;
+	atomic_inc(&alloc->ref_cnt);
+
+	mutex_unlock(&lock);
+
+	memcpy(alloc->kaddr, old_kaddr, alloc->size);
+
+	mutex_lock(&lock);
+
+	unmap_kernel_range((unsigned long)old_kaddr, alloc->size);
+	api->free(instance, old_hndl);
+
+	alloc->moving = false;
+	wake_up_all(&move_wq);
+
+	if (atomic_dec_and_test(&alloc->ref_cnt))
+		release_alloc(alloc);
+
+	return 0;
+
+kmap_alloc_failed:
+	api->free(instance, new_hndl);
+	alloc->allocator_hndl = old_hndl;
+	alloc->paddr = old_paddr;
+	alloc->kaddr = old_kaddr;
+
+	return ret;
+}
+
+/*
+ * Slides every movable alloc as far down as it goes, merging the holes left
+ * behind by freed allocs. The lock is dropped while each alloc is copied so
+ * the alloc list is rescanned after every move, skipping allocs this pass
+ * has already tried.
+ */
+static void compact_allocs(void)
+{
+	struct hwmem_alloc *alloc;
+	bool found;
+
+	mutex_lock(&compact_lock);
+	mutex_lock(&lock);
+
+	compact_gen++;
+
+	while (true) {
+		found = false;
+		list_for_each_entry(alloc, &alloc_list, list) {
+			if (alloc->compact_gen != compact_gen &&
+							is_movable(alloc)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			break;
+
+		alloc->compact_gen = compact_gen;
+		(void)move_alloc(alloc);
+	}
+
+	mutex_unlock(&lock);
+	mutex_unlock(&compact_lock);
+}
+
+static struct list_head *pool_bucket(size_t size)
+{
+	return &pool_buckets[hash_long(size >> PAGE_SHIFT, POOL_BUCKET_BITS)];
+}
+
+static void pool_remove(struct hwmem_alloc *alloc)
+{
+	list_del_init(&alloc->list);
+	list_del(&alloc->pool_lru);
+	pool_size -= alloc->size;
+	pool_count--;
+	if (alloc->pages != NULL)
+		pool_pages -= alloc->num_pages;
+}
+
+/* Frees up to <nr> pooled buffers, oldest first. Returns the number freed. */
+static unsigned int pool_evict(unsigned int nr)
+{
+	struct hwmem_alloc *alloc;
+	struct hwmem_alloc *tmp;
+	unsigned int freed = 0;
+
+	list_for_each_entry_safe(alloc, tmp, &pool_lru, pool_lru) {
+		if (freed == nr)
+			break;
+
+		if (alloc->pool_clearing)
+			continue;
+
+		pool_remove(alloc);
+		destroy_alloc(alloc);
+		freed++;
+	}
+
+	return freed;
+}
+
+static void pool_add(struct hwmem_alloc *alloc)
+{
+	while (pool_size + alloc->size > pool_max_size && pool_evict(1) > 0)
+		;
+
+	list_add(&alloc->list, pool_bucket(alloc->size));
+	list_add_tail(&alloc->pool_lru, &pool_lru);
+	pool_size += alloc->size;
+	pool_count++;
+	if (alloc->pages != NULL)
+		pool_pages += alloc->num_pages;
+}
+
+/* Returns false if the buffer can't be pooled and must be destroyed */
+static bool pool_put(struct hwmem_alloc *alloc)
+{
+	if (alloc->name != 0 || alloc->size > pool_max_size)
+		return false;
+
+	list_del(&alloc->list);
+	clean_alloc_threadg_info_list(alloc);
+	alloc->pool_clean = false;
+
+	pool_add(alloc);
+
+	schedule_work(&pool_clear_work);
+
+	return true;
+}
+
+/* Prefers buffers that have already been cleared */
+static struct hwmem_alloc *pool_get(size_t size, enum hwmem_alloc_flags flags,
+					enum hwmem_mem_type mem_type)
+{
+	struct hwmem_alloc *alloc;
+	struct hwmem_alloc *found = NULL;
+
+	list_for_each_entry(alloc, pool_bucket(size), list) {
+		if (alloc->size != size || alloc->flags != flags ||
+					alloc->mem_type->id != mem_type ||
+							alloc->pool_clearing)
+			continue;
+
+		found = alloc;
+		if (alloc->pool_clean)
+			break;
+	}
+
+	if (found == NULL)
+		return NULL;
+
+	pool_remove(found);
+
+	init_alloc_cach_buf(found);
+
+	return found;
+}
+
+/*
+ * Called when the last reference to <alloc> is dropped, with lock held. A
+ * buffer the hardware still accesses must not be reused or freed yet; its
+ * last hwmem_fence_signal() schedules pool_clear_work, which finishes the
+ * release.
+ */
+static void release_alloc(struct hwmem_alloc *alloc)
+{
+	unsigned long flags;
+	bool busy;
+
+	spin_lock_irqsave(&alloc->fence_lock, flags);
+	busy = alloc->pending_reads != 0 || alloc->pending_writes != 0;
+	alloc->released_busy = busy;
+	spin_unlock_irqrestore(&alloc->fence_lock, flags);
+
+	if (busy)
+		list_move_tail(&alloc->list, &busy_list);
+	else if (!pool_put(alloc))
+		destroy_alloc(alloc);
+}
+
+static void pool_clear_work_func(struct work_struct *work)
+{
+	struct hwmem_alloc *alloc;
+	struct hwmem_alloc *tmp;
+	bool found;
+
+	mutex_lock(&lock);
+
+	list_for_each_entry_safe(alloc, tmp, &busy_list, list) {
+		if (!fence_idle(alloc, HWMEM_ACCESS_WRITE))
+			continue;
+
+		alloc->released_busy = false;
+		if (!pool_put(alloc))
+			destroy_alloc(alloc);
+	}
+
+	while (true) {
+		found = false;
+		list_for_each_entry(alloc, &pool_lru, pool_lru) {
+			if (!alloc->pool_clean) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			break;
+
+		/* Keep its place in the pool but make sure nobody takes it */
+		alloc->pool_clearing = true;
+
+		mutex_unlock(&lock);
+
+		clear_alloc_mem(alloc);
+
+		mutex_lock(&lock);
+
+		alloc->pool_clearing = false;
+		alloc->pool_clean = true;
+	}
+
+	mutex_unlock(&lock);
+}
+
+/* Counts and scans in pages, oldest buffers first */
+static int pool_shrink(struct shrinker *shrinker, int nr_to_scan,
+							gfp_t gfp_mask)
+{
+	struct hwmem_alloc *alloc;
+	struct hwmem_alloc *tmp;
+
+	if (nr_to_scan > 0) {
+		/* We may be called from an allocation made under lock */
+		if (!mutex_trylock(&lock))
+			return -1;
+
+		list_for_each_entry_safe(alloc, tmp, &pool_lru, pool_lru) {
+			if (nr_to_scan <= 0)
+				break;
+
+			if (alloc->pool_clearing || alloc->pages == NULL)
+				continue;
+
+			nr_to_scan -= alloc->num_pages;
+			pool_remove(alloc);
+			destroy_alloc(alloc);
+		}
+
+		mutex_unlock(&lock);
+	}
+
+	return pool_pages;
+}
+
+static struct shrinker pool_shrinker = {
+	.shrink = pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Falls back on emptying the pool and then on compaction when the allocator
+ * is out of memory. Called with lock held, which is dropped while compacting.
+ */
+static void *allocator_alloc(struct hwmem_mem_type_struct *mem_type,
+								size_t size)
+{
+	void *hndl;
+
+	if (mem_type->allocator_api.alloc == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	hndl = mem_type->allocator_api.alloc(mem_type->allocator_instance,
+									size);
+	if (PTR_ERR(hndl) == -ENOMEM && pool_count > 0) {
+		pool_evict(pool_count);
+		hndl = mem_type->allocator_api.alloc(
+					mem_type->allocator_instance, size);
+	}
+	if (PTR_ERR(hndl) == -ENOMEM &&
+				mem_type->allocator_api.alloc_below != NULL) {
+		/* There may be enough free memory, just not in one piece */
+		mutex_unlock(&lock);
+		compact_allocs();
+		mutex_lock(&lock);
+
+		hndl = mem_type->allocator_api.alloc(
+					mem_type->allocator_instance, size);
+	}
+
+	return hndl;
+}
+
 static struct hwmem_mem_type_struct *resolve_mem_type(
 						enum hwmem_mem_type mem_type)
 {
@@ -206,6 +734,9 @@ static struct hwmem_mem_type_struct *resolve_mem_type(
 			return &hwmem_mem_types[i];
 	}
 
+	if (mem_type == HWMEM_MEM_SCATTERED_SYS)
+		return &scattered_sys_mem_type;
+
 	return ERR_PTR(-ENOENT);
 }
 
@@ -225,18 +756,37 @@ struct hwmem_alloc *hwmem_alloc(size_t size, enum hwmem_alloc_flags flags,
 	if (size == 0)
 		return ERR_PTR(-EINVAL);
 
+	size = PAGE_ALIGN(size);
+
 	mutex_lock(&lock);
 
-	size = PAGE_ALIGN(size);
+	alloc = pool_get(size, flags, mem_type);
+	if (alloc != NULL) {
+		atomic_set(&alloc->ref_cnt, 1);
+		alloc->pin_cnt = 0;
+		alloc->default_access = def_access;
+#ifdef CONFIG_DEBUG_FS
+		alloc->creator = __builtin_return_address(0);
+		alloc->creator_tgid = task_tgid_nr(current);
+#endif
+		if (!alloc->pool_clean)
+			clear_alloc_mem(alloc);
 
-	alloc = kzalloc(sizeof(struct hwmem_alloc), GFP_KERNEL);
-	if (alloc == NULL) {
-		ret = -ENOMEM;
-		goto alloc_alloc_failed;
+		list_add_tail(&alloc->list, &alloc_list);
+
+		goto out;
 	}
 
+	mutex_unlock(&lock);
+
+	alloc = kzalloc(sizeof(struct hwmem_alloc), GFP_KERNEL);
+	if (alloc == NULL)
+		return ERR_PTR(-ENOMEM);
+
 	INIT_LIST_HEAD(&alloc->list);
 	atomic_inc(&alloc->ref_cnt);
+	spin_lock_init(&alloc->fence_lock);
+	init_waitqueue_head(&alloc->fence_wq);
 	alloc->flags = flags;
 	alloc->default_access = def_access;
 	INIT_LIST_HEAD(&alloc->threadg_info_list);
@@ -247,26 +797,52 @@ struct hwmem_alloc *hwmem_alloc(size_t size, enum hwmem_alloc_flags flags,
 	alloc->mem_type = resolve_mem_type(mem_type);
 	if (IS_ERR(alloc->mem_type)) {
 		ret = PTR_ERR(alloc->mem_type);
-		goto resolve_mem_type_failed;
+		kfree(alloc);
+		return ERR_PTR(ret);
 	}
 
-	alloc->allocator_hndl = alloc->mem_type->allocator_api.alloc(
-				alloc->mem_type->allocator_instance, size);
-	if (IS_ERR(alloc->allocator_hndl)) {
-		ret = PTR_ERR(alloc->allocator_hndl);
-		goto allocator_failed;
+	/*
+	 * Pages stay mapped write-back cacheable in the kernel's linear map.
+	 * On ARMv7 mapping the same memory with other cache attributes is
+	 * unpredictable, and lines speculatively fetched through the linear map
+	 * could be written back over what the hardware produced, so only
+	 * write-back cached buffers are made up of pages. The pages are
+	 * allocated without lock as that may have to wait for reclaim.
+	 */
+	cach_init_buf(&alloc->cach_buf, alloc->flags, size);
+	ret = -ENOMEM;
+	if (alloc->mem_type->id == HWMEM_MEM_SCATTERED_SYS &&
+		(alloc->cach_buf.cache_settings & HWMEM_ALLOC_HINT_CACHED) &&
+		!(alloc->cach_buf.cache_settings & HWMEM_ALLOC_HINT_CACHE_WT)) {
+		ret = alloc_page_list(alloc, size);
+		if (ret < 0)
+			free_page_list(alloc);
 	}
 
-	alloc->paddr = alloc->mem_type->allocator_api.get_alloc_paddr(
+	mutex_lock(&lock);
+
+	if (ret < 0) {
+		/*
+		 * Without an IOMMU contiguous memory can be used by anyone,
+		 * fall back on it if we're out of pages.
+		 */
+		alloc->allocator_hndl = allocator_alloc(alloc->mem_type, size);
+		if (IS_ERR(alloc->allocator_hndl)) {
+			ret = PTR_ERR(alloc->allocator_hndl);
+			goto allocator_failed;
+		}
+
+		alloc->paddr = alloc->mem_type->allocator_api.get_alloc_paddr(
 							alloc->allocator_hndl);
-	alloc->size = alloc->mem_type->allocator_api.get_alloc_size(
+		alloc->size = alloc->mem_type->allocator_api.get_alloc_size(
 							alloc->allocator_hndl);
+	}
 
 	cach_init_buf(&alloc->cach_buf, alloc->flags, alloc->size);
 	ret = kmap_alloc(alloc);
 	if (ret < 0)
 		goto kmap_alloc_failed;
-	cach_set_buf_addrs(&alloc->cach_buf, alloc->kaddr, alloc->paddr);
+	init_alloc_cach_buf(alloc);
 
 	list_add_tail(&alloc->list, &alloc_list);
 
@@ -276,9 +852,7 @@ struct hwmem_alloc *hwmem_alloc(size_t size, enum hwmem_alloc_flags flags,
 
 kmap_alloc_failed:
 allocator_failed:
-resolve_mem_type_failed:
 	destroy_alloc(alloc);
-alloc_alloc_failed:
 	alloc = ERR_PTR(ret);
 
 out:
@@ -293,7 +867,7 @@ void hwmem_release(struct hwmem_alloc *alloc)
 	mutex_lock(&lock);
 
 	if (atomic_dec_and_test(&alloc->ref_cnt))
-		destroy_alloc(alloc);
+		release_alloc(alloc);
 
 	mutex_unlock(&lock);
 }
@@ -304,6 +878,8 @@ int hwmem_set_domain(struct hwmem_alloc *alloc, enum hwmem_access access,
 {
 	mutex_lock(&lock);
 
+	wait_moved(alloc);
+
 	cach_set_domain(&alloc->cach_buf, access, domain, region);
 
 	mutex_unlock(&lock);
@@ -312,39 +888,110 @@ int hwmem_set_domain(struct hwmem_alloc *alloc, enum hwmem_access access,
 }
 EXPORT_SYMBOL(hwmem_set_domain);
 
-int hwmem_pin(struct hwmem_alloc *alloc, struct hwmem_mem_chunk *mem_chunks,
-							u32 *mem_chunks_length)
+static struct hwmem_alloc *find_moving(struct hwmem_set_domain_op *ops,
+							unsigned int num_ops)
 {
-	if (*mem_chunks_length < 1) {
-		*mem_chunks_length = 1;
-		return -ENOSPC;
+	unsigned int i;
+
+	for (i = 0; i < num_ops; i++) {
+		if (ops[i].alloc->moving)
+			return ops[i].alloc;
+	}
+
+	return NULL;
+}
+
+int hwmem_set_domain_batch(struct hwmem_set_domain_op *ops,
+						unsigned int num_ops)
+{
+	unsigned int i;
+	struct cach_domain_op *cach_ops;
+	struct hwmem_alloc *moving;
+
+	if (num_ops == 0)
+		return 0;
+
+	cach_ops = kmalloc(sizeof(*cach_ops) * num_ops, GFP_KERNEL);
+	if (cach_ops == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < num_ops; i++) {
+		cach_ops[i].buf = &ops[i].alloc->cach_buf;
+		cach_ops[i].access = ops[i].access;
+		cach_ops[i].domain = ops[i].domain;
+		cach_ops[i].region = ops[i].region;
 	}
 
 	mutex_lock(&lock);
 
-	mem_chunks[0].paddr = alloc->paddr;
-	mem_chunks[0].size = alloc->size;
-	*mem_chunks_length = 1;
+	/* Another alloc may start moving while we wait, so look again */
+	while ((moving = find_moving(ops, num_ops)) != NULL)
+		wait_moved(moving);
+
+	cach_set_domain_batch(cach_ops, num_ops);
 
 	mutex_unlock(&lock);
 
+	kfree(cach_ops);
+
 	return 0;
 }
+EXPORT_SYMBOL(hwmem_set_domain_batch);
+
+int hwmem_pin(struct hwmem_alloc *alloc, struct hwmem_mem_chunk *mem_chunks,
+							u32 *mem_chunks_length)
+{
+	int ret = 0;
+	u32 required_length;
+
+	mutex_lock(&lock);
+
+	wait_moved(alloc);
+
+	required_length = get_mem_chunks(alloc, mem_chunks,
+							*mem_chunks_length);
+	if (required_length > *mem_chunks_length) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	alloc->pin_cnt++;
+
+out:
+	*mem_chunks_length = required_length;
+
+	mutex_unlock(&lock);
+
+	return ret;
+}
 EXPORT_SYMBOL(hwmem_pin);
 
 void hwmem_unpin(struct hwmem_alloc *alloc)
 {
+	mutex_lock(&lock);
+
+	/* User space can unpin without having pinned, ignore that */
+	if (alloc->pin_cnt > 0)
+		alloc->pin_cnt--;
+
+	mutex_unlock(&lock);
 }
 EXPORT_SYMBOL(hwmem_unpin);
 
 static void vm_open(struct vm_area_struct *vma)
 {
-	atomic_inc(&((struct hwmem_alloc *)vma->vm_private_data)->ref_cnt);
+	struct hwmem_alloc *alloc = (struct hwmem_alloc *)vma->vm_private_data;
+
+	atomic_inc(&alloc->mmap_cnt);
+	atomic_inc(&alloc->ref_cnt);
 }
 
 static void vm_close(struct vm_area_struct *vma)
 {
-	hwmem_release((struct hwmem_alloc *)vma->vm_private_data);
+	struct hwmem_alloc *alloc = (struct hwmem_alloc *)vma->vm_private_data;
+
+	atomic_dec(&alloc->mmap_cnt);
+	hwmem_release(alloc);
 }
 
 int hwmem_mmap(struct hwmem_alloc *alloc, struct vm_area_struct *vma)
@@ -354,6 +1001,8 @@ int hwmem_mmap(struct hwmem_alloc *alloc, struct vm_area_struct *vma)
 	enum hwmem_access access;
 	mutex_lock(&lock);
 
+	wait_moved(alloc);
+
 	access = get_access(alloc);
 
 	/* Check permissions */
@@ -372,23 +1021,42 @@ int hwmem_mmap(struct hwmem_alloc *alloc, struct vm_area_struct *vma)
 
 	/*
 	 * We don't want Linux to do anything (merging etc) with our VMAs as
-	 * the offset is not necessarily valid
+	 * the offset is not necessarily valid. Pages are inserted as normal
+	 * pages so the VMA must not be VM_PFNMAP in that case.
 	 */
-	vma->vm_flags |= VM_SPECIAL;
+	if (alloc->pages != NULL)
+		vma->vm_flags |= VM_SPECIAL & ~VM_PFNMAP;
+	else
+		vma->vm_flags |= VM_SPECIAL;
 	cach_set_pgprot_cache_options(&alloc->cach_buf, &vma->vm_page_prot);
 	vma->vm_private_data = (void *)alloc;
+	atomic_inc(&alloc->mmap_cnt);
 	atomic_inc(&alloc->ref_cnt);
 	vma->vm_ops = &vm_ops;
 
-	ret = remap_pfn_range(vma, vma->vm_start, alloc->paddr >> PAGE_SHIFT,
-		min(vma_size, (unsigned long)alloc->size), vma->vm_page_prot);
-	if (ret < 0)
-		goto map_failed;
+	if (alloc->pages != NULL) {
+		unsigned long addr;
+		unsigned int i = 0;
+
+		for (addr = vma->vm_start; addr < vma->vm_end;
+						addr += PAGE_SIZE, i++) {
+			ret = vm_insert_page(vma, addr, alloc->pages[i]);
+			if (ret < 0)
+				goto map_failed;
+		}
+	} else {
+		ret = remap_pfn_range(vma, vma->vm_start,
+			alloc->paddr >> PAGE_SHIFT, min(vma_size,
+			(unsigned long)alloc->size), vma->vm_page_prot);
+		if (ret < 0)
+			goto map_failed;
+	}
 
 	goto out;
 
 map_failed:
 	atomic_dec(&alloc->ref_cnt);
+	atomic_dec(&alloc->mmap_cnt);
 illegal_size:
 illegal_access:
 
@@ -405,6 +1073,9 @@ void *hwmem_kmap(struct hwmem_alloc *alloc)
 
 	mutex_lock(&lock);
 
+	wait_moved(alloc);
+
+	alloc->pin_cnt++;
 	ret = alloc->kaddr;
 
 	mutex_unlock(&lock);
@@ -415,6 +1086,12 @@ EXPORT_SYMBOL(hwmem_kmap);
 
 void hwmem_kunmap(struct hwmem_alloc *alloc)
 {
+	mutex_lock(&lock);
+
+	if (alloc->pin_cnt > 0)
+		alloc->pin_cnt--;
+
+	mutex_unlock(&lock);
 }
 EXPORT_SYMBOL(hwmem_kunmap);
 
@@ -479,6 +1156,106 @@ void hwmem_get_info(struct hwmem_alloc *alloc, u32 *size,
 }
 EXPORT_SYMBOL(hwmem_get_info);
 
+int hwmem_fence_add(struct hwmem_alloc *alloc, enum hwmem_access access)
+{
+	unsigned long flags;
+
+	if (!(access & (HWMEM_ACCESS_READ | HWMEM_ACCESS_WRITE)))
+		return -EINVAL;
+
+	spin_lock_irqsave(&alloc->fence_lock, flags);
+
+	if (access & HWMEM_ACCESS_WRITE)
+		alloc->pending_writes++;
+	else
+		alloc->pending_reads++;
+
+	spin_unlock_irqrestore(&alloc->fence_lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL(hwmem_fence_add);
+
+void hwmem_fence_signal(struct hwmem_alloc *alloc, enum hwmem_access access)
+{
+	unsigned long flags;
+	unsigned int *pending;
+	bool released;
+
+	spin_lock_irqsave(&alloc->fence_lock, flags);
+
+	if (access & HWMEM_ACCESS_WRITE)
+		pending = &alloc->pending_writes;
+	else
+		pending = &alloc->pending_reads;
+
+	if (!WARN_ON(*pending == 0))
+		(*pending)--;
+
+	released = alloc->released_busy && alloc->pending_reads == 0 &&
+						alloc->pending_writes == 0;
+
+	/*
+	 * Wake up under fence_lock, a released alloc may be freed as soon as
+	 * it has been dropped.
+	 */
+	wake_up_all(&alloc->fence_wq);
+
+	spin_unlock_irqrestore(&alloc->fence_lock, flags);
+
+	if (released)
+		schedule_work(&pool_clear_work);
+}
+EXPORT_SYMBOL(hwmem_fence_signal);
+
+/* Readers only wait for writers, writers wait for everyone */
+static bool fence_idle(struct hwmem_alloc *alloc, enum hwmem_access access)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&alloc->fence_lock, flags);
+
+	idle = alloc->pending_writes == 0 && (!(access & HWMEM_ACCESS_WRITE) ||
+						alloc->pending_reads == 0);
+
+	spin_unlock_irqrestore(&alloc->fence_lock, flags);
+
+	return idle;
+}
+
+int hwmem_fence_wait(struct hwmem_alloc *alloc, enum hwmem_access access,
+								long timeout)
+{
+	long ret;
+
+	ret = wait_event_interruptible_timeout(alloc->fence_wq,
+					fence_idle(alloc, access), timeout);
+	if (ret == 0)
+		return -ETIME;
+	else if (ret < 0)
+		return ret;
+
+	return 0;
+}
+EXPORT_SYMBOL(hwmem_fence_wait);
+
+unsigned int hwmem_fence_poll(struct hwmem_alloc *alloc, struct file *file,
+					struct poll_table_struct *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(file, &alloc->fence_wq, wait);
+
+	if (fence_idle(alloc, HWMEM_ACCESS_READ))
+		mask |= POLLIN | POLLRDNORM;
+	if (fence_idle(alloc, HWMEM_ACCESS_WRITE))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+EXPORT_SYMBOL(hwmem_fence_poll);
+
 s32 hwmem_get_name(struct hwmem_alloc *alloc)
 {
 	int ret = 0, name;
@@ -532,7 +1309,8 @@ struct hwmem_alloc *hwmem_resolve_by_name(s32 name)
 	mutex_lock(&lock);
 
 	alloc = idr_find(&global_idr, name);
-	if (alloc == NULL) {
+	/* Released, only waiting for the hardware to let go of it */
+	if (alloc == NULL || alloc->released_busy) {
 		alloc = ERR_PTR(-EINVAL);
 		goto find_failed;
 	}
@@ -583,6 +1361,8 @@ static int print_alloc(struct hwmem_alloc *alloc, char **buf, size_t buf_size)
 				"\tMemory type: %u\n"
 				"\tName: %#x\n"
 				"\tReference count: %i\n"
+				"\tPin count: %i\n"
+				"\tPending hardware reads/writes: %u/%u\n"
 				"\tAllocation flags: %#x\n"
 				"\t$ settings: %#x\n"
 				"\tDefault access: %#x\n"
@@ -592,6 +1372,8 @@ static int print_alloc(struct hwmem_alloc *alloc, char **buf, size_t buf_size)
 				"\tCreator thread group id: %u\n",
 			(unsigned int)alloc, alloc->size, alloc->mem_type->id,
 			alloc->name, atomic_read(&alloc->ref_cnt),
+			alloc->pin_cnt, alloc->pending_reads,
+			alloc->pending_writes,
 			alloc->flags, alloc->cach_buf.cache_settings,
 			alloc->default_access, alloc->paddr,
 			(unsigned int)alloc->kaddr, creator,
@@ -678,12 +1460,17 @@ extern int hwmem_ioctl_init(void);
 static int __devinit hwmem_probe(struct platform_device *pdev)
 {
 	int ret;
+	unsigned int i;
 
 	if (hwdev) {
 		dev_err(&pdev->dev, "Probed multiple times\n");
 		return -EINVAL;
 	}
 
+	for (i = 0; i < ARRAY_SIZE(pool_buckets); i++)
+		INIT_LIST_HEAD(&pool_buckets[i]);
+	register_shrinker(&pool_shrinker);
+
 	hwdev = pdev;
 
 	/*
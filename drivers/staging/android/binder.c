@@ -19,6 +19,7 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -32,22 +33,67 @@
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking overview
+ *
+ * There is no global lock protecting the binder object graph.  Instead:
+ *
+ * binder_procs_lock:            binder_procs list
+ * binder_context_mgr_node_lock: binder_context_mgr_node and _uid
+ * binder_dead_nodes_lock:       binder_dead_nodes list
+ * binder_deferred_lock:         binder_deferred_list
+ * proc->outer_lock (mutex):     proc->refs_by_desc, proc->refs_by_node and
+ *                               the strong/weak counts of those refs
+ * proc->alloc_lock (mutex):     the buffer allocator of proc
+ * proc->files_lock (mutex):     proc->files
+ * node->lock (spinlock):        node reference counts and node->refs
+ * proc->inner_lock (spinlock):  proc->threads, proc->nodes, proc->todo,
+ *                               thread->todo and thread->transaction_stack
+ *                               of every thread of proc, proc->delivered_death,
+ *                               the node work state of nodes owned by proc,
+ *                               looper state and thread pool counters
+ * t->lock (spinlock):           t->from, t->to_proc and t->to_thread
+ * binder_lru_lock (spinlock):   binder_lru, nests inside proc->alloc_lock;
+ *                               binder_shrink() takes the inner_lock of the
+ *                               page's proc inside it
+ *
+ * Locks must be taken in this order:
+ *   proc->outer_lock -> node->lock -> proc->inner_lock -> t->lock
+ * and no two outer or two inner locks may be held at the same time.
+ * proc->alloc_lock and proc->files_lock are taken with no other binder
+ * lock held.  The global locks nest outside all of the above.
+ *
+ * Functions that expect a lock to be held by the caller carry a suffix:
+ * _olocked (outer_lock), _ilocked (inner_lock), _nilocked (node->lock
+ * and the inner_lock of node->proc).
+ *
+ * Procs, threads and nodes that may be looked at without holding the lock
+ * that keeps them alive are pinned with a temporary reference (tmp_ref).
+ */
+
+static DEFINE_MUTEX(binder_procs_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
+static DEFINE_MUTEX(binder_context_mgr_node_lock);
+static DEFINE_MUTEX(binder_mmap_lock);
+static DEFINE_SPINLOCK(binder_dead_nodes_lock);
+static DEFINE_SPINLOCK(binder_lru_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
+static LIST_HEAD(binder_lru);
+static int binder_lru_count;
 
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -105,6 +151,20 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+/*
+ * Thread pool sizing: ask for another looper when the oldest transaction
+ * on proc->todo has waited longer than spawn_queue_age_us, and let a
+ * spawned looper leave the pool after looper_idle_timeout_ms without
+ * work (0 keeps all loopers).
+ */
+static unsigned int binder_spawn_queue_age_us = 2000;
+module_param_named(spawn_queue_age_us, binder_spawn_queue_age_us, uint,
+		   S_IWUSR | S_IRUGO);
+
+static unsigned int binder_looper_idle_timeout_ms = 10000;
+module_param_named(looper_idle_timeout_ms, binder_looper_idle_timeout_ms,
+		   uint, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -146,22 +206,66 @@ enum binder_stat_types {
 };
 
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+/*
+ * Bucket i of a histogram counts values in [2^(i-1), 2^i), the last one
+ * everything above.
+ */
+#define BINDER_HIST_BUCKETS	20
+
+/* Allocator statistics, shown in debugfs alloc_stats. */
+struct binder_alloc_stats {
+	atomic_t size_hist[BINDER_HIST_BUCKETS];
+	atomic_t latency_hist[BINDER_HIST_BUCKETS];	/* usecs */
+	atomic_t class_hits;
+	atomic_t tree_hits;
+	atomic_t failed;
+	atomic_t pages_reused;
+	atomic_t pages_allocated;
+	atomic_t pages_reclaimed;
+};
+
+static struct binder_alloc_stats binder_alloc_stats;
+
+static inline void binder_hist_add(atomic_t *hist, unsigned long val)
+{
+	int i = fls_long(val);
+
+	if (i >= BINDER_HIST_BUCKETS)
+		i = BINDER_HIST_BUCKETS - 1;
+	atomic_inc(&hist[i]);
+}
+
+enum binder_latency_types {
+	BINDER_LATENCY_QUEUE,	/* queued on a todo list until dequeued */
+	BINDER_LATENCY_WAKEUP,	/* queued until the reader woke up */
+	BINDER_LATENCY_EXEC,	/* delivered until BC_REPLY */
+	BINDER_LATENCY_REPLY,	/* BC_TRANSACTION until BR_REPLY */
+	BINDER_LATENCY_COUNT
+};
+
+/* Transaction latency histograms in usecs, shown in debugfs latency. */
+struct binder_latency_stats {
+	atomic_t hist[BINDER_LATENCY_COUNT][BINDER_HIST_BUCKETS];
+};
+
+static struct binder_latency_stats binder_latency_stats;
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -177,24 +281,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -212,6 +319,7 @@ struct binder_work {
 
 struct binder_node {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	union {
 		struct rb_node rb_node;
@@ -222,6 +330,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -232,6 +341,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency_stats latency_stats;
 };
 
 struct binder_ref_death {
@@ -258,12 +368,17 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* large free entry by size or */
+					/* allocated entry by address */
+		struct list_head free_entry; /* small free entry */
+					     /* by size class */
+	};
 	unsigned free:1;
+	unsigned free_in_class:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned debug_id:28;
 
 	struct binder_transaction *transaction;
 
@@ -273,19 +388,60 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers smaller than BINDER_FREE_CLASS_MAX are kept on per-size
+ * class lists instead of the free_buffers tree, so that the common small
+ * allocations are a list pop instead of a tree walk.  Class i holds free
+ * buffers of at least BINDER_FREE_CLASS_MIN << i bytes, and any buffer
+ * of the next class up is big enough for any request of class i.
+ */
+#define BINDER_FREE_CLASS_SHIFT		6
+#define BINDER_FREE_CLASS_MIN		(1U << BINDER_FREE_CLASS_SHIFT)
+#define BINDER_FREE_CLASSES		6
+#define BINDER_FREE_CLASS_MAX		(BINDER_FREE_CLASS_MIN << \
+					 BINDER_FREE_CLASSES)
+
+/*
+ * Pages backing a proc's buffer area.  Pages of freed buffers are not
+ * unmapped right away but parked on binder_lru, where they can be reused
+ * by the next allocation of the same proc or given back to the system by
+ * binder_shrink().
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
 	BINDER_DEFERRED_RELEASE      = 0x04,
 };
 
+/*
+ * Scheduling priority carried by a synchronous transaction into the target
+ * thread.  prio is the nice value for the normal policies and the rt
+ * priority for SCHED_FIFO and SCHED_RR.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex outer_lock;
+	spinlock_t inner_lock;
+	struct mutex alloc_lock;
+	struct mutex files_lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
 	struct rb_root refs_by_node;
 	int pid;
+	int tmp_ref;
+	int is_dead;
 	struct vm_area_struct *vma;
 	struct task_struct *tsk;
 	struct files_struct *files;
@@ -296,21 +452,24 @@ struct binder_proc {
 
 	struct list_head buffers;
 	struct rb_root free_buffers;
+	struct list_head free_classes[BINDER_FREE_CLASSES];
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_latency_stats latency_stats;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	int queued_transactions;	/* transactions on todo */
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
 };
 
@@ -336,10 +495,14 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	atomic_t tmp_ref;
+	int is_dead;
+	ktime_t wakeup_time;
 };
 
 struct binder_transaction {
 	int debug_id;
+	spinlock_t lock;
 	struct binder_work work;
 	struct binder_thread *from;
 	struct binder_transaction *from_parent;
@@ -352,27 +515,138 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	/*
+	 * Latency accounting: start_time is when the transaction was
+	 * queued, deliver_time when the target thread picked it up and
+	 * call_time when the synchronous call it belongs to was made.
+	 * stats_node holds a temporary reference on the node the call
+	 * was made to, and is handed over from the call to its reply.
+	 */
+	ktime_t start_time;
+	ktime_t deliver_time;
+	ktime_t call_time;
+	struct binder_node *stats_node;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+static inline void binder_proc_lock(struct binder_proc *proc)
+{
+	mutex_lock(&proc->outer_lock);
+}
+
+static inline void binder_proc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->outer_lock);
+}
+
+static inline void binder_inner_proc_lock(struct binder_proc *proc)
+{
+	spin_lock(&proc->inner_lock);
+}
+
+static inline void binder_inner_proc_unlock(struct binder_proc *proc)
+{
+	spin_unlock(&proc->inner_lock);
+}
+
+static inline void binder_node_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+}
+
+static inline void binder_node_unlock(struct binder_node *node)
+{
+	spin_unlock(&node->lock);
+}
+
+/*
+ * Takes node->lock and, unless the node is dead, the inner lock of the
+ * proc owning it.  node->proc only changes with both locks held.
+ */
+static inline void binder_node_inner_lock(struct binder_node *node)
+{
+	spin_lock(&node->lock);
+	if (node->proc)
+		binder_inner_proc_lock(node->proc);
+}
+
+static inline void binder_node_inner_unlock(struct binder_node *node)
+{
+	struct binder_proc *proc = node->proc;
+
+	if (proc)
+		binder_inner_proc_unlock(proc);
+	spin_unlock(&node->lock);
+}
+
+static void binder_enqueue_work_ilocked(struct binder_work *work,
+					struct list_head *target_list)
+{
+	BUG_ON(target_list == NULL);
+	list_add_tail(&work->entry, target_list);
+}
+
+static void binder_enqueue_work(struct binder_proc *proc,
+				struct binder_work *work,
+				struct list_head *target_list)
+{
+	binder_inner_proc_lock(proc);
+	binder_enqueue_work_ilocked(work, target_list);
+	binder_inner_proc_unlock(proc);
+}
+
+static void binder_dequeue_work_ilocked(struct binder_work *work)
+{
+	list_del_init(&work->entry);
+}
+
+static void binder_dequeue_work(struct binder_proc *proc,
+				struct binder_work *work)
+{
+	binder_inner_proc_lock(proc);
+	binder_dequeue_work_ilocked(work);
+	binder_inner_proc_unlock(proc);
+}
+
+static struct binder_work *binder_dequeue_work_head(struct binder_proc *proc,
+						    struct list_head *list)
+{
+	struct binder_work *w = NULL;
+
+	binder_inner_proc_lock(proc);
+	if (!list_empty(list)) {
+		w = list_first_entry(list, struct binder_work, entry);
+		binder_dequeue_work_ilocked(w);
+	}
+	binder_inner_proc_unlock(proc);
+	return w;
+}
+
 /*
  * copied from get_unused_fd_flags
  */
 int task_get_unused_fd_flags(struct binder_proc *proc, int flags)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	int fd, error;
 	struct fdtable *fdt;
 	unsigned long rlim_cur;
 	unsigned long irqs;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	error = -EMFILE;
 	spin_lock(&files->file_lock);
@@ -425,6 +699,7 @@ repeat:
 
 out:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return error;
 }
 
@@ -434,17 +709,22 @@ out:
 static void task_fd_install(
 	struct binder_proc *proc, unsigned int fd, struct file *file)
 {
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return;
+	}
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
 	BUG_ON(fdt->fd[fd] != NULL);
 	rcu_assign_pointer(fdt->fd[fd], file);
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 }
 
 /*
@@ -464,12 +744,16 @@ static void __put_unused_fd(struct files_struct *files, unsigned int fd)
 static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 {
 	struct file *filp;
-	struct files_struct *files = proc->files;
+	struct files_struct *files;
 	struct fdtable *fdt;
 	int retval;
 
-	if (files == NULL)
+	mutex_lock(&proc->files_lock);
+	files = proc->files;
+	if (files == NULL) {
+		mutex_unlock(&proc->files_lock);
 		return -ESRCH;
+	}
 
 	spin_lock(&files->file_lock);
 	fdt = files_fdtable(files);
@@ -483,6 +767,7 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 	__put_unused_fd(files, fd);
 	spin_unlock(&files->file_lock);
 	retval = filp_close(filp, files);
+	mutex_unlock(&proc->files_lock);
 
 	/* can't restart close syscall because file table entry was cleared */
 	if (unlikely(retval == -ERESTARTSYS ||
@@ -495,6 +780,7 @@ static long task_close_fd(struct binder_proc *proc, unsigned int fd)
 
 out_unlock:
 	spin_unlock(&files->file_lock);
+	mutex_unlock(&proc->files_lock);
 	return -EBADF;
 }
 
@@ -515,6 +801,90 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	if (binder_is_rt_policy(task->policy))
+		p.prio = task->rt_priority;
+	else
+		p.prio = task_nice(task);
+	return p;
+}
+
+/*
+ * Switch current to the given policy and priority.  This is the driver
+ * handing the caller's priority to the thread that works for it, so the
+ * rt limits of the target process do not apply.
+ */
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct sched_param param;
+	unsigned int reset_on_fork;
+	int ret;
+
+	reset_on_fork = current->sched_reset_on_fork ? SCHED_RESET_ON_FORK : 0;
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		if (current->policy == desired.sched_policy &&
+		    current->rt_priority == desired.prio)
+			return;
+		param.sched_priority = desired.prio;
+	} else {
+		param.sched_priority = 0;
+	}
+	if (current->policy != desired.sched_policy ||
+	    binder_is_rt_policy(desired.sched_policy)) {
+		ret = sched_setscheduler_nocheck(current,
+				desired.sched_policy | reset_on_fork, &param);
+		if (ret) {
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: policy %u prio %d failed, "
+				     "%d\n", current->pid,
+				     desired.sched_policy, desired.prio, ret);
+			return;
+		}
+	}
+	if (!binder_is_rt_policy(desired.sched_policy))
+		binder_set_nice(desired.prio);
+}
+
+static void binder_transaction_priority(struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired = t->priority;
+	struct binder_priority saved = binder_get_priority(current);
+	long nice = node->min_priority;
+
+	t->saved_priority = saved;
+	if (binder_is_rt_policy(desired.sched_policy) &&
+	    !(t->flags & TF_ONE_WAY)) {
+		/* only rt callers lend their policy, and never lower ours */
+		if (!binder_is_rt_policy(saved.sched_policy) ||
+		    saved.prio < desired.prio)
+			binder_set_priority(desired);
+		return;
+	}
+
+	/*
+	 * Everything else only lends a nice value, and only to raise ours:
+	 * a SCHED_BATCH or SCHED_IDLE caller must not drag the thread down
+	 * to its policy.  Async calls only get the node's minimum priority.
+	 */
+	if (binder_is_rt_policy(saved.sched_policy))
+		return;
+	if (!(t->flags & TF_ONE_WAY) &&
+	    !binder_is_rt_policy(desired.sched_policy) && desired.prio < nice)
+		nice = desired.prio;
+	if (nice < saved.prio)
+		binder_set_nice(nice);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -525,6 +895,16 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_free_class(size_t size)
+{
+	int class;
+
+	if (size >= BINDER_FREE_CLASS_MAX)
+		return -1;
+	class = fls(size) - 1 - BINDER_FREE_CLASS_SHIFT;
+	return class < 0 ? 0 : class;
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
@@ -533,6 +913,7 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 	struct binder_buffer *buffer;
 	size_t buffer_size;
 	size_t new_buffer_size;
+	int class;
 
 	BUG_ON(!new_buffer->free);
 
@@ -542,6 +923,14 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
+	class = binder_free_class(new_buffer_size);
+	if (class >= 0) {
+		new_buffer->free_in_class = 1;
+		list_add(&new_buffer->free_entry, &proc->free_classes[class]);
+		return;
+	}
+	new_buffer->free_in_class = 0;
+
 	while (*p) {
 		parent = *p;
 		buffer = rb_entry(parent, struct binder_buffer, rb_node);
@@ -558,6 +947,82 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
 }
 
+static void binder_remove_free_buffer(struct binder_proc *proc,
+				      struct binder_buffer *buffer)
+{
+	BUG_ON(!buffer->free);
+	if (buffer->free_in_class) {
+		list_del(&buffer->free_entry);
+		buffer->free_in_class = 0;
+	} else
+		rb_erase(&buffer->rb_node, &proc->free_buffers);
+}
+
+/*
+ * Returns a free buffer of at least size bytes and its size, or NULL.
+ * Small requests first try a first fit in their own class, then take
+ * any buffer of a bigger class; everything else is a best fit in the
+ * free_buffers tree.
+ */
+static struct binder_buffer *binder_find_free_buffer(struct binder_proc *proc,
+						     size_t size,
+						     size_t *buffer_sizep)
+{
+	struct rb_node *n = proc->free_buffers.rb_node;
+	struct rb_node *best_fit = NULL;
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	int class = binder_free_class(size);
+
+	if (class >= 0) {
+		list_for_each_entry(buffer, &proc->free_classes[class],
+				    free_entry) {
+			buffer_size = binder_buffer_size(proc, buffer);
+			if (buffer_size >= size)
+				goto found_in_class;
+		}
+		while (++class < BINDER_FREE_CLASSES) {
+			if (list_empty(&proc->free_classes[class]))
+				continue;
+			buffer = list_first_entry(&proc->free_classes[class],
+						  struct binder_buffer,
+						  free_entry);
+			buffer_size = binder_buffer_size(proc, buffer);
+			goto found_in_class;
+		}
+	}
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+		buffer_size = binder_buffer_size(proc, buffer);
+
+		if (size < buffer_size) {
+			best_fit = n;
+			n = n->rb_left;
+		} else if (size > buffer_size)
+			n = n->rb_right;
+		else {
+			best_fit = n;
+			break;
+		}
+	}
+	if (best_fit == NULL)
+		return NULL;
+	if (n == NULL) {
+		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+		buffer_size = binder_buffer_size(proc, buffer);
+	}
+	atomic_inc(&binder_alloc_stats.tree_hits);
+	*buffer_sizep = buffer_size;
+	return buffer;
+
+found_in_class:
+	atomic_inc(&binder_alloc_stats.class_hits);
+	*buffer_sizep = buffer_size;
+	return buffer;
+}
+
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
 					   struct binder_buffer *new_buffer)
 {
@@ -607,6 +1072,29 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (list_empty(&page->lru)) {
+		list_add_tail(&page->lru, &binder_lru);
+		binder_lru_count++;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+/* Number of pages mapped with one map_vm_area() call */
+#define BINDER_PAGE_BATCH	16
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +1102,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int need_mm = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,57 +1113,109 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
-		mm = get_task_mm(proc->tsk);
+	if (allocate == 0)
+		goto free_range;
 
-	if (mm) {
-		down_write(&mm->mmap_sem);
-		vma = proc->vma;
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr) {
+			need_mm = 1;
+			break;
+		}
 	}
 
-	if (allocate == 0)
-		goto free_range;
+	if (need_mm && !vma) {
+		mm = get_task_mm(proc->tsk);
+		if (mm) {
+			down_write(&mm->mmap_sem);
+			vma = proc->vma;
+		}
+	}
 
-	if (vma == NULL) {
+	if (need_mm && vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+	page_addr = start;
+	while (page_addr < end) {
+		struct page *batch[BINDER_PAGE_BATCH];
+		struct page **batch_ptr = batch;
+		void *batch_start = page_addr;
+		int nr = 0;
 		int ret;
-		struct page **page_array_ptr;
+		int i;
+
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr) {
+			/*
+			 * Still mapped from an earlier buffer.  Clear it like
+			 * a new page, the old contents were meant for
+			 * another transaction.
+			 */
+			binder_lru_del(page);
+			clear_highpage(page->page_ptr);
+			atomic_inc(&binder_alloc_stats.pages_reused);
+			page_addr += PAGE_SIZE;
+			continue;
+		}
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "for page at %p\n", proc->pid, page_addr);
-			goto err_alloc_page_failed;
+		while (page_addr < end && nr < BINDER_PAGE_BATCH &&
+		       !page[nr].page_ptr) {
+			batch[nr] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+			if (batch[nr] == NULL) {
+				printk(KERN_ERR "binder: %d: binder_alloc_buf "
+				       "failed for page at %p\n",
+				       proc->pid, page_addr);
+				goto err_alloc_page_failed;
+			}
+			nr++;
+			page_addr += PAGE_SIZE;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+
+		tmp_area.addr = batch_start;
+		/* map_vm_area() leaves out the trailing guard page */
+		tmp_area.size = (nr + 1) * PAGE_SIZE;
+		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &batch_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
+			       "to map pages at %p in kernel\n",
+			       proc->pid, batch_start);
 			goto err_map_kernel_failed;
 		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
-			goto err_vm_insert_page_failed;
+		for (i = 0; i < nr; i++) {
+			user_page_addr = (uintptr_t)batch_start +
+				i * PAGE_SIZE + proc->user_buffer_offset;
+			ret = vm_insert_page(vma, user_page_addr, batch[i]);
+			if (ret) {
+				printk(KERN_ERR "binder: %d: binder_alloc_buf "
+				       "failed to map page at %lx in "
+				       "userspace\n", proc->pid,
+				       user_page_addr);
+				goto err_vm_insert_page_failed;
+			}
+			/* vm_insert_page does not seem to increment the refcount */
 		}
-		/* vm_insert_page does not seem to increment the refcount */
+		for (i = 0; i < nr; i++)
+			page[i].page_ptr = batch[i];
+		atomic_add(nr, &binder_alloc_stats.pages_allocated);
+		continue;
+
+err_vm_insert_page_failed:
+		if (i)
+			zap_page_range(vma, (uintptr_t)batch_start +
+				       proc->user_buffer_offset,
+				       i * PAGE_SIZE, NULL);
+		unmap_kernel_range((unsigned long)batch_start,
+				   nr * PAGE_SIZE);
+err_map_kernel_failed:
+err_alloc_page_failed:
+		while (nr--)
+			__free_page(batch[nr]);
+		/* pages already set up for this range go back on the lru */
+		binder_update_page_range(proc, 0, start, batch_start, NULL);
+		goto err_no_vma;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -683,20 +1224,13 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
-err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
-err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
-err_alloc_page_failed:
-		;
+		BUG_ON(!page->page_ptr);
+		binder_lru_add(page);
 	}
+	return 0;
+
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -705,25 +1239,125 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmaps and frees an lru page.  Called with proc->alloc_lock held and
+ * the page already taken off binder_lru.
+ */
+static int binder_free_lru_page(struct binder_proc *proc,
+				struct binder_lru_page *page)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
-	void *has_page_addr;
-	void *end_page_addr;
-	size_t size;
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+	struct mm_struct *mm;
 
-	if (proc->vma == NULL) {
-		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
-		       proc->pid);
-		return NULL;
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		struct vm_area_struct *vma;
+
+		if (!down_write_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return -EAGAIN;
+		}
+		vma = proc->vma;
+		if (vma)
+			zap_page_range(vma, (uintptr_t)page_addr +
+				       proc->user_buffer_offset,
+				       PAGE_SIZE, NULL);
+		up_write(&mm->mmap_sem);
+		mmput(mm);
 	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	return 0;
+}
 
-	size = ALIGN(data_size, sizeof(void *)) +
+static void binder_proc_dec_tmpref(struct binder_proc *proc);
+
+/*
+ * binder_shrink - gives pages of freed buffers back to the system,
+ * least recently freed first.  Procs that are busy allocating, or whose
+ * mm is locked, are skipped.
+ */
+static int binder_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	if (!nr_to_scan)
+		return binder_lru_count;
+
+	while (nr_to_scan-- > 0) {
+		spin_lock(&binder_lru_lock);
+		if (list_empty(&binder_lru)) {
+			spin_unlock(&binder_lru_lock);
+			break;
+		}
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		/*
+		 * While the page is on the lru, the proc struct exists.  Pin
+		 * it with a tmp_ref before letting go of binder_lru_lock.
+		 * Pages of a proc that is being released are left alone,
+		 * binder_free_proc() takes them off the lru and frees them.
+		 */
+		binder_inner_proc_lock(proc);
+		if (proc->is_dead) {
+			binder_inner_proc_unlock(proc);
+			list_move_tail(&page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			binder_inner_proc_unlock(proc);
+			list_move_tail(&page->lru, &binder_lru);
+			spin_unlock(&binder_lru_lock);
+			continue;
+		}
+		proc->tmp_ref++;
+		binder_inner_proc_unlock(proc);
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		if (binder_free_lru_page(proc, page))
+			binder_lru_add(page);
+		else
+			atomic_inc(&binder_alloc_stats.pages_reclaimed);
+		mutex_unlock(&proc->alloc_lock);
+		binder_proc_dec_tmpref(proc);
+	}
+
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
+{
+	struct binder_buffer *buffer;
+	size_t buffer_size;
+	void *has_page_addr;
+	void *end_page_addr;
+	size_t size;
+
+	if (proc->vma == NULL) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
+		       proc->pid);
+		return NULL;
+	}
+	/* pairs with smp_wmb() in binder_mmap() */
+	smp_rmb();
+
+	size = ALIGN(data_size, sizeof(void *)) +
 		ALIGN(offsets_size, sizeof(void *));
 
 	if (size < data_size || size < offsets_size) {
@@ -740,30 +1374,12 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
+	buffer = binder_find_free_buffer(proc, size, &buffer_size);
+	if (buffer == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -771,7 +1387,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -785,7 +1401,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_remove_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -811,6 +1427,26 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+	ktime_t start = ktime_get();
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+
+	binder_hist_add(binder_alloc_stats.size_hist,
+			      data_size + offsets_size);
+	binder_hist_add(binder_alloc_stats.latency_hist,
+			      ktime_to_us(ktime_sub(ktime_get(), start)));
+	if (buffer == NULL)
+		atomic_inc(&binder_alloc_stats.failed);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -868,8 +1504,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -907,7 +1543,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_remove_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -915,20 +1551,30 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_remove_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
-static struct binder_node *binder_get_node(struct binder_proc *proc,
-					   void __user *ptr)
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
+static struct binder_node *binder_get_node_ilocked(struct binder_proc *proc,
+						   void __user *ptr)
 {
 	struct rb_node *n = proc->nodes.rb_node;
 	struct binder_node *node;
 
+	assert_spin_locked(&proc->inner_lock);
+
 	while (n) {
 		node = rb_entry(n, struct binder_node, rb_node);
 
@@ -936,20 +1582,49 @@ static struct binder_node *binder_get_node(struct binder_proc *proc,
 			n = n->rb_left;
 		else if (ptr > node->ptr)
 			n = n->rb_right;
-		else
+		else {
+			/*
+			 * take an implicit temporary reference, the caller
+			 * drops it with binder_put_node()
+			 */
+			node->tmp_refs++;
 			return node;
+		}
 	}
 	return NULL;
 }
 
+static struct binder_node *binder_get_node(struct binder_proc *proc,
+					   void __user *ptr)
+{
+	struct binder_node *node;
+
+	binder_inner_proc_lock(proc);
+	node = binder_get_node_ilocked(proc, ptr);
+	binder_inner_proc_unlock(proc);
+	return node;
+}
+
+/*
+ * Returns the node for ptr with a temporary reference held, creating it
+ * from fp if it does not exist yet.  fp may be NULL for the context
+ * manager node.
+ */
 static struct binder_node *binder_new_node(struct binder_proc *proc,
-					   void __user *ptr,
-					   void __user *cookie)
+					   struct flat_binder_object *fp)
 {
 	struct rb_node **p = &proc->nodes.rb_node;
 	struct rb_node *parent = NULL;
-	struct binder_node *node;
+	struct binder_node *node, *new_node;
+	void __user *ptr = fp ? fp->binder : NULL;
+	void __user *cookie = fp ? fp->cookie : NULL;
+	unsigned long flags = fp ? fp->flags : 0;
+
+	new_node = kzalloc(sizeof(*node), GFP_KERNEL);
+	if (new_node == NULL)
+		return NULL;
 
+	binder_inner_proc_lock(proc);
 	while (*p) {
 		parent = *p;
 		node = rb_entry(parent, struct binder_node, rb_node);
@@ -958,23 +1633,30 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 			p = &(*p)->rb_left;
 		else if (ptr > node->ptr)
 			p = &(*p)->rb_right;
-		else
-			return NULL;
+		else {
+			/* lost a race with another thread creating it */
+			node->tmp_refs++;
+			binder_inner_proc_unlock(proc);
+			kfree(new_node);
+			return node;
+		}
 	}
-
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (node == NULL)
-		return NULL;
+	node = new_node;
 	binder_stats_created(BINDER_STAT_NODE);
+	node->tmp_refs++;
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
 	node->work.type = BINDER_WORK_NODE;
+	node->min_priority = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+	node->accept_fds = !!(flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+	spin_lock_init(&node->lock);
 	INIT_LIST_HEAD(&node->work.entry);
 	INIT_LIST_HEAD(&node->async_todo);
+	binder_inner_proc_unlock(proc);
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d:%d node %d u%p c%p created\n",
 		     proc->pid, current->pid, node->debug_id,
@@ -982,9 +1664,30 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	return node;
 }
 
-static int binder_inc_node(struct binder_node *node, int strong, int internal,
-			   struct list_head *target_list)
+/*
+ * Dead nodes are only unlinked from binder_dead_nodes here, after
+ * node->lock has been dropped, so that binder_dead_nodes_lock can be
+ * taken before node->lock when walking the list.
+ */
+static void binder_free_node(struct binder_node *node)
 {
+	if (node->proc == NULL) {
+		spin_lock(&binder_dead_nodes_lock);
+		hlist_del(&node->dead_node);
+		spin_unlock(&binder_dead_nodes_lock);
+	}
+	kfree(node);
+	binder_stats_deleted(BINDER_STAT_NODE);
+}
+
+static int binder_inc_node_nilocked(struct binder_node *node, int strong,
+				    int internal,
+				    struct list_head *target_list)
+{
+	assert_spin_locked(&node->lock);
+	if (node->proc)
+		assert_spin_locked(&node->proc->inner_lock);
+
 	if (strong) {
 		if (internal) {
 			if (target_list == NULL &&
@@ -999,8 +1702,8 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 		} else
 			node->local_strong_refs++;
 		if (!node->has_strong_ref && target_list) {
-			list_del_init(&node->work.entry);
-			list_add_tail(&node->work.entry, target_list);
+			binder_dequeue_work_ilocked(&node->work);
+			binder_enqueue_work_ilocked(&node->work, target_list);
 		}
 	} else {
 		if (!internal)
@@ -1011,58 +1714,128 @@ static int binder_inc_node(struct binder_node *node, int strong, int internal,
 					"for %d\n", node->debug_id);
 				return -EINVAL;
 			}
-			list_add_tail(&node->work.entry, target_list);
+			binder_enqueue_work_ilocked(&node->work, target_list);
 		}
 	}
 	return 0;
 }
 
-static int binder_dec_node(struct binder_node *node, int strong, int internal)
+static int binder_inc_node(struct binder_node *node, int strong, int internal,
+			   struct list_head *target_list)
 {
+	int ret;
+
+	binder_node_inner_lock(node);
+	ret = binder_inc_node_nilocked(node, strong, internal, target_list);
+	binder_node_inner_unlock(node);
+
+	return ret;
+}
+
+/*
+ * Returns true if the last reference to the node is gone and the caller
+ * must free it with binder_free_node() after dropping the locks.
+ */
+static bool binder_dec_node_nilocked(struct binder_node *node,
+				     int strong, int internal)
+{
+	struct binder_proc *proc = node->proc;
+
+	assert_spin_locked(&node->lock);
+	if (proc)
+		assert_spin_locked(&proc->inner_lock);
+
 	if (strong) {
 		if (internal)
 			node->internal_strong_refs--;
 		else
 			node->local_strong_refs--;
 		if (node->local_strong_refs || node->internal_strong_refs)
-			return 0;
+			return false;
 	} else {
 		if (!internal)
 			node->local_weak_refs--;
-		if (node->local_weak_refs || !hlist_empty(&node->refs))
-			return 0;
+		if (node->local_weak_refs || node->tmp_refs ||
+		    !hlist_empty(&node->refs))
+			return false;
 	}
-	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
+	if (proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
-			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			binder_enqueue_work_ilocked(&node->work, &proc->todo);
+			wake_up_interruptible(&proc->wait);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
-		    !node->local_weak_refs) {
-			list_del_init(&node->work.entry);
-			if (node->proc) {
-				rb_erase(&node->rb_node, &node->proc->nodes);
+		    !node->local_weak_refs && !node->tmp_refs) {
+			if (proc) {
+				binder_dequeue_work_ilocked(&node->work);
+				rb_erase(&node->rb_node, &proc->nodes);
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: refless node %d deleted\n",
 					     node->debug_id);
 			} else {
-				hlist_del(&node->dead_node);
+				BUG_ON(!list_empty(&node->work.entry));
 				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
+			return true;
 		}
 	}
 
-	return 0;
+	return false;
+}
+
+static void binder_dec_node(struct binder_node *node, int strong, int internal)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	free_node = binder_dec_node_nilocked(node, strong, internal);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
 }
 
+static void binder_inc_node_tmpref_ilocked(struct binder_node *node)
+{
+	node->tmp_refs++;
+}
 
-static struct binder_ref *binder_get_ref(struct binder_proc *proc,
-					 uint32_t desc)
+static void binder_inc_node_tmpref(struct binder_node *node)
+{
+	binder_node_inner_lock(node);
+	binder_inc_node_tmpref_ilocked(node);
+	binder_node_inner_unlock(node);
+}
+
+static void binder_put_node(struct binder_node *node)
+{
+	bool free_node;
+
+	binder_node_inner_lock(node);
+	node->tmp_refs--;
+	BUG_ON(node->tmp_refs < 0);
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+}
+
+static void binder_latency_add(struct binder_proc *proc,
+			       struct binder_node *node,
+			       enum binder_latency_types type, s64 usecs)
+{
+	if (usecs < 0)
+		usecs = 0;
+	binder_hist_add(binder_latency_stats.hist[type], usecs);
+	binder_hist_add(proc->latency_stats.hist[type], usecs);
+	if (node)
+		binder_hist_add(node->latency_stats.hist[type], usecs);
+}
+
+static struct binder_ref *binder_get_ref_olocked(struct binder_proc *proc,
+						 uint32_t desc)
 {
 	struct rb_node *n = proc->refs_by_desc.rb_node;
 	struct binder_ref *ref;
@@ -1080,8 +1853,8 @@ static struct binder_ref *binder_get_ref(struct binder_proc *proc,
 	return NULL;
 }
 
-static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
-						  struct binder_node *node)
+static struct binder_ref *binder_get_ref_for_node_olocked(
+	struct binder_proc *proc, struct binder_node *node)
 {
 	struct rb_node *n;
 	struct rb_node **p = &proc->refs_by_node.rb_node;
@@ -1103,7 +1876,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1131,41 +1904,47 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	}
 	rb_link_node(&new_ref->rb_node_desc, parent, p);
 	rb_insert_color(&new_ref->rb_node_desc, &proc->refs_by_desc);
-	if (node) {
-		hlist_add_head(&new_ref->node_entry, &node->refs);
 
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "node %d\n", proc->pid, new_ref->debug_id,
-			     new_ref->desc, node->debug_id);
-	} else {
-		binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-			     "binder: %d new ref %d desc %d for "
-			     "dead node\n", proc->pid, new_ref->debug_id,
-			      new_ref->desc);
-	}
+	binder_node_inner_lock(node);
+	hlist_add_head(&new_ref->node_entry, &node->refs);
+	binder_node_inner_unlock(node);
+
+	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+		     "binder: %d new ref %d desc %d for "
+		     "%snode %d\n", proc->pid, new_ref->debug_id,
+		     new_ref->desc, node->proc ? "" : "dead ",
+		     node->debug_id);
 	return new_ref;
 }
 
-static void binder_delete_ref(struct binder_ref *ref)
+static void binder_delete_ref_olocked(struct binder_ref *ref)
 {
+	struct binder_node *node = ref->node;
+	bool free_node;
+
 	binder_debug(BINDER_DEBUG_INTERNAL_REFS,
 		     "binder: %d delete ref %d desc %d for "
 		     "node %d\n", ref->proc->pid, ref->debug_id,
-		     ref->desc, ref->node->debug_id);
+		     ref->desc, node->debug_id);
 
 	rb_erase(&ref->rb_node_desc, &ref->proc->refs_by_desc);
 	rb_erase(&ref->rb_node_node, &ref->proc->refs_by_node);
+
+	binder_node_inner_lock(node);
 	if (ref->strong)
-		binder_dec_node(ref->node, 1, 1);
+		binder_dec_node_nilocked(node, 1, 1);
 	hlist_del(&ref->node_entry);
-	binder_dec_node(ref->node, 0, 1);
+	free_node = binder_dec_node_nilocked(node, 0, 1);
+	binder_node_inner_unlock(node);
+	if (free_node)
+		binder_free_node(node);
+
 	if (ref->death) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder: %d delete ref %d desc %d "
 			     "has death notification\n", ref->proc->pid,
 			     ref->debug_id, ref->desc);
-		list_del(&ref->death->work.entry);
+		binder_dequeue_work(ref->proc, &ref->death->work);
 		kfree(ref->death);
 		binder_stats_deleted(BINDER_STAT_DEATH);
 	}
@@ -1173,8 +1952,8 @@ static void binder_delete_ref(struct binder_ref *ref)
 	binder_stats_deleted(BINDER_STAT_REF);
 }
 
-static int binder_inc_ref(struct binder_ref *ref, int strong,
-			  struct list_head *target_list)
+static int binder_inc_ref_olocked(struct binder_ref *ref, int strong,
+				  struct list_head *target_list)
 {
 	int ret;
 	if (strong) {
@@ -1195,8 +1974,11 @@ static int binder_inc_ref(struct binder_ref *ref, int strong,
 	return 0;
 }
 
-
-static int binder_dec_ref(struct binder_ref *ref, int strong)
+/*
+ * Returns true if the ref has no references left, in which case the
+ * caller must remove it with binder_delete_ref_olocked().
+ */
+static bool binder_dec_ref_olocked(struct binder_ref *ref, int strong)
 {
 	if (strong) {
 		if (ref->strong == 0) {
@@ -1204,43 +1986,120 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			return false;
 		}
 		ref->strong--;
-		if (ref->strong == 0) {
-			int ret;
-			ret = binder_dec_node(ref->node, strong, 1);
-			if (ret)
-				return ret;
-		}
+		if (ref->strong == 0)
+			binder_dec_node(ref->node, strong, 1);
 	} else {
 		if (ref->weak == 0) {
 			binder_user_error("binder: %d invalid dec weak, "
 					  "ref %d desc %d s %d w %d\n",
 					  ref->proc->pid, ref->debug_id,
 					  ref->desc, ref->strong, ref->weak);
-			return -EINVAL;
+			return false;
 		}
 		ref->weak--;
 	}
-	if (ref->strong == 0 && ref->weak == 0)
-		binder_delete_ref(ref);
-	return 0;
+	return ref->strong == 0 && ref->weak == 0;
 }
 
-static void binder_pop_transaction(struct binder_thread *target_thread,
-				   struct binder_transaction *t)
+static void binder_free_proc(struct binder_proc *proc);
+static void binder_free_thread(struct binder_thread *thread);
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
 {
-	if (target_thread) {
-		BUG_ON(target_thread->transaction_stack != t);
-		BUG_ON(target_thread->transaction_stack->from != target_thread);
-		target_thread->transaction_stack =
-			target_thread->transaction_stack->from_parent;
-		t->from = NULL;
+	binder_inner_proc_lock(proc);
+	proc->tmp_ref--;
+	if (proc->is_dead && RB_EMPTY_ROOT(&proc->threads) &&
+	    !proc->tmp_ref) {
+		binder_inner_proc_unlock(proc);
+		binder_free_proc(proc);
+		return;
 	}
+	binder_inner_proc_unlock(proc);
+}
+
+static void binder_thread_dec_tmpref(struct binder_thread *thread)
+{
+	binder_inner_proc_lock(thread->proc);
+	atomic_dec(&thread->tmp_ref);
+	if (thread->is_dead && !atomic_read(&thread->tmp_ref)) {
+		binder_inner_proc_unlock(thread->proc);
+		binder_free_thread(thread);
+		return;
+	}
+	binder_inner_proc_unlock(thread->proc);
+}
+
+/*
+ * Returns t->from with a temporary reference held, or NULL if the
+ * sending thread is gone.
+ */
+static struct binder_thread *binder_get_txn_from(
+		struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	spin_lock(&t->lock);
+	from = t->from;
+	if (from)
+		atomic_inc(&from->tmp_ref);
+	spin_unlock(&t->lock);
+	return from;
+}
+
+/*
+ * Like binder_get_txn_from(), but also returns with the inner lock of
+ * the sending proc held.
+ */
+static struct binder_thread *binder_get_txn_from_and_acq_inner(
+		struct binder_transaction *t)
+{
+	struct binder_thread *from;
+
+	from = binder_get_txn_from(t);
+	if (!from)
+		return NULL;
+	binder_inner_proc_lock(from->proc);
+	if (t->from) {
+		BUG_ON(from != t->from);
+		return from;
+	}
+	binder_inner_proc_unlock(from->proc);
+	binder_thread_dec_tmpref(from);
+	return NULL;
+}
+
+static void binder_pop_transaction_ilocked(struct binder_thread *target_thread,
+					   struct binder_transaction *t)
+{
+	assert_spin_locked(&target_thread->proc->inner_lock);
+	BUG_ON(target_thread->transaction_stack != t);
+	BUG_ON(target_thread->transaction_stack->from != target_thread);
+	target_thread->transaction_stack =
+		target_thread->transaction_stack->from_parent;
+	spin_lock(&t->lock);
+	t->from = NULL;
+	spin_unlock(&t->lock);
+}
+
+static void binder_free_transaction(struct binder_transaction *t)
+{
+	struct binder_proc *target_proc;
+
+	spin_lock(&t->lock);
+	target_proc = t->to_proc;
+	spin_unlock(&t->lock);
 	t->need_reply = 0;
-	if (t->buffer)
-		t->buffer->transaction = NULL;
+	if (target_proc) {
+		binder_inner_proc_lock(target_proc);
+		if (t->buffer)
+			t->buffer->transaction = NULL;
+		binder_inner_proc_unlock(target_proc);
+	}
+	if (t->stats_node)
+		binder_put_node(t->stats_node);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
@@ -1249,10 +2108,14 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
 	struct binder_thread *target_thread;
+	struct binder_transaction *next;
+
 	BUG_ON(t->flags & TF_ONE_WAY);
 	while (1) {
-		target_thread = t->from;
+		target_thread = binder_get_txn_from_and_acq_inner(t);
 		if (target_thread) {
+			bool popped = false;
+
 			if (target_thread->return_error != BR_OK &&
 			   target_thread->return_error2 == BR_OK) {
 				target_thread->return_error2 =
@@ -1266,9 +2129,10 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					      t->debug_id, target_thread->proc->pid,
 					      target_thread->pid);
 
-				binder_pop_transaction(target_thread, t);
+				binder_pop_transaction_ilocked(target_thread, t);
 				target_thread->return_error = error_code;
 				wake_up_interruptible(&target_thread->wait);
+				popped = true;
 			} else {
 				printk(KERN_ERR "binder: reply failed, target "
 					"thread, %d:%d, has error code %d "
@@ -1276,27 +2140,30 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 					target_thread->pid,
 					target_thread->return_error);
 			}
+			binder_inner_proc_unlock(target_thread->proc);
+			binder_thread_dec_tmpref(target_thread);
+			if (popped)
+				binder_free_transaction(t);
 			return;
-		} else {
-			struct binder_transaction *next = t->from_parent;
-
-			binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-				     "binder: send failed reply "
-				     "for transaction %d, target dead\n",
-				     t->debug_id);
-
-			binder_pop_transaction(target_thread, t);
-			if (next == NULL) {
-				binder_debug(BINDER_DEBUG_DEAD_BINDER,
-					     "binder: reply failed,"
-					     " no target thread at root\n");
-				return;
-			}
-			t = next;
+		}
+		next = t->from_parent;
+
+		binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+			     "binder: send failed reply "
+			     "for transaction %d, target dead\n",
+			     t->debug_id);
+
+		binder_free_transaction(t);
+		if (next == NULL) {
 			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: reply failed, no target "
-				     "thread -- retry %d\n", t->debug_id);
+				     "binder: reply failed,"
+				     " no target thread at root\n");
+			return;
 		}
+		t = next;
+		binder_debug(BINDER_DEBUG_DEAD_BINDER,
+			     "binder: reply failed, no target "
+			     "thread -- retry %d\n", t->debug_id);
 	}
 }
 
@@ -1344,11 +2211,16 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				     "        node %d u%p\n",
 				     node->debug_id, node->ptr);
 			binder_dec_node(node, fp->type == BINDER_TYPE_BINDER, 0);
+			binder_put_node(node);
 		} break;
 		case BINDER_TYPE_HANDLE:
 		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
+			struct binder_ref *ref;
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, fp->handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				printk(KERN_ERR "binder: transaction release %d"
 				       " bad handle %ld\n", debug_id,
 				       fp->handle);
@@ -1357,7 +2229,10 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 			binder_debug(BINDER_DEBUG_TRANSACTION,
 				     "        ref %d desc %d (node %d)\n",
 				     ref->debug_id, ref->desc, ref->node->debug_id);
-			binder_dec_ref(ref, fp->type == BINDER_TYPE_HANDLE);
+			if (binder_dec_ref_olocked(ref,
+					fp->type == BINDER_TYPE_HANDLE))
+				binder_delete_ref_olocked(ref);
+			binder_proc_unlock(proc);
 		} break;
 
 		case BINDER_TYPE_FD:
@@ -1375,21 +2250,248 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Takes a strong local reference and a temporary reference on node for
+ * the duration of a transaction, and a temporary reference on the proc
+ * owning it.  Fails with BR_DEAD_REPLY if the node is dead.
+ */
+static struct binder_node *binder_get_node_refs_for_txn(
+		struct binder_node *node,
+		struct binder_proc **procp,
+		uint32_t *error)
+{
+	struct binder_node *target_node = NULL;
+
+	binder_node_inner_lock(node);
+	if (node->proc) {
+		target_node = node;
+		binder_inc_node_nilocked(node, 1, 0, NULL);
+		binder_inc_node_tmpref_ilocked(node);
+		node->proc->tmp_ref++;
+		*procp = node->proc;
+	} else
+		*error = BR_DEAD_REPLY;
+	binder_node_inner_unlock(node);
+
+	return target_node;
+}
+
+/*
+ * Queues t on the todo list of thread, or of proc if thread is NULL, and
+ * wakes up a waiter.  Returns false if the target is dead.
+ */
+static bool binder_proc_transaction(struct binder_transaction *t,
+				    struct binder_proc *proc,
+				    struct binder_thread *thread)
+{
+	struct binder_node *node = t->buffer->target_node;
+	struct list_head *target_list;
+	wait_queue_head_t *target_wait;
+	bool oneway = !!(t->flags & TF_ONE_WAY);
+
+	BUG_ON(!node);
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	if (proc->is_dead || (thread && thread->is_dead)) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		return false;
+	}
+
+	if (thread) {
+		target_list = &thread->todo;
+		target_wait = &thread->wait;
+	} else {
+		target_list = &proc->todo;
+		target_wait = &proc->wait;
+	}
+	if (oneway) {
+		BUG_ON(thread);
+		if (node->has_async_transaction) {
+			target_list = &node->async_todo;
+			target_wait = NULL;
+		} else
+			node->has_async_transaction = 1;
+	}
+	binder_enqueue_work_ilocked(&t->work, target_list);
+	if (target_list == &proc->todo)
+		proc->queued_transactions++;
+	binder_inner_proc_unlock(proc);
+	binder_node_unlock(node);
+
+	if (target_wait)
+		wake_up_interruptible(target_wait);
+	return true;
+}
+
+static int binder_translate_binder(struct flat_binder_object *fp,
+				   struct binder_transaction *t,
+				   struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+	struct binder_proc *target_proc = t->to_proc;
+	struct binder_node *node;
+	struct binder_ref *ref;
+	int ret = 0;
+
+	node = binder_get_node(proc, fp->binder);
+	if (node == NULL) {
+		node = binder_new_node(proc, fp);
+		if (node == NULL)
+			return -ENOMEM;
+	}
+	if (fp->cookie != node->cookie) {
+		binder_user_error("binder: %d:%d sending u%p "
+			"node %d, cookie mismatch %p != %p\n",
+			proc->pid, thread->pid,
+			fp->binder, node->debug_id,
+			fp->cookie, node->cookie);
+		ret = -EINVAL;
+		goto done;
+	}
+	binder_proc_lock(target_proc);
+	ref = binder_get_ref_for_node_olocked(target_proc, node);
+	if (ref == NULL) {
+		binder_proc_unlock(target_proc);
+		ret = -ENOMEM;
+		goto done;
+	}
+	if (fp->type == BINDER_TYPE_BINDER)
+		fp->type = BINDER_TYPE_HANDLE;
+	else
+		fp->type = BINDER_TYPE_WEAK_HANDLE;
+	fp->handle = ref->desc;
+	binder_inc_ref_olocked(ref, fp->type == BINDER_TYPE_HANDLE,
+			       &thread->todo);
+
+	binder_debug(BINDER_DEBUG_TRANSACTION,
+		     "        node %d u%p -> ref %d desc %d\n",
+		     node->debug_id, node->ptr, ref->debug_id,
+		     ref->desc);
+	binder_proc_unlock(target_proc);
+done:
+	binder_put_node(node);
+	return ret;
+}
+
+static int binder_translate_handle(struct flat_binder_object *fp,
+				   struct binder_transaction *t,
+				   struct binder_thread *thread)
+{
+	struct binder_proc *proc = thread->proc;
+	struct binder_proc *target_proc = t->to_proc;
+	struct binder_node *node;
+	struct binder_ref *ref;
+	int ret = 0;
+
+	binder_proc_lock(proc);
+	ref = binder_get_ref_olocked(proc, fp->handle);
+	if (ref == NULL) {
+		binder_proc_unlock(proc);
+		binder_user_error("binder: %d:%d got "
+			"transaction with invalid "
+			"handle, %ld\n", proc->pid,
+			thread->pid, fp->handle);
+		return -EINVAL;
+	}
+	node = ref->node;
+	binder_inc_node_tmpref(node);
+	binder_debug(BINDER_DEBUG_TRANSACTION,
+		     "        ref %d desc %d (node %d)\n",
+		     ref->debug_id, ref->desc, node->debug_id);
+	binder_proc_unlock(proc);
+
+	binder_node_inner_lock(node);
+	if (node->proc == target_proc) {
+		if (fp->type == BINDER_TYPE_HANDLE)
+			fp->type = BINDER_TYPE_BINDER;
+		else
+			fp->type = BINDER_TYPE_WEAK_BINDER;
+		fp->binder = node->ptr;
+		fp->cookie = node->cookie;
+		binder_inc_node_nilocked(node, fp->type == BINDER_TYPE_BINDER,
+					 0, NULL);
+		binder_node_inner_unlock(node);
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "        -> node %d u%p\n",
+			     node->debug_id, node->ptr);
+	} else {
+		struct binder_ref *new_ref;
+
+		binder_node_inner_unlock(node);
+		binder_proc_lock(target_proc);
+		new_ref = binder_get_ref_for_node_olocked(target_proc, node);
+		if (new_ref == NULL) {
+			binder_proc_unlock(target_proc);
+			ret = -ENOMEM;
+			goto done;
+		}
+		fp->handle = new_ref->desc;
+		binder_inc_ref_olocked(new_ref, fp->type == BINDER_TYPE_HANDLE,
+				       NULL);
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "        -> ref %d desc %d\n",
+			     new_ref->debug_id, new_ref->desc);
+		binder_proc_unlock(target_proc);
+	}
+done:
+	binder_put_node(node);
+	return ret;
+}
+
+/*
+ * Gathers the user segments described by uiov into dst, which is size
+ * bytes long.  The segments must add up to exactly size bytes.
+ */
+static int binder_copy_iovec_from_user(void *dst, size_t size,
+				       const struct iovec __user *uiov,
+				       size_t iov_count)
+{
+	struct iovec iov[UIO_FASTIOV];
+	size_t copied = 0;
+
+	if (iov_count > UIO_MAXIOV)
+		return -EINVAL;
+	while (iov_count) {
+		size_t n = min_t(size_t, iov_count, ARRAY_SIZE(iov));
+		size_t i;
+
+		if (copy_from_user(iov, uiov, n * sizeof(iov[0])))
+			return -EFAULT;
+		for (i = 0; i < n; i++) {
+			if (iov[i].iov_len > size - copied)
+				return -EINVAL;
+			if (copy_from_user(dst + copied, iov[i].iov_base,
+					   iov[i].iov_len))
+				return -EFAULT;
+			copied += iov[i].iov_len;
+		}
+		uiov += n;
+		iov_count -= n;
+	}
+	return copied == size ? 0 : -EINVAL;
+}
+
+/*
+ * data_iov is NULL for BC_TRANSACTION and BC_REPLY, where the data is
+ * copied from tr->data.ptr.buffer.
+ */
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       const struct iovec __user *data_iov,
+			       size_t data_iov_count)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
 	size_t *offp, *off_end;
-	struct binder_proc *target_proc;
+	s64 exec_us;
+	struct binder_proc *target_proc = NULL;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
-	struct list_head *target_list;
-	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
-	uint32_t return_error;
+	uint32_t return_error = BR_OK;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1400,16 +2502,18 @@ static void binder_transaction(struct binder_proc *proc,
 	e->offsets_size = tr->offsets_size;
 
 	if (reply) {
+		binder_inner_proc_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_inner_proc_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
+			spin_lock(&in_reply_to->lock);
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
 				" transaction %d has target %d:%d\n",
@@ -1418,12 +2522,16 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			spin_unlock(&in_reply_to->lock);
+			binder_inner_proc_unlock(proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
-		target_thread = in_reply_to->from;
+		binder_inner_proc_unlock(proc);
+		binder_set_priority(in_reply_to->saved_priority);
+		target_thread = binder_get_txn_from_and_acq_inner(in_reply_to);
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1436,41 +2544,56 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_inner_proc_unlock(target_thread->proc);
+			binder_thread_dec_tmpref(target_thread);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
 		target_proc = target_thread->proc;
+		target_proc->tmp_ref++;
+		binder_inner_proc_unlock(target_thread->proc);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
-			ref = binder_get_ref(proc, tr->target.handle);
+
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, tr->target.handle);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
 				binder_user_error("binder: %d:%d got "
 					"transaction to invalid handle\n",
 					proc->pid, thread->pid);
 				return_error = BR_FAILED_REPLY;
 				goto err_invalid_target_handle;
 			}
-			target_node = ref->node;
+			target_node = binder_get_node_refs_for_txn(ref->node,
+						&target_proc, &return_error);
+			binder_proc_unlock(proc);
 		} else {
+			mutex_lock(&binder_context_mgr_node_lock);
 			target_node = binder_context_mgr_node;
-			if (target_node == NULL) {
+			if (target_node)
+				target_node = binder_get_node_refs_for_txn(
+						target_node, &target_proc,
+						&return_error);
+			else
 				return_error = BR_DEAD_REPLY;
-				goto err_no_context_mgr_node;
-			}
+			mutex_unlock(&binder_context_mgr_node_lock);
 		}
-		e->to_node = target_node->debug_id;
-		target_proc = target_node->proc;
-		if (target_proc == NULL) {
-			return_error = BR_DEAD_REPLY;
+		if (target_node == NULL) {
+			/* return_error is set above */
 			goto err_dead_binder;
 		}
+		e->to_node = target_node->debug_id;
+		binder_inner_proc_lock(proc);
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
-			struct binder_transaction *tmp;
+			struct binder_transaction *tmp, *match = NULL;
+
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
+				spin_lock(&tmp->lock);
 				binder_user_error("binder: %d:%d got new "
 					"transaction with bad transaction stack"
 					", transaction %d has target %d:%d\n",
@@ -1478,24 +2601,38 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				spin_unlock(&tmp->lock);
+				binder_inner_proc_unlock(proc);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
+			/*
+			 * The stack of this thread cannot be popped while we
+			 * hold its inner lock, so only the final pick needs a
+			 * temporary reference.
+			 */
 			while (tmp) {
+				spin_lock(&tmp->lock);
 				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
+					match = tmp;
+				spin_unlock(&tmp->lock);
 				tmp = tmp->from_parent;
 			}
+			if (match) {
+				spin_lock(&match->lock);
+				target_thread = match->from;
+				if (target_thread &&
+				    target_thread->proc == target_proc)
+					atomic_inc(&target_thread->tmp_ref);
+				else
+					target_thread = NULL;
+				spin_unlock(&match->lock);
+			}
 		}
+		binder_inner_proc_unlock(proc);
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1505,6 +2642,7 @@ static void binder_transaction(struct binder_proc *proc,
 		goto err_alloc_t_failed;
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION);
+	spin_lock_init(&t->lock);
 
 	tcomplete = kzalloc(sizeof(*tcomplete), GFP_KERNEL);
 	if (tcomplete == NULL) {
@@ -1513,7 +2651,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1542,7 +2680,7 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1553,12 +2691,18 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (data_iov) {
+		if (binder_copy_iovec_from_user(t->buffer->data, tr->data_size,
+						data_iov, data_iov_count)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid data iovec\n", proc->pid, thread->pid);
+			return_error = BR_FAILED_REPLY;
+			goto err_copy_data_failed;
+		}
+	} else if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
@@ -1592,83 +2736,19 @@ static void binder_transaction(struct binder_proc *proc,
 		fp = (struct flat_binder_object *)(t->buffer->data + *offp);
 		switch (fp->type) {
 		case BINDER_TYPE_BINDER:
-		case BINDER_TYPE_WEAK_BINDER: {
-			struct binder_ref *ref;
-			struct binder_node *node = binder_get_node(proc, fp->binder);
-			if (node == NULL) {
-				node = binder_new_node(proc, fp->binder, fp->cookie);
-				if (node == NULL) {
-					return_error = BR_FAILED_REPLY;
-					goto err_binder_new_node_failed;
-				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
-				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
-			}
-			if (fp->cookie != node->cookie) {
-				binder_user_error("binder: %d:%d sending u%p "
-					"node %d, cookie mismatch %p != %p\n",
-					proc->pid, thread->pid,
-					fp->binder, node->debug_id,
-					fp->cookie, node->cookie);
-				return_error = BR_FAILED_REPLY;
-				goto err_binder_get_ref_for_node_failed;
-			}
-			ref = binder_get_ref_for_node(target_proc, node);
-			if (ref == NULL) {
+		case BINDER_TYPE_WEAK_BINDER:
+			if (binder_translate_binder(fp, t, thread)) {
 				return_error = BR_FAILED_REPLY;
-				goto err_binder_get_ref_for_node_failed;
+				goto err_translate_failed;
 			}
-			if (fp->type == BINDER_TYPE_BINDER)
-				fp->type = BINDER_TYPE_HANDLE;
-			else
-				fp->type = BINDER_TYPE_WEAK_HANDLE;
-			fp->handle = ref->desc;
-			binder_inc_ref(ref, fp->type == BINDER_TYPE_HANDLE,
-				       &thread->todo);
-
-			binder_debug(BINDER_DEBUG_TRANSACTION,
-				     "        node %d u%p -> ref %d desc %d\n",
-				     node->debug_id, node->ptr, ref->debug_id,
-				     ref->desc);
-		} break;
+			break;
 		case BINDER_TYPE_HANDLE:
-		case BINDER_TYPE_WEAK_HANDLE: {
-			struct binder_ref *ref = binder_get_ref(proc, fp->handle);
-			if (ref == NULL) {
-				binder_user_error("binder: %d:%d got "
-					"transaction with invalid "
-					"handle, %ld\n", proc->pid,
-					thread->pid, fp->handle);
+		case BINDER_TYPE_WEAK_HANDLE:
+			if (binder_translate_handle(fp, t, thread)) {
 				return_error = BR_FAILED_REPLY;
-				goto err_binder_get_ref_failed;
-			}
-			if (ref->node->proc == target_proc) {
-				if (fp->type == BINDER_TYPE_HANDLE)
-					fp->type = BINDER_TYPE_BINDER;
-				else
-					fp->type = BINDER_TYPE_WEAK_BINDER;
-				fp->binder = ref->node->ptr;
-				fp->cookie = ref->node->cookie;
-				binder_inc_node(ref->node, fp->type == BINDER_TYPE_BINDER, 0, NULL);
-				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> node %d u%p\n",
-					     ref->debug_id, ref->desc, ref->node->debug_id,
-					     ref->node->ptr);
-			} else {
-				struct binder_ref *new_ref;
-				new_ref = binder_get_ref_for_node(target_proc, ref->node);
-				if (new_ref == NULL) {
-					return_error = BR_FAILED_REPLY;
-					goto err_binder_get_ref_for_node_failed;
-				}
-				fp->handle = new_ref->desc;
-				binder_inc_ref(new_ref, fp->type == BINDER_TYPE_HANDLE, NULL);
-				binder_debug(BINDER_DEBUG_TRANSACTION,
-					     "        ref %d desc %d -> ref %d desc %d (node %d)\n",
-					     ref->debug_id, ref->desc, new_ref->debug_id,
-					     new_ref->desc, ref->node->debug_id);
+				goto err_translate_failed;
 			}
-		} break;
+			break;
 
 		case BINDER_TYPE_FD: {
 			int target_fd;
@@ -1716,47 +2796,84 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	t->work.type = BINDER_WORK_TRANSACTION;
+	t->start_time = ktime_get();
+	trace_binder_transaction(reply, t, target_node);
 	if (reply) {
+		t->call_time = in_reply_to->start_time;
+		binder_enqueue_work(proc, tcomplete, &thread->todo);
+		binder_inner_proc_lock(target_proc);
+		if (target_thread->is_dead) {
+			binder_inner_proc_unlock(target_proc);
+			goto err_dead_proc_or_thread;
+		}
 		BUG_ON(t->buffer->async_transaction != 0);
-		binder_pop_transaction(target_thread, in_reply_to);
+		binder_pop_transaction_ilocked(target_thread, in_reply_to);
+		t->stats_node = in_reply_to->stats_node;
+		in_reply_to->stats_node = NULL;
+		binder_enqueue_work_ilocked(&t->work, &target_thread->todo);
+		binder_inner_proc_unlock(target_proc);
+		wake_up_interruptible(&target_thread->wait);
+		exec_us = ktime_us_delta(t->start_time,
+					 in_reply_to->deliver_time);
+		binder_latency_add(proc, t->stats_node, BINDER_LATENCY_EXEC,
+				   exec_us);
+		trace_binder_transaction_replied(in_reply_to, exec_us);
+		binder_free_transaction(in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		t->call_time = t->start_time;
+		binder_inc_node_tmpref(target_node);
+		t->stats_node = target_node;
+		binder_inner_proc_lock(proc);
+		binder_enqueue_work_ilocked(tcomplete, &thread->todo);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		binder_inner_proc_unlock(proc);
+		if (!binder_proc_transaction(t, target_proc, target_thread)) {
+			binder_inner_proc_lock(proc);
+			binder_pop_transaction_ilocked(thread, t);
+			binder_inner_proc_unlock(proc);
+			goto err_dead_proc_or_thread;
+		}
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
-		if (target_node->has_async_transaction) {
-			target_list = &target_node->async_todo;
-			target_wait = NULL;
-		} else
-			target_node->has_async_transaction = 1;
+		binder_enqueue_work(proc, tcomplete, &thread->todo);
+		if (!binder_proc_transaction(t, target_proc, NULL))
+			goto err_dead_proc_or_thread;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	binder_proc_dec_tmpref(target_proc);
+	if (target_node)
+		binder_put_node(target_node);
 	return;
 
+err_dead_proc_or_thread:
+	return_error = BR_DEAD_REPLY;
+	binder_dequeue_work(proc, tcomplete);
 err_get_unused_fd_failed:
 err_fget_failed:
 err_fd_not_allowed:
-err_binder_get_ref_for_node_failed:
-err_binder_get_ref_failed:
-err_binder_new_node_failed:
+err_translate_failed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
+	if (target_node)
+		binder_put_node(target_node);
+	target_node = NULL;
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
+	if (t->stats_node)
+		binder_put_node(t->stats_node);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
@@ -1764,7 +2881,14 @@ err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
 err_invalid_target_handle:
-err_no_context_mgr_node:
+	if (target_thread)
+		binder_thread_dec_tmpref(target_thread);
+	if (target_proc)
+		binder_proc_dec_tmpref(target_proc);
+	if (target_node) {
+		binder_dec_node(target_node, 1, 0);
+		binder_put_node(target_node);
+	}
 	binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
 		     "binder: %d:%d transaction failed %d, size %zd-%zd\n",
 		     proc->pid, thread->pid, return_error,
@@ -1776,12 +2900,16 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	binder_inner_proc_lock(proc);
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
+		binder_inner_proc_unlock(proc);
 		binder_send_failed_reply(in_reply_to, return_error);
-	} else
+	} else {
 		thread->return_error = return_error;
+		binder_inner_proc_unlock(proc);
+	}
 }
 
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
@@ -1796,9 +2924,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1807,16 +2935,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 		case BC_DECREFS: {
 			uint32_t target;
 			struct binder_ref *ref;
+			struct binder_node *ctx_mgr_node = NULL;
 			const char *debug_string;
+			bool delete_ref = false;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (target == 0 && binder_context_mgr_node &&
+			if (target == 0 &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
-				ref = binder_get_ref_for_node(proc,
-					       binder_context_mgr_node);
-				if (ref->desc != target) {
+				mutex_lock(&binder_context_mgr_node_lock);
+				ctx_mgr_node = binder_context_mgr_node;
+				if (ctx_mgr_node)
+					binder_inc_node_tmpref(ctx_mgr_node);
+				mutex_unlock(&binder_context_mgr_node_lock);
+			}
+			binder_proc_lock(proc);
+			if (ctx_mgr_node) {
+				ref = binder_get_ref_for_node_olocked(proc,
+							ctx_mgr_node);
+				if (ref && ref->desc != target) {
 					binder_user_error("binder: %d:"
 						"%d tried to acquire "
 						"reference to desc 0, "
@@ -1825,8 +2963,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						ref->desc);
 				}
 			} else
-				ref = binder_get_ref(proc, target);
+				ref = binder_get_ref_olocked(proc, target);
 			if (ref == NULL) {
+				binder_proc_unlock(proc);
+				if (ctx_mgr_node)
+					binder_put_node(ctx_mgr_node);
 				binder_user_error("binder: %d:%d refcou"
 					"nt change on invalid ref %d\n",
 					proc->pid, thread->pid, target);
@@ -1835,26 +2976,31 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
-				binder_inc_ref(ref, 0, NULL);
+				binder_inc_ref_olocked(ref, 0, NULL);
 				break;
 			case BC_ACQUIRE:
 				debug_string = "Acquire";
-				binder_inc_ref(ref, 1, NULL);
+				binder_inc_ref_olocked(ref, 1, NULL);
 				break;
 			case BC_RELEASE:
 				debug_string = "Release";
-				binder_dec_ref(ref, 1);
+				delete_ref = binder_dec_ref_olocked(ref, 1);
 				break;
 			case BC_DECREFS:
 			default:
 				debug_string = "DecRefs";
-				binder_dec_ref(ref, 0);
+				delete_ref = binder_dec_ref_olocked(ref, 0);
 				break;
 			}
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s ref %d desc %d s %d w %d for node %d\n",
 				     proc->pid, thread->pid, debug_string, ref->debug_id,
 				     ref->desc, ref->strong, ref->weak, ref->node->debug_id);
+			if (delete_ref)
+				binder_delete_ref_olocked(ref);
+			binder_proc_unlock(proc);
+			if (ctx_mgr_node)
+				binder_put_node(ctx_mgr_node);
 			break;
 		}
 		case BC_INCREFS_DONE:
@@ -1862,6 +3008,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *node_ptr;
 			void *cookie;
 			struct binder_node *node;
+			bool free_node;
 
 			if (get_user(node_ptr, (void * __user *)ptr))
 				return -EFAULT;
@@ -1888,8 +3035,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_put_node(node);
 				break;
 			}
+			binder_node_inner_lock(node);
 			if (cmd == BC_ACQUIRE_DONE) {
 				if (node->pending_strong_ref == 0) {
 					binder_user_error("binder: %d:%d "
@@ -1897,6 +3046,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1907,16 +3058,23 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_node_inner_unlock(node);
+					binder_put_node(node);
 					break;
 				}
 				node->pending_weak_ref = 0;
 			}
-			binder_dec_node(node, cmd == BC_ACQUIRE_DONE, 0);
+			free_node = binder_dec_node_nilocked(node,
+					cmd == BC_ACQUIRE_DONE, 0);
+			/* the temporary reference keeps the node alive */
+			BUG_ON(free_node);
 			binder_debug(BINDER_DEBUG_USER_REFS,
 				     "binder: %d:%d %s node %d ls %d lw %d\n",
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_node_inner_unlock(node);
+			binder_put_node(node);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1934,20 +3092,28 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			mutex_lock(&proc->alloc_lock);
 			buffer = binder_buffer_lookup(proc, data_ptr);
 			if (buffer == NULL) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
 			if (!buffer->allow_user_free) {
+				mutex_unlock(&proc->alloc_lock);
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			/* a second BC_FREE_BUFFER for it must not match */
+			buffer->allow_user_free = 0;
+			mutex_unlock(&proc->alloc_lock);
+
+			binder_inner_proc_lock(proc);
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1957,12 +3123,24 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				buffer->transaction->buffer = NULL;
 				buffer->transaction = NULL;
 			}
+			binder_inner_proc_unlock(proc);
 			if (buffer->async_transaction && buffer->target_node) {
-				BUG_ON(!buffer->target_node->has_async_transaction);
-				if (list_empty(&buffer->target_node->async_todo))
-					buffer->target_node->has_async_transaction = 0;
+				struct binder_node *buf_node = buffer->target_node;
+
+				/*
+				 * thread->todo is protected by our own inner
+				 * lock, which binder_node_inner_lock() skips
+				 * once the node is dead.
+				 */
+				binder_node_lock(buf_node);
+				binder_inner_proc_lock(proc);
+				BUG_ON(!buf_node->has_async_transaction);
+				if (list_empty(&buf_node->async_todo))
+					buf_node->has_async_transaction = 0;
 				else
-					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
+					list_move_tail(buf_node->async_todo.next, &thread->todo);
+				binder_inner_proc_unlock(proc);
+				binder_node_unlock(buf_node);
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
@@ -1976,7 +3154,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, tr.data_iov,
+					   tr.data_iov_count);
 			break;
 		}
 
@@ -1984,6 +3176,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2001,11 +3194,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2014,12 +3209,19 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			binder_inner_proc_unlock(proc);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_inner_proc_lock(proc);
+			/* a retired looper frees its slot for a new spawn */
+			if ((thread->looper & BINDER_LOOPER_STATE_REGISTERED) &&
+			    !(thread->looper & BINDER_LOOPER_STATE_EXITED))
+				proc->requested_threads_started--;
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			binder_inner_proc_unlock(proc);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2027,7 +3229,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			uint32_t target;
 			void __user *cookie;
 			struct binder_ref *ref;
-			struct binder_ref_death *death;
+			struct binder_ref_death *death = NULL;
+			int wake_proc = 0;
 
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
@@ -2035,7 +3238,25 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
-			ref = binder_get_ref(proc, target);
+			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+				/*
+				 * Allocate up front; the node lock taken
+				 * below is a spinlock.
+				 */
+				death = kzalloc(sizeof(*death), GFP_KERNEL);
+				if (death == NULL) {
+					binder_inner_proc_lock(proc);
+					thread->return_error = BR_ERROR;
+					binder_inner_proc_unlock(proc);
+					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
+						     "binder: %d:%d "
+						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
+						     proc->pid, thread->pid);
+					break;
+				}
+			}
+			binder_proc_lock(proc);
+			ref = binder_get_ref_olocked(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
 					"invalid ref %d\n",
@@ -2044,6 +3265,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_REQUEST_DEATH_NOTIFICATION" :
 					"BC_CLEAR_DEATH_NOTIFICATION",
 					target);
+				binder_proc_unlock(proc);
+				kfree(death);
 				break;
 			}
 
@@ -2056,6 +3279,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     cookie, ref->debug_id, ref->desc,
 				     ref->strong, ref->weak, ref->node->debug_id);
 
+			binder_node_lock(ref->node);
 			if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
 				if (ref->death) {
 					binder_user_error("binder: %d:%"
@@ -2063,15 +3287,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"FICATION death notific"
 						"ation already set\n",
 						proc->pid, thread->pid);
-					break;
-				}
-				death = kzalloc(sizeof(*death), GFP_KERNEL);
-				if (death == NULL) {
-					thread->return_error = BR_ERROR;
-					binder_debug(BINDER_DEBUG_FAILED_TRANSACTION,
-						     "binder: %d:%d "
-						     "BC_REQUEST_DEATH_NOTIFICATION failed\n",
-						     proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
+					kfree(death);
 					break;
 				}
 				binder_stats_created(BINDER_STAT_DEATH);
@@ -2080,12 +3298,14 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				ref->death = death;
 				if (ref->node->proc == NULL) {
 					ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+					binder_inner_proc_lock(proc);
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&ref->death->work.entry, &thread->todo);
+						binder_enqueue_work_ilocked(&ref->death->work, &thread->todo);
 					} else {
-						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_enqueue_work_ilocked(&ref->death->work, &proc->todo);
+						wake_proc = 1;
 					}
+					binder_inner_proc_unlock(proc);
 				}
 			} else {
 				if (ref->death == NULL) {
@@ -2094,6 +3314,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"CATION death notificat"
 						"ion not active\n",
 						proc->pid, thread->pid);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				death = ref->death;
@@ -2105,31 +3327,42 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"%p != %p\n",
 						proc->pid, thread->pid,
 						death->cookie, cookie);
+					binder_node_unlock(ref->node);
+					binder_proc_unlock(proc);
 					break;
 				}
 				ref->death = NULL;
+				binder_inner_proc_lock(proc);
 				if (list_empty(&death->work.entry)) {
 					death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 					if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-						list_add_tail(&death->work.entry, &thread->todo);
+						binder_enqueue_work_ilocked(&death->work, &thread->todo);
 					} else {
-						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_enqueue_work_ilocked(&death->work, &proc->todo);
+						wake_proc = 1;
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
 					death->work.type = BINDER_WORK_DEAD_BINDER_AND_CLEAR;
 				}
+				binder_inner_proc_unlock(proc);
 			}
+			binder_node_unlock(ref->node);
+			binder_proc_unlock(proc);
+			if (wake_proc)
+				wake_up_interruptible(&proc->wait);
 		} break;
 		case BC_DEAD_BINDER_DONE: {
 			struct binder_work *w;
 			void __user *cookie;
 			struct binder_ref_death *death = NULL;
+			int wake_proc = 0;
+
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_inner_proc_lock(proc);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2141,22 +3374,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_DEAD_BINDER_DONE %p found %p\n",
 				     proc->pid, thread->pid, cookie, death);
 			if (death == NULL) {
+				binder_inner_proc_unlock(proc);
 				binder_user_error("binder: %d:%d BC_DEAD"
 					"_BINDER_DONE %p not found\n",
 					proc->pid, thread->pid, cookie);
 				break;
 			}
 
-			list_del_init(&death->work.entry);
+			binder_dequeue_work_ilocked(&death->work);
 			if (death->work.type == BINDER_WORK_DEAD_BINDER_AND_CLEAR) {
 				death->work.type = BINDER_WORK_CLEAR_DEATH_NOTIFICATION;
 				if (thread->looper & (BINDER_LOOPER_STATE_REGISTERED | BINDER_LOOPER_STATE_ENTERED)) {
-					list_add_tail(&death->work.entry, &thread->todo);
+					binder_enqueue_work_ilocked(&death->work, &thread->todo);
 				} else {
-					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_enqueue_work_ilocked(&death->work, &proc->todo);
+					wake_proc = 1;
 				}
 			}
+			binder_inner_proc_unlock(proc);
+			if (wake_proc)
+				wake_up_interruptible(&proc->wait);
 		} break;
 
 		default:
@@ -2173,23 +3410,112 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
 static int binder_has_proc_work(struct binder_proc *proc,
 				struct binder_thread *thread)
 {
-	return !list_empty(&proc->todo) ||
+	int has_work;
+
+	binder_inner_proc_lock(proc);
+	has_work = !list_empty(&proc->todo) ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	binder_inner_proc_unlock(proc);
+	return has_work;
 }
 
 static int binder_has_thread_work(struct binder_thread *thread)
 {
-	return !list_empty(&thread->todo) || thread->return_error != BR_OK ||
+	int has_work;
+
+	binder_inner_proc_lock(thread->proc);
+	has_work = !list_empty(&thread->todo) ||
+		thread->return_error != BR_OK ||
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
+	binder_inner_proc_unlock(thread->proc);
+	return has_work;
+}
+
+/*
+ * Age in usecs of the oldest transaction waiting on proc->todo, 0 if
+ * there is none.
+ */
+static s64 binder_todo_age_ilocked(struct binder_proc *proc)
+{
+	struct binder_work *w;
+	struct binder_transaction *t;
+
+	assert_spin_locked(&proc->inner_lock);
+	list_for_each_entry(w, &proc->todo, entry) {
+		if (w->type != BINDER_WORK_TRANSACTION)
+			continue;
+		t = container_of(w, struct binder_transaction, work);
+		return ktime_us_delta(ktime_get(), t->start_time);
+	}
+	return 0;
+}
+
+/*
+ * Decide whether to ask user-space for another looper.  Without an idle
+ * or requested thread one is always needed.  Otherwise spawn when more
+ * transactions are queued than there are threads to take them, or when
+ * the queue has stopped moving.
+ */
+static bool binder_need_spawn_ilocked(struct binder_proc *proc)
+{
+	int spare = proc->ready_threads + proc->requested_threads;
+
+	assert_spin_locked(&proc->inner_lock);
+	if (proc->requested_threads_started + proc->requested_threads >=
+	    proc->max_threads)
+		return false;
+	if (!spare || proc->queued_transactions > spare)
+		return true;
+	return !proc->requested_threads && proc->queued_transactions &&
+		binder_todo_age_ilocked(proc) > binder_spawn_queue_age_us;
+}
+
+/*
+ * Only loopers spawned on request of the driver retire when idle; the
+ * main looper of a process always stays.
+ */
+static long binder_looper_idle_timeout(struct binder_thread *thread)
+{
+	if (!binder_looper_idle_timeout_ms ||
+	    (thread->looper & BINDER_LOOPER_STATE_ENTERED) ||
+	    !(thread->looper & BINDER_LOOPER_STATE_REGISTERED))
+		return MAX_SCHEDULE_TIMEOUT;
+	return msecs_to_jiffies(binder_looper_idle_timeout_ms);
+}
+
+static int binder_wait_for_proc_work(struct binder_proc *proc,
+				     struct binder_thread *thread,
+				     long timeout)
+{
+	DEFINE_WAIT(wait);
+	int ret = 0;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&proc->wait, &wait,
+					  TASK_INTERRUPTIBLE);
+		if (binder_has_proc_work(proc, thread))
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		if (!timeout) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	finish_wait(&proc->wait, &wait);
+	return ret;
 }
 
 static int binder_thread_read(struct binder_proc *proc,
@@ -2210,22 +3536,29 @@ static int binder_thread_read(struct binder_proc *proc,
 	}
 
 retry:
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
 	if (thread->return_error != BR_OK && ptr < end) {
-		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+		uint32_t return_error = thread->return_error;
+		uint32_t return_error2 = thread->return_error2;
+
+		thread->return_error2 = BR_OK;
+		if (return_error2 == BR_OK ||
+		    end - ptr >= 2 * sizeof(uint32_t))
+			thread->return_error = BR_OK;
+		binder_inner_proc_unlock(proc);
+		if (return_error2 != BR_OK) {
+			if (put_user(return_error2, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
-			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		if (put_user(return_error, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		thread->return_error = BR_OK;
 		goto done;
 	}
 
@@ -2233,7 +3566,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2244,12 +3577,13 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = binder_wait_for_proc_work(proc, thread,
+					binder_looper_idle_timeout(thread));
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2257,10 +3591,27 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	thread->wakeup_time = ktime_get();
+	binder_inner_proc_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+	if (ret == -ETIMEDOUT) {
+		/*
+		 * Only leave the pool while another looper is idle and
+		 * nothing is queued, otherwise go back to waiting.
+		 */
+		if (!proc->ready_threads || !list_empty(&proc->todo) ||
+		    !list_empty(&thread->todo)) {
+			binder_inner_proc_unlock(proc);
+			ret = 0;
+			goto retry;
+		}
+		binder_debug(BINDER_DEBUG_THREADS,
+			     "binder: %d:%d idle looper retired\n",
+			     proc->pid, thread->pid);
+	}
+	binder_inner_proc_unlock(proc);
 
 	if (ret)
 		return ret;
@@ -2270,26 +3621,45 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		struct binder_thread *t_from;
+		struct list_head *list;
+		s64 queue_us, wakeup_us;
 
+		binder_inner_proc_lock(proc);
 		if (!list_empty(&thread->todo))
-			w = list_first_entry(&thread->todo, struct binder_work, entry);
+			list = &thread->todo;
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
-			w = list_first_entry(&proc->todo, struct binder_work, entry);
+			list = &proc->todo;
 		else {
+			binder_inner_proc_unlock(proc);
 			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
 				goto retry;
 			break;
 		}
 
-		if (end - ptr < sizeof(tr) + 4)
+		if (end - ptr < sizeof(tr) + 4) {
+			binder_inner_proc_unlock(proc);
 			break;
+		}
+		/*
+		 * Take the work off the list before dropping the lock so
+		 * that no other reader of proc->todo can pick it up too.
+		 */
+		w = list_first_entry(list, struct binder_work, entry);
+		binder_dequeue_work_ilocked(w);
 
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION: {
+			if (list == &proc->todo)
+				proc->queued_transactions--;
+			binder_inner_proc_unlock(proc);
 			t = container_of(w, struct binder_transaction, work);
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			binder_inner_proc_unlock(proc);
 			cmd = BR_TRANSACTION_COMPLETE;
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
@@ -2298,17 +3668,17 @@ retry:
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
 				     "binder: %d:%d BR_TRANSACTION_COMPLETE\n",
 				     proc->pid, thread->pid);
-
-			list_del(&w->entry);
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 		} break;
 		case BINDER_WORK_NODE: {
 			struct binder_node *node = container_of(w, struct binder_node, work);
 			uint32_t cmd = BR_NOOP;
 			const char *cmd_name;
+			void __user *node_ptr = node->ptr;
+			void __user *node_cookie = node->cookie;
+			int node_debug_id = node->debug_id;
 			int strong = node->internal_strong_refs || node->local_strong_refs;
-			int weak = !hlist_empty(&node->refs) || node->local_weak_refs || strong;
+			int weak = !hlist_empty(&node->refs) || node->local_weak_refs ||
+				node->tmp_refs || strong;
 			if (weak && !node->has_weak_ref) {
 				cmd = BR_INCREFS;
 				cmd_name = "BR_INCREFS";
@@ -2331,53 +3701,71 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
+				/*
+				 * Put the node back at the head so the next
+				 * pass can send any further state change.
+				 */
+				list_add(&w->entry, list);
+				binder_inner_proc_unlock(proc);
 				if (put_user(cmd, (uint32_t __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
+				if (put_user(node_ptr, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
+				if (put_user(node_cookie, (void * __user *)ptr))
 					return -EFAULT;
 				ptr += sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
 					     "binder: %d:%d %s %d u%p c%p\n",
-					     proc->pid, thread->pid, cmd_name, node->debug_id, node->ptr, node->cookie);
+					     proc->pid, thread->pid, cmd_name, node_debug_id, node_ptr, node_cookie);
+			} else if (!weak && !strong) {
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p deleted\n",
+					     proc->pid, thread->pid, node_debug_id,
+					     node_ptr, node_cookie);
+				rb_erase(&node->rb_node, &proc->nodes);
+				binder_inner_proc_unlock(proc);
+				/*
+				 * Whoever queued the work may still be on its
+				 * way out of binder_node_inner_unlock().
+				 */
+				binder_node_lock(node);
+				binder_node_unlock(node);
+				binder_free_node(node);
 			} else {
-				list_del_init(&w->entry);
-				if (!weak && !strong) {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p deleted\n",
-						     proc->pid, thread->pid, node->debug_id,
-						     node->ptr, node->cookie);
-					rb_erase(&node->rb_node, &proc->nodes);
-					kfree(node);
-					binder_stats_deleted(BINDER_STAT_NODE);
-				} else {
-					binder_debug(BINDER_DEBUG_INTERNAL_REFS,
-						     "binder: %d:%d node %d u%p c%p state unchanged\n",
-						     proc->pid, thread->pid, node->debug_id, node->ptr,
-						     node->cookie);
-				}
+				binder_inner_proc_unlock(proc);
+				binder_debug(BINDER_DEBUG_INTERNAL_REFS,
+					     "binder: %d:%d node %d u%p c%p state unchanged\n",
+					     proc->pid, thread->pid, node_debug_id, node_ptr,
+					     node_cookie);
 			}
 		} break;
 		case BINDER_WORK_DEAD_BINDER:
 		case BINDER_WORK_DEAD_BINDER_AND_CLEAR:
 		case BINDER_WORK_CLEAR_DEATH_NOTIFICATION: {
 			struct binder_ref_death *death;
+			void __user *cookie;
 			uint32_t cmd;
 
 			death = container_of(w, struct binder_ref_death, work);
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION)
+			cookie = death->cookie;
+			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
-			else
+				binder_inner_proc_unlock(proc);
+				kfree(death);
+				binder_stats_deleted(BINDER_STAT_DEATH);
+			} else {
 				cmd = BR_DEAD_BINDER;
+				binder_enqueue_work_ilocked(w, &proc->delivered_death);
+				binder_inner_proc_unlock(proc);
+			}
 			if (put_user(cmd, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
+			if (put_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
@@ -2386,34 +3774,28 @@ retry:
 				      cmd == BR_DEAD_BINDER ?
 				      "BR_DEAD_BINDER" :
 				      "BR_CLEAR_DEATH_NOTIFICATION_DONE",
-				      death->cookie);
+				      cookie);
 
-			if (w->type == BINDER_WORK_CLEAR_DEATH_NOTIFICATION) {
-				list_del(&w->entry);
-				kfree(death);
-				binder_stats_deleted(BINDER_STAT_DEATH);
-			} else
-				list_move(&w->entry, &proc->delivered_death);
 			if (cmd == BR_DEAD_BINDER)
 				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
+		default:
+			binder_inner_proc_unlock(proc);
+			break;
 		}
 
 		if (!t)
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		t->deliver_time = ktime_get();
+		queue_us = ktime_us_delta(t->deliver_time, t->start_time);
+		wakeup_us = ktime_us_delta(thread->wakeup_time, t->start_time);
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2424,8 +3806,9 @@ retry:
 		tr.flags = t->flags;
 		tr.sender_euid = t->sender_euid;
 
-		if (t->from) {
-			struct task_struct *sender = t->from->proc->tsk;
+		t_from = binder_get_txn_from(t);
+		if (t_from) {
+			struct task_struct *sender = t_from->proc->tsk;
 			tr.sender_pid = task_tgid_nr_ns(sender,
 							current->nsproxy->pid_ns);
 		} else {
@@ -2440,13 +3823,35 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
+		if (put_user(cmd, (uint32_t __user *)ptr) ||
+		    copy_to_user(ptr + sizeof(uint32_t), &tr, sizeof(tr))) {
+			if (t_from)
+				binder_thread_dec_tmpref(t_from);
+			if (cmd == BR_TRANSACTION)
+				binder_set_priority(t->saved_priority);
+			/* leave the transaction queued for the next read */
+			binder_inner_proc_lock(proc);
+			list_add(&t->work.entry, list);
+			if (list == &proc->todo)
+				proc->queued_transactions++;
+			binder_inner_proc_unlock(proc);
 			return -EFAULT;
-		ptr += sizeof(tr);
-
+		}
+		ptr += sizeof(uint32_t) + sizeof(tr);
+
+		binder_latency_add(proc, t->buffer->target_node,
+				   BINDER_LATENCY_QUEUE, queue_us);
+		binder_latency_add(proc, t->buffer->target_node,
+				   BINDER_LATENCY_WAKEUP, wakeup_us);
+		trace_binder_transaction_received(t, queue_us, wakeup_us);
+		if (cmd == BR_REPLY) {
+			s64 reply_us = ktime_us_delta(t->deliver_time,
+						      t->call_time);
+
+			binder_latency_add(proc, t->stats_node,
+					   BINDER_LATENCY_REPLY, reply_us);
+			trace_binder_reply_received(t, reply_us);
+		}
 		binder_stat_br(proc, thread, cmd);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
@@ -2454,21 +3859,22 @@ retry:
 			     proc->pid, thread->pid,
 			     (cmd == BR_TRANSACTION) ? "BR_TRANSACTION" :
 			     "BR_REPLY",
-			     t->debug_id, t->from ? t->from->proc->pid : 0,
-			     t->from ? t->from->pid : 0, cmd,
+			     t->debug_id, t_from ? t_from->proc->pid : 0,
+			     t_from ? t_from->pid : 0, cmd,
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
-		list_del(&t->work.entry);
+		if (t_from)
+			binder_thread_dec_tmpref(t_from);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
+			binder_inner_proc_lock(thread->proc);
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
 			thread->transaction_stack = t;
+			binder_inner_proc_unlock(thread->proc);
 		} else {
-			t->buffer->transaction = NULL;
-			kfree(t);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION);
+			binder_free_transaction(t);
 		}
 		break;
 	}
@@ -2476,93 +3882,207 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
-	if (proc->requested_threads + proc->ready_threads == 0 &&
-	    proc->requested_threads_started < proc->max_threads &&
+	binder_inner_proc_lock(proc);
+	if (binder_need_spawn_ilocked(proc) &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
 		proc->requested_threads++;
+		binder_inner_proc_unlock(proc);
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
 		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
 			return -EFAULT;
+	} else
+		binder_inner_proc_unlock(proc);
+	return 0;
+}
+
+static void binder_release_work(struct binder_proc *proc,
+				struct list_head *list)
+{
+	struct binder_work *w;
+
+	while (1) {
+		w = binder_dequeue_work_head(proc, list);
+		if (!w)
+			return;
+
+		switch (w->type) {
+		case BINDER_WORK_TRANSACTION: {
+			struct binder_transaction *t;
+
+			t = container_of(w, struct binder_transaction, work);
+			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
+				binder_send_failed_reply(t, BR_DEAD_REPLY);
+			else if (!t->buffer->target_node)
+				binder_free_transaction(t);
+		} break;
+		case BINDER_WORK_TRANSACTION_COMPLETE: {
+			kfree(w);
+			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
+		} break;
+		default:
+			break;
+		}
+	}
+
+}
+
+static struct binder_thread *binder_get_thread_ilocked(
+		struct binder_proc *proc, struct binder_thread *new_thread)
+{
+	struct binder_thread *thread = NULL;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &proc->threads.rb_node;
+
+	while (*p) {
+		parent = *p;
+		thread = rb_entry(parent, struct binder_thread, rb_node);
+
+		if (current->pid < thread->pid)
+			p = &(*p)->rb_left;
+		else if (current->pid > thread->pid)
+			p = &(*p)->rb_right;
+		else
+			return thread;
+	}
+	if (!new_thread)
+		return NULL;
+	thread = new_thread;
+	binder_stats_created(BINDER_STAT_THREAD);
+	thread->proc = proc;
+	thread->pid = current->pid;
+	atomic_set(&thread->tmp_ref, 0);
+	init_waitqueue_head(&thread->wait);
+	INIT_LIST_HEAD(&thread->todo);
+	rb_link_node(&thread->rb_node, parent, p);
+	rb_insert_color(&thread->rb_node, &proc->threads);
+	thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
+	thread->return_error = BR_OK;
+	thread->return_error2 = BR_OK;
+	return thread;
+}
+
+static struct binder_thread *binder_get_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	struct binder_thread *new_thread;
+
+	binder_inner_proc_lock(proc);
+	thread = binder_get_thread_ilocked(proc, NULL);
+	binder_inner_proc_unlock(proc);
+	if (!thread) {
+		new_thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+		if (new_thread == NULL)
+			return NULL;
+		binder_inner_proc_lock(proc);
+		thread = binder_get_thread_ilocked(proc, new_thread);
+		binder_inner_proc_unlock(proc);
+		if (thread != new_thread)
+			kfree(new_thread);
+	}
+	return thread;
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!list_empty(&proc->todo));
+
+	buffers = 0;
+	mutex_lock(&proc->alloc_lock);
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		struct binder_transaction *t = buffer->transaction;
+
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			printk(KERN_ERR "binder: release proc %d, "
+			       "transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		__binder_free_buf(proc, buffer);
+		buffers++;
+	}
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i].page_ptr) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+					     "binder_release: %d: "
+					     "page %d at %p not freed\n",
+					     proc->pid, i,
+					     page_addr);
+				binder_lru_del(&proc->pages[i]);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				__free_page(proc->pages[i].page_ptr);
+				page_count++;
+			}
+		}
 	}
-	return 0;
-}
+	mutex_unlock(&proc->alloc_lock);
 
-static void binder_release_work(struct list_head *list)
-{
-	struct binder_work *w;
-	while (!list_empty(list)) {
-		w = list_first_entry(list, struct binder_work, entry);
-		list_del_init(&w->entry);
-		switch (w->type) {
-		case BINDER_WORK_TRANSACTION: {
-			struct binder_transaction *t;
+	binder_stats_deleted(BINDER_STAT_PROC);
 
-			t = container_of(w, struct binder_transaction, work);
-			if (t->buffer->target_node && !(t->flags & TF_ONE_WAY))
-				binder_send_failed_reply(t, BR_DEAD_REPLY);
-		} break;
-		case BINDER_WORK_TRANSACTION_COMPLETE: {
-			kfree(w);
-			binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
-		} break;
-		default:
-			break;
-		}
+	if (proc->pages) {
+		kfree(proc->pages);
+		vfree(proc->buffer);
 	}
 
-}
+	put_task_struct(proc->tsk);
 
-static struct binder_thread *binder_get_thread(struct binder_proc *proc)
-{
-	struct binder_thread *thread = NULL;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &proc->threads.rb_node;
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d freed %d buffers, %d pages\n",
+		     proc->pid, buffers, page_count);
 
-	while (*p) {
-		parent = *p;
-		thread = rb_entry(parent, struct binder_thread, rb_node);
+	kfree(proc);
+}
 
-		if (current->pid < thread->pid)
-			p = &(*p)->rb_left;
-		else if (current->pid > thread->pid)
-			p = &(*p)->rb_right;
-		else
-			break;
-	}
-	if (*p == NULL) {
-		thread = kzalloc(sizeof(*thread), GFP_KERNEL);
-		if (thread == NULL)
-			return NULL;
-		binder_stats_created(BINDER_STAT_THREAD);
-		thread->proc = proc;
-		thread->pid = current->pid;
-		init_waitqueue_head(&thread->wait);
-		INIT_LIST_HEAD(&thread->todo);
-		rb_link_node(&thread->rb_node, parent, p);
-		rb_insert_color(&thread->rb_node, &proc->threads);
-		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
-		thread->return_error = BR_OK;
-		thread->return_error2 = BR_OK;
-	}
-	return thread;
+static void binder_free_thread(struct binder_thread *thread)
+{
+	BUG_ON(!list_empty(&thread->todo));
+	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_proc_dec_tmpref(thread->proc);
+	kfree(thread);
 }
 
-static int binder_free_thread(struct binder_proc *proc,
-			      struct binder_thread *thread)
+static int binder_thread_release(struct binder_proc *proc,
+				 struct binder_thread *thread)
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
+	struct binder_transaction *last_t;
 	int active_transactions = 0;
 
+	binder_inner_proc_lock(thread->proc);
+	/*
+	 * The proc reference is dropped in binder_free_thread(), the
+	 * thread reference at the end of this function.
+	 */
+	proc->tmp_ref++;
+	atomic_inc(&thread->tmp_ref);
 	rb_erase(&thread->rb_node, &proc->threads);
 	t = thread->transaction_stack;
-	if (t && t->to_thread == thread)
-		send_reply = t;
+	if (t) {
+		spin_lock(&t->lock);
+		if (t->to_thread == thread)
+			send_reply = t;
+	}
+	thread->is_dead = 1;
+
 	while (t) {
+		last_t = t;
 		active_transactions++;
 		binder_debug(BINDER_DEBUG_DEAD_TRANSACTION,
 			     "binder: release %d:%d transaction %d "
@@ -2583,12 +4103,16 @@ static int binder_free_thread(struct binder_proc *proc,
 			t = t->from_parent;
 		} else
 			BUG();
+		spin_unlock(&last_t->lock);
+		if (t)
+			spin_lock(&t->lock);
 	}
+	binder_inner_proc_unlock(thread->proc);
+
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
-	binder_release_work(&thread->todo);
-	kfree(thread);
-	binder_stats_deleted(BINDER_STAT_THREAD);
+	binder_release_work(proc, &thread->todo);
+	binder_thread_dec_tmpref(thread);
 	return active_transactions;
 }
 
@@ -2599,12 +4123,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
+	if (thread == NULL)
+		return POLLERR;
 
+	binder_inner_proc_lock(proc);
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_inner_proc_unlock(proc);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2622,6 +4148,46 @@ static unsigned int binder_poll(struct file *filp,
 	return 0;
 }
 
+static int binder_ioctl_set_ctx_mgr(struct binder_proc *proc)
+{
+	int ret = 0;
+	struct binder_node *new_node;
+
+	mutex_lock(&binder_context_mgr_node_lock);
+	if (binder_context_mgr_node != NULL) {
+		printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
+		ret = -EBUSY;
+		goto out;
+	}
+	if (binder_context_mgr_uid != -1) {
+		if (binder_context_mgr_uid != current->cred->euid) {
+			printk(KERN_ERR "binder: BINDER_SET_"
+			       "CONTEXT_MGR bad uid %d != %d\n",
+			       current->cred->euid,
+			       binder_context_mgr_uid);
+			ret = -EPERM;
+			goto out;
+		}
+	} else
+		binder_context_mgr_uid = current->cred->euid;
+	new_node = binder_new_node(proc, NULL);
+	if (new_node == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	binder_node_inner_lock(new_node);
+	new_node->local_weak_refs++;
+	new_node->local_strong_refs++;
+	new_node->has_strong_ref = 1;
+	new_node->has_weak_ref = 1;
+	binder_context_mgr_node = new_node;
+	binder_node_inner_unlock(new_node);
+	binder_put_node(new_node);
+out:
+	mutex_unlock(&binder_context_mgr_node_lock);
+	return ret;
+}
+
 static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	int ret;
@@ -2636,7 +4202,6 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2669,8 +4234,13 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		}
 		if (bwr.read_size > 0) {
+			int wake_proc;
+
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
-			if (!list_empty(&proc->todo))
+			binder_inner_proc_lock(proc);
+			wake_proc = !list_empty(&proc->todo);
+			binder_inner_proc_unlock(proc);
+			if (wake_proc)
 				wake_up_interruptible(&proc->wait);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
@@ -2688,43 +4258,27 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_inner_proc_lock(proc);
+		proc->max_threads = max_threads;
+		binder_inner_proc_unlock(proc);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
-		if (binder_context_mgr_node != NULL) {
-			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
-			ret = -EBUSY;
-			goto err;
-		}
-		if (binder_context_mgr_uid != -1) {
-			if (binder_context_mgr_uid != current->cred->euid) {
-				printk(KERN_ERR "binder: BINDER_SET_"
-				       "CONTEXT_MGR bad uid %d != %d\n",
-				       current->cred->euid,
-				       binder_context_mgr_uid);
-				ret = -EPERM;
-				goto err;
-			}
-		} else
-			binder_context_mgr_uid = current->cred->euid;
-		binder_context_mgr_node = binder_new_node(proc, NULL, NULL);
-		if (binder_context_mgr_node == NULL) {
-			ret = -ENOMEM;
+		ret = binder_ioctl_set_ctx_mgr(proc);
+		if (ret)
 			goto err;
-		}
-		binder_context_mgr_node->local_weak_refs++;
-		binder_context_mgr_node->local_strong_refs++;
-		binder_context_mgr_node->has_strong_ref = 1;
-		binder_context_mgr_node->has_weak_ref = 1;
 		break;
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
-		binder_free_thread(proc, thread);
+		binder_thread_release(proc, thread);
 		thread = NULL;
 		break;
 	case BINDER_VERSION:
@@ -2743,11 +4297,13 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		binder_inner_proc_lock(proc);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		binder_inner_proc_unlock(proc);
+	}
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
-	if (ret && ret != -ERESTARTSYS)
+	if (ret && ret != -ERESTARTSYS && ret != -ETIMEDOUT)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
 	return ret;
 }
@@ -2787,6 +4343,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2804,6 +4361,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	vma->vm_flags = (vma->vm_flags | VM_DONTCOPY) & ~VM_MAYWRITE;
 
+	mutex_lock(&binder_mmap_lock);
 	if (proc->buffer) {
 		ret = -EBUSY;
 		failure_string = "already mapped";
@@ -2834,6 +4392,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2849,9 +4411,13 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
-	barrier();
+	mutex_lock(&proc->files_lock);
 	proc->files = get_files_struct(current);
+	mutex_unlock(&proc->files_lock);
+	/* publish the buffer setup before the vma, see binder_alloc_buf() */
+	smp_wmb();
 	proc->vma = vma;
+	mutex_unlock(&binder_mmap_lock);
 
 	/*printk(KERN_INFO "binder_mmap: %d %lx-%lx maps %p\n",
 		 proc->pid, vma->vm_start, vma->vm_end, proc->buffer);*/
@@ -2865,6 +4431,7 @@ err_alloc_pages_failed:
 	proc->buffer = NULL;
 err_get_vm_area_failed:
 err_already_mapped:
+	mutex_unlock(&binder_mmap_lock);
 err_bad_arg:
 	printk(KERN_ERR "binder_mmap: %d %lx-%lx %s failed %d\n",
 	       proc->pid, vma->vm_start, vma->vm_end, failure_string, ret);
@@ -2874,6 +4441,7 @@ err_bad_arg:
 static int binder_open(struct inode *nodp, struct file *filp)
 {
 	struct binder_proc *proc;
+	int i;
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE, "binder_open: %d:%d\n",
 		     current->group_leader->pid, current->pid);
@@ -2883,16 +4451,31 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->outer_lock);
+	spin_lock_init(&proc->inner_lock);
+	mutex_init(&proc->alloc_lock);
+	mutex_init(&proc->files_lock);
+	for (i = 0; i < BINDER_FREE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->free_classes[i]);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	/*
+	 * Idle threads go back to this between transactions; it must not
+	 * hand the opener's rt policy to every thread of the pool.
+	 */
+	if (binder_is_rt_policy(current->policy))
+		proc->default_priority.sched_policy = SCHED_NORMAL;
+	else
+		proc->default_priority.sched_policy = current->policy;
+	proc->default_priority.prio = task_nice(current);
 	binder_stats_created(BINDER_STAT_PROC);
-	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+
+	mutex_lock(&binder_procs_lock);
+	hlist_add_head(&proc->proc_node, &binder_procs);
+	mutex_unlock(&binder_procs_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2917,6 +4500,8 @@ static void binder_deferred_flush(struct binder_proc *proc)
 {
 	struct rb_node *n;
 	int wake_count = 0;
+
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n)) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2925,6 +4510,7 @@ static void binder_deferred_flush(struct binder_proc *proc)
 			wake_count++;
 		}
 	}
+	binder_inner_proc_unlock(proc);
 	wake_up_interruptible_all(&proc->wait);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
@@ -2941,128 +4527,132 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
-static void binder_deferred_release(struct binder_proc *proc)
+static int binder_node_release(struct binder_node *node, int refs)
 {
+	struct binder_ref *ref;
 	struct hlist_node *pos;
-	struct binder_transaction *t;
+	int death = 0;
+	struct binder_proc *proc = node->proc;
+
+	binder_release_work(proc, &node->async_todo);
+
+	binder_node_lock(node);
+	binder_inner_proc_lock(proc);
+	binder_dequeue_work_ilocked(&node->work);
+	/* the caller holds a temporary reference */
+	BUG_ON(!node->tmp_refs);
+	if (hlist_empty(&node->refs) && node->tmp_refs == 1) {
+		binder_inner_proc_unlock(proc);
+		binder_node_unlock(node);
+		binder_free_node(node);
+		return refs;
+	}
+
+	node->proc = NULL;
+	node->local_strong_refs = 0;
+	node->local_weak_refs = 0;
+	binder_inner_proc_unlock(proc);
+
+	hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
+		refs++;
+		if (!ref->death)
+			continue;
+		death++;
+		binder_inner_proc_lock(ref->proc);
+		if (list_empty(&ref->death->work.entry)) {
+			ref->death->work.type = BINDER_WORK_DEAD_BINDER;
+			binder_enqueue_work_ilocked(&ref->death->work,
+						    &ref->proc->todo);
+			wake_up_interruptible(&ref->proc->wait);
+		} else
+			BUG();
+		binder_inner_proc_unlock(ref->proc);
+	}
+	binder_debug(BINDER_DEBUG_DEAD_BINDER,
+		     "binder: node %d now dead, "
+		     "refs %d, death %d\n", node->debug_id,
+		     refs, death);
+	binder_node_unlock(node);
+
+	/* the temporary reference keeps the node off binder_free_node() */
+	spin_lock(&binder_dead_nodes_lock);
+	hlist_add_head(&node->dead_node, &binder_dead_nodes);
+	spin_unlock(&binder_dead_nodes_lock);
+	binder_put_node(node);
+
+	return refs;
+}
+
+static void binder_deferred_release(struct binder_proc *proc)
+{
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	mutex_lock(&binder_procs_lock);
 	hlist_del(&proc->proc_node);
+	mutex_unlock(&binder_procs_lock);
+
+	mutex_lock(&binder_context_mgr_node_lock);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
 			     "binder_release: %d context_mgr_node gone\n",
 			     proc->pid);
 		binder_context_mgr_node = NULL;
 	}
+	mutex_unlock(&binder_context_mgr_node_lock);
 
+	binder_inner_proc_lock(proc);
+	/* keep proc alive until every thread below has been freed */
+	proc->tmp_ref++;
+	proc->is_dead = 1;
 	threads = 0;
 	active_transactions = 0;
 	while ((n = rb_first(&proc->threads))) {
 		struct binder_thread *thread = rb_entry(n, struct binder_thread, rb_node);
+
+		binder_inner_proc_unlock(proc);
 		threads++;
-		active_transactions += binder_free_thread(proc, thread);
+		active_transactions += binder_thread_release(proc, thread);
+		binder_inner_proc_lock(proc);
 	}
+
 	nodes = 0;
 	incoming_refs = 0;
 	while ((n = rb_first(&proc->nodes))) {
 		struct binder_node *node = rb_entry(n, struct binder_node, rb_node);
 
 		nodes++;
+		/* dropped by binder_node_release() */
+		binder_inc_node_tmpref_ilocked(node);
 		rb_erase(&node->rb_node, &proc->nodes);
-		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
-			kfree(node);
-			binder_stats_deleted(BINDER_STAT_NODE);
-		} else {
-			struct binder_ref *ref;
-			int death = 0;
-
-			node->proc = NULL;
-			node->local_strong_refs = 0;
-			node->local_weak_refs = 0;
-			hlist_add_head(&node->dead_node, &binder_dead_nodes);
-
-			hlist_for_each_entry(ref, pos, &node->refs, node_entry) {
-				incoming_refs++;
-				if (ref->death) {
-					death++;
-					if (list_empty(&ref->death->work.entry)) {
-						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
-						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
-					} else
-						BUG();
-				}
-			}
-			binder_debug(BINDER_DEBUG_DEAD_BINDER,
-				     "binder: node %d now dead, "
-				     "refs %d, death %d\n", node->debug_id,
-				     incoming_refs, death);
-		}
+		binder_inner_proc_unlock(proc);
+		incoming_refs = binder_node_release(node, incoming_refs);
+		binder_inner_proc_lock(proc);
 	}
+	binder_inner_proc_unlock(proc);
+
 	outgoing_refs = 0;
+	binder_proc_lock(proc);
 	while ((n = rb_first(&proc->refs_by_desc))) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
 		outgoing_refs++;
-		binder_delete_ref(ref);
-	}
-	binder_release_work(&proc->todo);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
-
-	binder_stats_deleted(BINDER_STAT_PROC);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
+		binder_delete_ref_olocked(ref);
 	}
+	binder_proc_unlock(proc);
 
-	put_task_struct(proc->tsk);
+	binder_release_work(proc, &proc->todo);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
+		     "refs %d, active transactions %d\n",
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     active_transactions);
 
-	kfree(proc);
+	binder_proc_dec_tmpref(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3072,7 +4662,6 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3088,9 +4677,11 @@ static void binder_deferred_func(struct work_struct *work)
 
 		files = NULL;
 		if (defer & BINDER_DEFERRED_PUT_FILES) {
+			mutex_lock(&proc->files_lock);
 			files = proc->files;
 			if (files)
 				proc->files = NULL;
+			mutex_unlock(&proc->files_lock);
 		}
 
 		if (defer & BINDER_DEFERRED_FLUSH)
@@ -3099,7 +4690,6 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3119,17 +4709,34 @@ binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer)
 	mutex_unlock(&binder_deferred_lock);
 }
 
-static void print_binder_transaction(struct seq_file *m, const char *prefix,
+/*
+ * Called with proc->inner_lock held.  t->buffer belongs to t->to_proc,
+ * so it is only looked at when that is the proc being printed.
+ */
+static void print_binder_transaction(struct seq_file *m,
+				     struct binder_proc *proc,
+				     const char *prefix,
 				     struct binder_transaction *t)
 {
+	struct binder_proc *to_proc;
+
+	spin_lock(&t->lock);
+	to_proc = t->to_proc;
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
-		   t->to_proc ? t->to_proc->pid : 0,
+		   to_proc ? to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
+	spin_unlock(&t->lock);
+
+	if (proc != to_proc) {
+		seq_puts(m, "\n");
+		return;
+	}
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3151,7 +4758,8 @@ static void print_binder_buffer(struct seq_file *m, const char *prefix,
 		   buffer->transaction ? "active" : "delivered");
 }
 
-static void print_binder_work(struct seq_file *m, const char *prefix,
+static void print_binder_work(struct seq_file *m, struct binder_proc *proc,
+			      const char *prefix,
 			      const char *transaction_prefix,
 			      struct binder_work *w)
 {
@@ -3161,7 +4769,7 @@ static void print_binder_work(struct seq_file *m, const char *prefix,
 	switch (w->type) {
 	case BINDER_WORK_TRANSACTION:
 		t = container_of(w, struct binder_transaction, work);
-		print_binder_transaction(m, transaction_prefix, t);
+		print_binder_transaction(m, proc, transaction_prefix, t);
 		break;
 	case BINDER_WORK_TRANSACTION_COMPLETE:
 		seq_printf(m, "%stransaction complete\n", prefix);
@@ -3200,25 +4808,31 @@ static void print_binder_thread(struct seq_file *m,
 	t = thread->transaction_stack;
 	while (t) {
 		if (t->from == thread) {
-			print_binder_transaction(m,
+			print_binder_transaction(m, thread->proc,
 						 "    outgoing transaction", t);
 			t = t->from_parent;
 		} else if (t->to_thread == thread) {
-			print_binder_transaction(m,
+			print_binder_transaction(m, thread->proc,
 						 "    incoming transaction", t);
 			t = t->to_parent;
 		} else {
-			print_binder_transaction(m, "    bad transaction", t);
+			print_binder_transaction(m, thread->proc,
+						 "    bad transaction", t);
 			t = NULL;
 		}
 	}
 	list_for_each_entry(w, &thread->todo, entry) {
-		print_binder_work(m, "    ", "    pending transaction", w);
+		print_binder_work(m, thread->proc, "    ",
+				  "    pending transaction", w);
 	}
 	if (!print_always && m->count == header_pos)
 		m->count = start_pos;
 }
 
+/*
+ * Called with node->lock or the owning proc's inner lock held; either is
+ * enough to keep node->refs stable.
+ */
 static void print_binder_node(struct seq_file *m, struct binder_node *node)
 {
 	struct binder_ref *ref;
@@ -3242,7 +4856,7 @@ static void print_binder_node(struct seq_file *m, struct binder_node *node)
 	}
 	seq_puts(m, "\n");
 	list_for_each_entry(w, &node->async_todo, entry)
-		print_binder_work(m, "    ",
+		print_binder_work(m, node->proc, "    ",
 				  "    pending async transaction", w);
 }
 
@@ -3264,6 +4878,7 @@ static void print_binder_proc(struct seq_file *m,
 	seq_printf(m, "proc %d\n", proc->pid);
 	header_pos = m->count;
 
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		print_binder_thread(m, rb_entry(n, struct binder_thread,
 						rb_node), print_all);
@@ -3273,22 +4888,29 @@ static void print_binder_proc(struct seq_file *m,
 		if (print_all || node->has_async_transaction)
 			print_binder_node(m, node);
 	}
+	binder_inner_proc_unlock(proc);
 	if (print_all) {
+		binder_proc_lock(proc);
 		for (n = rb_first(&proc->refs_by_desc);
 		     n != NULL;
 		     n = rb_next(n))
 			print_binder_ref(m, rb_entry(n, struct binder_ref,
 						     rb_node_desc));
+		binder_proc_unlock(proc);
 	}
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		print_binder_buffer(m, "  buffer",
 				    rb_entry(n, struct binder_buffer, rb_node));
+	mutex_unlock(&proc->alloc_lock);
+	binder_inner_proc_lock(proc);
 	list_for_each_entry(w, &proc->todo, entry)
-		print_binder_work(m, "  ", "  pending transaction", w);
+		print_binder_work(m, proc, "  ", "  pending transaction", w);
 	list_for_each_entry(w, &proc->delivered_death, entry) {
 		seq_puts(m, "  has delivered dead binder\n");
 		break;
 	}
+	binder_inner_proc_unlock(proc);
 	if (!print_all && m->count == header_pos)
 		m->count = start_pos;
 }
@@ -3331,7 +4953,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3352,17 +4976,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3370,11 +4998,13 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
@@ -3385,23 +5015,35 @@ static void print_binder_proc_stats(struct seq_file *m,
 	struct rb_node *n;
 	int count, strong, weak;
 
+	size_t free_async_space;
+
 	seq_printf(m, "proc %d\n", proc->pid);
 	count = 0;
+	binder_inner_proc_lock(proc);
 	for (n = rb_first(&proc->threads); n != NULL; n = rb_next(n))
 		count++;
 	seq_printf(m, "  threads: %d\n", count);
+	binder_inner_proc_unlock(proc);
+	mutex_lock(&proc->alloc_lock);
+	free_async_space = proc->free_async_space;
+	mutex_unlock(&proc->alloc_lock);
+	binder_inner_proc_lock(proc);
 	seq_printf(m, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
+			"  queued transactions %d, oldest %lldus\n"
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads, proc->queued_transactions,
+			binder_todo_age_ilocked(proc), free_async_space);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
+	binder_inner_proc_unlock(proc);
 	seq_printf(m, "  nodes: %d\n", count);
 	count = 0;
 	strong = 0;
 	weak = 0;
+	binder_proc_lock(proc);
 	for (n = rb_first(&proc->refs_by_desc); n != NULL; n = rb_next(n)) {
 		struct binder_ref *ref = rb_entry(n, struct binder_ref,
 						  rb_node_desc);
@@ -3409,14 +5051,18 @@ static void print_binder_proc_stats(struct seq_file *m,
 		strong += ref->strong;
 		weak += ref->weak;
 	}
+	binder_proc_unlock(proc);
 	seq_printf(m, "  refs: %d s %d w %d\n", count, strong, weak);
 
 	count = 0;
+	mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	mutex_unlock(&proc->alloc_lock);
 	seq_printf(m, "  buffers: %d\n", count);
 
 	count = 0;
+	binder_inner_proc_lock(proc);
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
 		case BINDER_WORK_TRANSACTION:
@@ -3426,6 +5072,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 			break;
 		}
 	}
+	binder_inner_proc_unlock(proc);
 	seq_printf(m, "  pending transactions: %d\n", count);
 
 	print_binder_stats(m, "  ", &proc->stats);
@@ -3439,20 +5086,24 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	struct binder_node *node;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder state:\n");
 
+	spin_lock(&binder_dead_nodes_lock);
 	if (!hlist_empty(&binder_dead_nodes))
 		seq_puts(m, "dead nodes:\n");
-	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
+	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node) {
+		binder_node_lock(node);
 		print_binder_node(m, node);
+		binder_node_unlock(node);
+	}
+	spin_unlock(&binder_dead_nodes_lock);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3462,17 +5113,16 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
 
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3482,28 +5132,38 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-
 	seq_puts(m, "binder transactions:\n");
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
 static int binder_proc_show(struct seq_file *m, void *unused)
 {
+	struct binder_proc *itr;
 	struct binder_proc *proc = m->private;
+	struct hlist_node *pos;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
-	seq_puts(m, "binder proc state:\n");
-	print_binder_proc(m, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+	if (!do_lock) {
+		seq_puts(m, "binder proc state:\n");
+		print_binder_proc(m, proc, 1);
+		return 0;
+	}
+	/* the proc may already be on its way out */
+	mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(itr, pos, &binder_procs, proc_node) {
+		if (itr == proc) {
+			seq_puts(m, "binder proc state:\n");
+			print_binder_proc(m, proc, 1);
+			break;
+		}
+	}
+	mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3521,14 +5181,135 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int log_cur = atomic_read(&log->cur);
+	unsigned int count;
+	unsigned int cur;
+	int i;
+
+	/* cur is the last slot handed out, -1 before the first */
+	count = log_cur + 1;
+	cur = count < ARRAY_SIZE(log->entry) && !log->full ?
+		0 : count % ARRAY_SIZE(log->entry);
+	if (count > ARRAY_SIZE(log->entry) || log->full)
+		count = ARRAY_SIZE(log->entry);
+	for (i = 0; i < count; i++) {
+		unsigned int index = cur++ % ARRAY_SIZE(log->entry);
+
+		print_binder_transaction_log_entry(m, &log->entry[index]);
+	}
+	return 0;
+}
+
+static void print_binder_hist(struct seq_file *m, const char *prefix,
+			      const char *name, const char *unit,
+			      atomic_t *hist)
+{
+	int i;
+
+	seq_printf(m, "%s%s:\n", prefix, name);
+	for (i = 0; i < BINDER_HIST_BUCKETS; i++) {
+		int count = atomic_read(&hist[i]);
+
+		if (!count)
+			continue;
+		if (i == BINDER_HIST_BUCKETS - 1)
+			seq_printf(m, "%s  >= %lu%s: %d\n", prefix,
+				   1UL << (i - 1), unit, count);
+		else
+			seq_printf(m, "%s  < %lu%s: %d\n", prefix,
+				   1UL << i, unit, count);
+	}
+}
+
+static int binder_alloc_stats_show(struct seq_file *m, void *unused)
+{
+	seq_puts(m, "binder alloc stats:\n");
+	seq_printf(m, "size class hits: %d\n",
+		   atomic_read(&binder_alloc_stats.class_hits));
+	seq_printf(m, "size tree hits: %d\n",
+		   atomic_read(&binder_alloc_stats.tree_hits));
+	seq_printf(m, "failed: %d\n",
+		   atomic_read(&binder_alloc_stats.failed));
+	seq_printf(m, "pages allocated: %d reused: %d reclaimed: %d "
+		   "on lru: %d\n",
+		   atomic_read(&binder_alloc_stats.pages_allocated),
+		   atomic_read(&binder_alloc_stats.pages_reused),
+		   atomic_read(&binder_alloc_stats.pages_reclaimed),
+		   binder_lru_count);
+	print_binder_hist(m, "", "size", "", binder_alloc_stats.size_hist);
+	print_binder_hist(m, "", "latency", "us",
+			  binder_alloc_stats.latency_hist);
+	return 0;
+}
+
+static const char *binder_latency_strings[] = {
+	"queue",
+	"wakeup",
+	"exec",
+	"reply"
+};
+
+static int binder_latency_stats_empty(struct binder_latency_stats *stats)
+{
+	int i, j;
+
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++)
+		for (j = 0; j < BINDER_HIST_BUCKETS; j++)
+			if (atomic_read(&stats->hist[i][j]))
+				return 0;
+	return 1;
+}
+
+static void print_binder_latency_stats(struct seq_file *m, const char *prefix,
+				       struct binder_latency_stats *stats)
+{
 	int i;
 
-	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
-			print_binder_transaction_log_entry(m, &log->entry[i]);
+	BUILD_BUG_ON(ARRAY_SIZE(binder_latency_strings) !=
+		     BINDER_LATENCY_COUNT);
+	for (i = 0; i < BINDER_LATENCY_COUNT; i++)
+		print_binder_hist(m, prefix, binder_latency_strings[i], "us",
+				  stats->hist[i]);
+}
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	struct rb_node *n;
+
+	if (binder_latency_stats_empty(&proc->latency_stats))
+		return;
+	seq_printf(m, "proc %d\n", proc->pid);
+	print_binder_latency_stats(m, "  ", &proc->latency_stats);
+	binder_inner_proc_lock(proc);
+	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+		struct binder_node *node = rb_entry(n, struct binder_node,
+						    rb_node);
+
+		if (binder_latency_stats_empty(&node->latency_stats))
+			continue;
+		seq_printf(m, "  node %d: u%p c%p\n", node->debug_id,
+			   node->ptr, node->cookie);
+		print_binder_latency_stats(m, "    ", &node->latency_stats);
 	}
-	for (i = 0; i < log->next; i++)
-		print_binder_transaction_log_entry(m, &log->entry[i]);
+	binder_inner_proc_unlock(proc);
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	seq_puts(m, "binder latency:\n");
+	print_binder_latency_stats(m, "", &binder_latency_stats);
+
+	if (do_lock)
+		mutex_lock(&binder_procs_lock);
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	if (do_lock)
+		mutex_unlock(&binder_procs_lock);
 	return 0;
 }
 
@@ -3552,6 +5333,8 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(alloc_stats);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3566,6 +5349,7 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3592,6 +5376,16 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("alloc_stats",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_alloc_stats_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
@@ -147,6 +147,19 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * Argument of BC_TRANSACTION_SG and BC_REPLY_SG.  The data of the
+ * transaction is the concatenation of the data_iov segments instead of
+ * transaction_data.data.ptr.buffer; the segment lengths must add up to
+ * transaction_data.data_size.  Offsets are relative to the gathered
+ * data, as for a flat transaction.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	const struct iovec __user	*data_iov;
+	size_t				data_iov_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +337,16 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: like BC_TRANSACTION and BC_REPLY, but
+	 * the data is gathered from a user iovec straight into the target's
+	 * buffer, so the sender does not have to flatten it first.  Large
+	 * payloads are better sent as a BINDER_TYPE_FD object referring to
+	 * a shared memory region, which the target can map without any copy.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
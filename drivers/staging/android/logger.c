@@ -20,11 +20,19 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -33,20 +41,74 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Writers do not serialize against each other while copying their payload.
+ * Under 'write_lock' a writer only reserves space at 'w_reserve', pushes
+ * 'head' past the entries it is about to overwrite and stores its header,
+ * marked pending. It then copies the payload without any lock held and
+ * commits by clearing the mark. 'w_off', the end of what readers may see,
+ * moves over every committed entry at its position, so entries are
+ * published in order as soon as all older ones are committed.
+ *
+ * All offsets are free running positions, see logger_offset(). Readers are
+ * not fixed up by writers: a reader that finds 'head' ahead of it has been
+ * lapped and restarts at 'head'. The reader list is protected by 'mutex'.
+ *
+ * The ring can be resized at runtime, see logger_resize(). With a non-zero
+ * 'archive_size', entries leaving the newest half of the ring are also LZO
+ * compressed into 'archive' so that readers can go back further than the
+ * ring holds. The archive is protected by 'archive_lock'.
+ *
+ * Readers may also mmap() 'mmap_header' and the ring, see logger_mmap().
+ * Both live in one vmalloc_user() area, the header page first, which is
+ * allocated by logger_alloc_ring().
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
+	wait_queue_head_t	commit_wq; /* a resize waits for writers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex protecting readers */
+	spinlock_t		write_lock; /* lock protecting offsets */
+	size_t			w_off;	/* committed write head position */
+	size_t			w_reserve; /* reserved write head position */
 	size_t			head;	/* new readers start here */
+	int			resizing; /* writers drop during a resize */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_header; /* offsets for mmap readers */
+	atomic_t		mapped;	/* mappings of the ring */
+	struct list_head	archive; /* compressed chunks, oldest first */
+	struct mutex		archive_lock; /* mutex protecting archive */
+	struct work_struct	archive_work; /* compresses aged entries */
+	size_t			archive_size; /* limit, 0 disables */
+	size_t			archive_used; /* compressed bytes in use */
+	size_t			archive_start; /* oldest archived position */
+	size_t			archived; /* archived up to here */
+	void			*lzo_wrkmem; /* compression state */
+	unsigned char		*lzo_src; /* uncompressed chunk */
+	unsigned char		*lzo_dst; /* compressed chunk */
 };
 
+/*
+ * struct logger_chunk - a compressed run of whole entries in the archive
+ */
+struct logger_chunk {
+	struct list_head	list;	/* entry in logger_log's archive */
+	size_t			start;	/* position of the first entry */
+	size_t			len;	/* uncompressed length */
+	size_t			clen;	/* compressed length */
+	unsigned char		data[0]; /* compressed entries */
+};
+
+/* uncompressed size of an archive chunk */
+#define LOGGER_ARCHIVE_CHUNK	(8*1024)
+
+/* limits for runtime resizing, see logger_resize() */
+#define LOGGER_MIN_SIZE		(4*LOGGER_ENTRY_MAX_LEN)
+#define LOGGER_MAX_SIZE		(8*1024*1024)
+
 /*
  * struct logger_reader - a logging device open for reading
  *
@@ -56,12 +118,19 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	size_t			r_off;	/* current read head position */
+	unsigned char		*chunk;	/* decompressed archive chunk */
+	size_t			chunk_start; /* position of 'chunk' */
+	size_t			chunk_len; /* length of 'chunk', 0 if none */
+	int			batch;	/* read() returns all entries that fit */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is position 'a' before position 'b'? */
+#define logger_before(a, b)	((long)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -87,14 +156,15 @@ static inline struct logger_log *file_get_log(struct file *file)
 
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
- * from 'off'.
+ * from position 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Readers must check the result with reader_lapped() before trusting it.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
+	off = logger_offset(off);
 	switch (log->size - off) {
 	case 1:
 		memcpy(&val, log->buffer + off, 1);
@@ -107,9 +177,146 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * LOGGER_ENTRY_PENDING - value of the '__pad' field of an entry in the ring
+ * that has been reserved but not committed yet. Committed entries, the only
+ * ones readers get to see, have it cleared.
+ */
+#define LOGGER_ENTRY_PENDING	1
+
+/*
+ * entry_pending - is the entry at position 'off' still being written?
+ *
+ * Caller must hold log->write_lock.
+ */
+static int entry_pending(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	off = logger_offset(off + offsetof(struct logger_entry, __pad));
+	switch (log->size - off) {
+	case 1:
+		memcpy(&val, log->buffer + off, 1);
+		memcpy(((char *) &val) + 1, log->buffer, 1);
+		break;
+	default:
+		memcpy(&val, log->buffer + off, 2);
+	}
+
+	return val == LOGGER_ENTRY_PENDING;
+}
+
+/*
+ * logger_oldest - position of the oldest entry that can still be read,
+ * either in the archive or in the ring.
+ */
+static size_t logger_oldest(struct logger_log *log)
+{
+	size_t head = ACCESS_ONCE(log->head);
+	size_t start = ACCESS_ONCE(log->archive_start);
+
+	if (ACCESS_ONCE(log->archive_used) && logger_before(start, head))
+		return start;
+	return head;
+}
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to
+ * the oldest entry still in the log.
+ *
+ * Caller must hold log->mutex.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	size_t oldest = logger_oldest(log);
+
+	if (logger_before(reader->r_off, oldest))
+		reader->r_off = oldest;
+}
+
+/*
+ * logger_archive_load - make reader->chunk hold the archived entry at the
+ * read head, moving the read head over gaps in the archive. Returns 0 on
+ * success, or -ENOENT after moving the read head to the ring.
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_archive_load(struct logger_log *log,
+			       struct logger_reader *reader)
+{
+	struct logger_chunk *chunk;
+	size_t len;
+
+	if (reader->chunk_len &&
+	    !logger_before(reader->r_off, reader->chunk_start) &&
+	    logger_before(reader->r_off,
+			  reader->chunk_start + reader->chunk_len))
+		return 0;
+
+	if (!reader->chunk) {
+		reader->chunk = kmalloc(LOGGER_ARCHIVE_CHUNK, GFP_KERNEL);
+		if (!reader->chunk)
+			goto use_ring;
+	}
+
+	mutex_lock(&log->archive_lock);
+	list_for_each_entry(chunk, &log->archive, list) {
+		if (!logger_before(reader->r_off, chunk->start + chunk->len))
+			continue;
+		if (!logger_before(chunk->start, ACCESS_ONCE(log->head)))
+			break;
+		len = LOGGER_ARCHIVE_CHUNK;
+		if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+					  reader->chunk, &len) != LZO_E_OK ||
+		    len != chunk->len)
+			break;
+		if (logger_before(reader->r_off, chunk->start))
+			reader->r_off = chunk->start;
+		reader->chunk_start = chunk->start;
+		reader->chunk_len = chunk->len;
+		mutex_unlock(&log->archive_lock);
+		return 0;
+	}
+	mutex_unlock(&log->archive_lock);
+
+use_ring:
+	reader->chunk_len = 0;
+	if (logger_before(reader->r_off, ACCESS_ONCE(log->head)))
+		reader->r_off = ACCESS_ONCE(log->head);
+	return -ENOENT;
+}
+
+/*
+ * logger_archive_entry_len - length of the archived entry at the read head,
+ * after logger_archive_load() succeeded.
+ */
+static __u32 logger_archive_entry_len(struct logger_reader *reader)
+{
+	struct logger_entry *entry;
+	__u16 val;
+
+	entry = (struct logger_entry *)
+		(reader->chunk + (reader->r_off - reader->chunk_start));
+	memcpy(&val, &entry->len, sizeof(val));
+
+	return sizeof(struct logger_entry) + val;
+}
+
+/*
+ * reader_lapped - has a writer reserved the entry at the read head since
+ * the reader looked at it? Pairs with the smp_wmb() in logger_reserve().
+ */
+static inline int reader_lapped(struct logger_log *log,
+				struct logger_reader *reader)
+{
+	smp_rmb();
+	return logger_before(reader->r_off, ACCESS_ONCE(log->head));
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * user-space buffer 'buf'. Returns 'count' on success, or -EAGAIN if the
+ * entry was overwritten while it was copied.
  *
  * Caller must hold log->mutex.
  */
@@ -118,6 +325,7 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -125,8 +333,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +345,63 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
+	if (reader_lapped(log, reader))
+		return -EAGAIN;
+
+	reader->r_off += count;
 
 	return count;
 }
 
+/*
+ * read_log_entry - copies the entry at the read head of 'reader' to 'buf'
+ * and advances the read head past it. Returns the length of the entry, 0
+ * if there is nothing to read, or -EINVAL if 'count' is too small for it.
+ *
+ * Caller must hold log->mutex.
+ */
+static ssize_t read_log_entry(struct logger_log *log,
+			      struct logger_reader *reader,
+			      char __user *buf, size_t count)
+{
+	ssize_t ret;
+
+retry:
+	fix_up_reader(log, reader);
+
+	if (ACCESS_ONCE(log->w_off) == reader->r_off)
+		return 0;
+	smp_rmb();
+
+	/* entries that left the ring come from the archive */
+	if (logger_before(reader->r_off, ACCESS_ONCE(log->head))) {
+		if (logger_archive_load(log, reader))
+			goto retry;
+		ret = logger_archive_entry_len(reader);
+		if (count < ret)
+			return -EINVAL;
+		if (copy_to_user(buf, reader->chunk +
+				 (reader->r_off - reader->chunk_start), ret))
+			return -EFAULT;
+		reader->r_off += ret;
+		return ret;
+	}
+
+	/* get the size of the next entry */
+	ret = get_entry_len(log, reader->r_off);
+	if (reader_lapped(log, reader))
+		goto retry;
+	if (count < ret)
+		return -EINVAL;
+
+	/* get exactly one entry from the log */
+	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (ret == -EAGAIN)
+		goto retry;
+
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,7 +409,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit after LOGGER_SET_BATCH_READ
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -159,7 +420,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
-	ssize_t ret;
+	ssize_t ret, nr;
 	DEFINE_WAIT(wait);
 
 start:
@@ -167,7 +428,8 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		fix_up_reader(log, reader);
+		ret = (ACCESS_ONCE(log->w_off) == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
 			break;
@@ -191,129 +453,386 @@ start:
 
 	mutex_lock(&log->mutex);
 
+	ret = read_log_entry(log, reader, buf, count);
+
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
+	if (unlikely(!ret)) {
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	/* fill the rest of the buffer with whole entries */
+	while (reader->batch && ret > 0 && ret < count) {
+		nr = read_log_entry(log, reader, buf + ret, count - ret);
+		if (nr <= 0)
+			break;
+		ret += nr;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
 	mutex_unlock(&log->mutex);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
+ */
+static void do_write_log(struct logger_log *log, size_t pos, const void *buf,
+			 size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
+
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
+
+	if (count != len)
+		memcpy(log->buffer, buf + len, count - len);
+}
+
+/*
+ * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
+ * the log 'log' at position 'pos'
  *
- * Caller must hold log->mutex.
+ * The caller needs to have reserved the space with logger_reserve().
+ *
+ * Returns 'count' on success, negative error code on failure.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t pos,
+				      const void __user *buf, size_t count)
 {
-	size_t count = 0;
+	size_t off = logger_offset(pos);
+	size_t len;
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
+		return -EFAULT;
 
-	return off;
+	if (count != len)
+		if (copy_from_user(log->buffer, buf + len, count - len))
+			return -EFAULT;
+
+	return count;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_has_room - can 'len' more bytes be reserved right now?
+ *
+ * Caller must hold log->write_lock.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static inline int logger_has_room(struct logger_log *log, size_t len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	return !log->resizing &&
+	       log->w_reserve + len - log->w_off <= log->size / 2;
+}
+
+/*
+ * logger_reserve - reserve room for the entry described by 'header' and
+ * store the header, marked pending. On success the position of the entry
+ * is returned in 'pos'.
+ *
+ * Entries that the new one will overwrite are dropped by moving the head
+ * past them before anything is written, so readers can tell that they have
+ * been lapped. Reservations that are not published yet are kept to half
+ * the log, which keeps writers still copying from being lapped themselves.
+ * Writers never wait: over that limit, or while the log is resized, the
+ * entry is not reserved and -EAGAIN is returned.
+ */
+static int logger_reserve(struct logger_log *log,
+			  struct logger_entry *header, size_t *pos)
+{
+	size_t len = sizeof(struct logger_entry) + header->len;
+
+	spin_lock(&log->write_lock);
+	if (!logger_has_room(log, len)) {
+		spin_unlock(&log->write_lock);
+		return -EAGAIN;
 	}
 
+	*pos = log->w_reserve;
+	while (log->size < *pos + len - log->head)
+		log->head += get_entry_len(log, log->head);
+	log->mmap_header->head = log->head;
+	smp_wmb();
+
+	log->w_reserve = *pos + len;
+	header->__pad = LOGGER_ENTRY_PENDING;
+	do_write_log(log, *pos, header, sizeof(struct logger_entry));
+	header->__pad = 0;
+	spin_unlock(&log->write_lock);
+
 	return 0;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * logger_commit - finish the entry reserved at 'pos'. A failed entry is
+ * taken back if nothing was reserved after it, otherwise it stays in the
+ * log with a zeroed payload.
  *
- * The caller needs to hold log->mutex.
+ * The entry is marked committed and 'w_off' is moved over the run of
+ * committed entries that starts there, which makes them visible to readers.
+ * A writer that is slow to commit only holds back the entries after its
+ * own.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, size_t pos,
+			  struct logger_entry *header, int failed)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	size_t len = sizeof(struct logger_entry) + header->len;
+	size_t w_off;
+
+	spin_lock(&log->write_lock);
+	if (failed && log->w_reserve == pos + len) {
+		log->w_reserve = pos;
+	} else {
+		if (failed) {
+			size_t off = logger_offset(pos + sizeof(*header));
+			size_t n = min_t(size_t, header->len, log->size - off);
+
+			memset(log->buffer + off, 0, n);
+			memset(log->buffer, 0, header->len - n);
+		}
+		do_write_log(log, pos + offsetof(struct logger_entry, __pad),
+			     &header->__pad, sizeof(header->__pad));
+	}
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	w_off = log->w_off;
+	while (w_off != log->w_reserve && !entry_pending(log, w_off))
+		w_off += get_entry_len(log, w_off);
+	if (w_off == log->w_off) {
+		spin_unlock(&log->write_lock);
+		return;
+	}
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	/* entries must be complete before readers can see them */
+	smp_wmb();
+	log->w_off = w_off;
+	log->mmap_header->w_off = w_off;
+	log->mmap_header->seq++;
+	spin_unlock(&log->write_lock);
+
+	if (waitqueue_active(&log->commit_wq))
+		wake_up(&log->commit_wq);
+	/* wake up any blocked readers */
+	wake_up_interruptible(&log->wq);
+	if (ACCESS_ONCE(log->archive_size) &&
+	    w_off - ACCESS_ONCE(log->archived) >
+	    log->size / 2 + LOGGER_ARCHIVE_CHUNK)
+		schedule_work(&log->archive_work);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * logger_archive_trim - drop the oldest chunks until the archive fits in
+ * 'limit' bytes.
  *
- * The caller needs to hold log->mutex.
+ * Caller must hold log->archive_lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void logger_archive_trim(struct logger_log *log, size_t limit)
 {
-	size_t len;
+	struct logger_chunk *chunk;
+
+	while (log->archive_used > limit) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		list_del(&chunk->list);
+		log->archive_used -= sizeof(*chunk) + chunk->clen;
+		kfree(chunk);
+	}
+	if (!list_empty(&log->archive)) {
+		chunk = list_first_entry(&log->archive, struct logger_chunk,
+					 list);
+		log->archive_start = chunk->start;
+	}
+}
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+/*
+ * logger_archive_work - compress the entries that left the newest half of
+ * the ring into the archive, one chunk of whole entries at a time, before
+ * the writers overwrite them.
+ */
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive_work);
+	struct logger_chunk *chunk;
+	size_t start, end, cold, off, n, clen;
+
+	mutex_lock(&log->archive_lock);
+	while (log->archive_size) {
+		cold = ACCESS_ONCE(log->w_off) - log->size / 2;
+		smp_rmb();
+		start = log->archived;
+		if (logger_before(start, ACCESS_ONCE(log->head)))
+			start = ACCESS_ONCE(log->head);
+
+		/* only full chunks, the rest waits for more entries */
+		end = start;
+		while (1) {
+			if (!logger_before(end, cold))
+				goto out;
+			n = get_entry_len(log, end);
+			if (end - start + n > LOGGER_ARCHIVE_CHUNK)
+				break;
+			end += n;
+		}
 
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
+		off = logger_offset(start);
+		n = min(end - start, log->size - off);
+		memcpy(log->lzo_src, log->buffer + off, n);
+		memcpy(log->lzo_src + n, log->buffer, end - start - n);
+		smp_rmb();
+		if (logger_before(start, ACCESS_ONCE(log->head))) {
+			/* lapped while copying, the entries are gone */
+			log->archived = ACCESS_ONCE(log->head);
+			continue;
+		}
 
-	log->w_off = logger_offset(log->w_off + count);
+		if (lzo1x_1_compress(log->lzo_src, end - start, log->lzo_dst,
+				     &clen, log->lzo_wrkmem) != LZO_E_OK)
+			break;
+		chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+		if (!chunk)
+			break;
+		chunk->start = start;
+		chunk->len = end - start;
+		chunk->clen = clen;
+		memcpy(chunk->data, log->lzo_dst, clen);
+
+		list_add_tail(&chunk->list, &log->archive);
+		log->archive_used += sizeof(*chunk) + clen;
+		logger_archive_trim(log, log->archive_size);
+		log->archived = end;
+	}
+out:
+	mutex_unlock(&log->archive_lock);
+}
 
+/*
+ * logger_set_archive_size - set the memory limit of the archive. Memory
+ * for compression is allocated when the archive is enabled and freed with
+ * the archive when it is disabled.
+ */
+static int logger_set_archive_size(struct logger_log *log, size_t size)
+{
+	int ret = 0;
+
+	mutex_lock(&log->archive_lock);
+	if (size && !log->lzo_wrkmem) {
+		log->lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		log->lzo_src = vmalloc(LOGGER_ARCHIVE_CHUNK);
+		log->lzo_dst = vmalloc(lzo1x_worst_compress(
+					       LOGGER_ARCHIVE_CHUNK));
+		if (!log->lzo_wrkmem || !log->lzo_src || !log->lzo_dst) {
+			size = 0;
+			ret = -ENOMEM;
+		}
+		log->archived = ACCESS_ONCE(log->head);
+	}
+	log->archive_size = size;
+	logger_archive_trim(log, size);
+	if (!size) {
+		vfree(log->lzo_wrkmem);
+		vfree(log->lzo_src);
+		vfree(log->lzo_dst);
+		log->lzo_wrkmem = NULL;
+		log->lzo_src = NULL;
+		log->lzo_dst = NULL;
+	}
+	mutex_unlock(&log->archive_lock);
+
+	return ret;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * logger_alloc_ring - allocate the zeroed, user mappable area for a ring of
+ * 'size' bytes. The struct logger_mmap_header page comes first, the ring
+ * follows it. Free it with vfree() on the returned header.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static struct logger_mmap_header *logger_alloc_ring(size_t size,
+						    unsigned char **buffer)
 {
-	size_t len;
+	unsigned char *area;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	area = vmalloc_user(PAGE_SIZE + size);
+	if (!area)
+		return NULL;
+	*buffer = area + PAGE_SIZE;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	return (struct logger_mmap_header *) area;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * logger_resize - replace the ring of 'log' by one of 'size' bytes, which
+ * must be a power of two between LOGGER_MIN_SIZE and LOGGER_MAX_SIZE. The
+ * newest entries that fit are kept; positions do not change, so readers
+ * carry on where they were. A log that is mapped cannot be resized.
+ */
+static int logger_resize(struct logger_log *log, size_t size)
+{
+	struct logger_mmap_header *header, *old;
+	unsigned char *buffer;
+	size_t old_size, pos, end, n;
 
-	return count;
+	if (size < LOGGER_MIN_SIZE || size > LOGGER_MAX_SIZE ||
+	    !is_power_of_2(size))
+		return -EINVAL;
+
+	header = logger_alloc_ring(size, &buffer);
+	if (!header)
+		return -ENOMEM;
+
+	mutex_lock(&log->mutex);
+	if (atomic_read(&log->mapped)) {
+		mutex_unlock(&log->mutex);
+		vfree(header);
+		return -EBUSY;
+	}
+	mutex_lock(&log->archive_lock);
+
+	/* new writers drop their entries; wait for those in flight */
+	spin_lock(&log->write_lock);
+	log->resizing = 1;
+	while (log->w_off != log->w_reserve) {
+		spin_unlock(&log->write_lock);
+		wait_event(log->commit_wq, ACCESS_ONCE(log->w_off) ==
+			   ACCESS_ONCE(log->w_reserve));
+		spin_lock(&log->write_lock);
+	}
+	spin_unlock(&log->write_lock);
+
+	while (log->w_off - log->head > size)
+		log->head += get_entry_len(log, log->head);
+
+	for (pos = log->head, end = log->w_off; pos != end; pos += n) {
+		n = min(end - pos, log->size - logger_offset(pos));
+		n = min(n, size - (pos & (size - 1)));
+		memcpy(buffer + (pos & (size - 1)),
+		       log->buffer + logger_offset(pos), n);
+	}
+
+	spin_lock(&log->write_lock);
+	old = log->mmap_header;
+	old_size = log->size;
+	*header = *old;
+	log->mmap_header = header;
+	log->buffer = buffer;
+	log->size = size;
+	log->mmap_header->size = size;
+	log->mmap_header->head = log->head;
+	log->mmap_header->seq++;
+	log->resizing = 0;
+	spin_unlock(&log->write_lock);
+	wake_up(&log->commit_wq);
+
+	mutex_unlock(&log->archive_lock);
+	mutex_unlock(&log->mutex);
+
+	vfree(old);
+
+	printk(KERN_INFO "logger: resized log '%s' from %luK to %luK\n",
+	       log->misc.name, (unsigned long) old_size >> 10,
+	       (unsigned long) size >> 10);
+
+	return 0;
 }
 
 /*
@@ -325,9 +844,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t pos;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -342,17 +861,14 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	header.__pad = 0;
 
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Log writes have never blocked or failed for lack of room, and
+	 * callers do not retry; an entry that finds no room is dropped.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	if (unlikely(logger_reserve(log, &header, &pos)))
+		return header.len;
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,10 +878,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log,
+				pos + sizeof(struct logger_entry) + ret,
+				iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			logger_commit(log, pos, &header, 1);
 			return nr;
 		}
 
@@ -373,10 +890,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, pos, &header, 0);
 
 	return ret;
 }
@@ -409,10 +923,13 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->chunk = NULL;
+		reader->chunk_len = 0;
+		reader->batch = 0;
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = logger_oldest(log);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -432,7 +949,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
+		kfree(reader->chunk);
 		kfree(reader);
 	}
 
@@ -463,7 +985,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	fix_up_reader(log, reader);
+	if (ACCESS_ONCE(log->w_off) != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -476,6 +999,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
+	/* takes log->mutex itself */
+	if (cmd == LOGGER_SET_LOG_BUF_SIZE) {
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return logger_resize(log, arg);
+	}
+
 	mutex_lock(&log->mutex);
 
 	switch (cmd) {
@@ -488,10 +1020,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = ACCESS_ONCE(log->w_off) - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,23 +1029,115 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
+		while (1) {
+			fix_up_reader(log, reader);
+			if (ACCESS_ONCE(log->w_off) == reader->r_off) {
+				ret = 0;
+				break;
+			}
+			smp_rmb();
+			if (logger_before(reader->r_off,
+					  ACCESS_ONCE(log->head))) {
+				if (logger_archive_load(log, reader))
+					continue;
+				ret = logger_archive_entry_len(reader);
+				break;
+			}
 			ret = get_entry_len(log, reader->r_off);
-		else
-			ret = 0;
+			if (!reader_lapped(log, reader))
+				break;
+		}
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* readers catch up with the new head on their next access */
+		mutex_lock(&log->archive_lock);
+		logger_archive_trim(log, 0);
+		spin_lock(&log->write_lock);
 		log->head = log->w_off;
+		log->mmap_header->head = log->head;
+		spin_unlock(&log->write_lock);
+		log->archived = log->w_off;
+		mutex_unlock(&log->archive_lock);
 		ret = 0;
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	}
+
+	mutex_unlock(&log->mutex);
+
+	return ret;
+}
+
+static void logger_vm_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mapped);
+}
+
+static void logger_vm_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mapped);
+}
+
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vm_open,
+	.close = logger_vm_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the struct logger_mmap_header page followed by the ring, read-only,
+ * for readers that want to drain the log without a read() per entry. The
+ * mapping must cover both exactly. A mapped log cannot be resized.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	mutex_lock(&log->mutex);
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size) {
+		ret = -EINVAL;
+		goto out;
 	}
 
+	ret = remap_vmalloc_range(vma, log->mmap_header, 0);
+	if (ret)
+		goto out;
+
+	vma->vm_ops = &logger_vm_ops;
+	vma->vm_private_data = log;
+	atomic_inc(&log->mapped);
+
+out:
 	mutex_unlock(&log->mutex);
 
 	return ret;
@@ -526,6 +1148,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -534,13 +1157,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * must be a power of two, at least LOGGER_MIN_SIZE, and less than LONG_MAX
+ * minus LOGGER_ENTRY_MAX_LEN. The ring itself is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.mapped = ATOMIC_INIT(0), \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -548,11 +1170,18 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.write_lock = __SPIN_LOCK_UNLOCKED(VAR .write_lock), \
 	.w_off = 0, \
+	.w_reserve = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.archive_lock = __MUTEX_INITIALIZER(VAR .archive_lock), \
+	.archive_work = __WORK_INITIALIZER(VAR .archive_work, \
+					   logger_archive_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -573,17 +1202,225 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static struct logger_log *dev_get_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+static ssize_t logger_buffer_size_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	return sprintf(buf, "%zu\n", dev_get_log(dev)->size);
+}
+
+static ssize_t logger_buffer_size_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned long size;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &size))
+		return -EINVAL;
+	ret = logger_resize(dev_get_log(dev), size);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(buffer_size, S_IRUGO | S_IWUSR, logger_buffer_size_show,
+		   logger_buffer_size_store);
+
+static ssize_t logger_archive_size_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+
+	return sprintf(buf, "%zu %zu\n", log->archive_size, log->archive_used);
+}
+
+static ssize_t logger_archive_size_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	unsigned long size;
+	int ret;
+
+	if (strict_strtoul(buf, 0, &size))
+		return -EINVAL;
+	ret = logger_set_archive_size(dev_get_log(dev), size);
+
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(archive_size, S_IRUGO | S_IWUSR, logger_archive_size_show,
+		   logger_archive_size_store);
+
+#ifdef CONFIG_ANDROID_LOGGER_BENCHMARK
+/* Entries written by each writer, and their payload length */
+#define LOGGER_BENCH_ENTRIES	20000
+#define LOGGER_BENCH_LEN	64
+#define LOGGER_BENCH_WRITERS	4
+
+struct logger_bench {
+	struct logger_log *log;
+	atomic_t running;
+	struct completion done;
+};
+
+static int logger_bench_thread(void *data)
+{
+	struct logger_bench *bench = data;
+	struct logger_log *log = bench->log;
+	struct logger_entry header;
+	char msg[LOGGER_BENCH_LEN];
+	size_t pos;
+	int i;
+
+	memset(msg, 'x', sizeof(msg));
+	memset(&header, 0, sizeof(header));
+	header.pid = current->tgid;
+	header.tid = current->pid;
+	header.len = sizeof(msg);
+
+	for (i = 0; i < LOGGER_BENCH_ENTRIES; i++) {
+		/* the other writers commit soon, so room comes back */
+		while (logger_reserve(log, &header, &pos))
+			cond_resched();
+		do_write_log(log, pos + sizeof(header), msg, sizeof(msg));
+		logger_commit(log, pos, &header, 0);
+	}
+
+	if (atomic_dec_and_test(&bench->running))
+		complete(&bench->done);
+	return 0;
+}
+
+/*
+ * logger_write_bench - write LOGGER_BENCH_ENTRIES entries from each of
+ * 'writers' threads into a scratch log the size of 'log' and return the
+ * aggregate rate in writes/s. The real log is not touched.
+ */
+static int logger_write_bench(struct logger_log *log, int writers)
+{
+	struct task_struct *tsk[LOGGER_BENCH_WRITERS];
+	struct logger_bench bench;
+	struct logger_log *scratch;
+	ktime_t start;
+	s64 us;
+	int i, ret = 0;
+
+	if (writers < 1 || writers > ARRAY_SIZE(tsk))
+		return -EINVAL;
+
+	scratch = kzalloc(sizeof(*scratch), GFP_KERNEL);
+	if (!scratch)
+		return -ENOMEM;
+	scratch->size = ACCESS_ONCE(log->size);
+	scratch->mmap_header = logger_alloc_ring(scratch->size,
+						 &scratch->buffer);
+	if (!scratch->mmap_header) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	init_waitqueue_head(&scratch->wq);
+	init_waitqueue_head(&scratch->commit_wq);
+	INIT_LIST_HEAD(&scratch->readers);
+	mutex_init(&scratch->mutex);
+	spin_lock_init(&scratch->write_lock);
+	INIT_LIST_HEAD(&scratch->archive);
+	mutex_init(&scratch->archive_lock);
+	INIT_WORK(&scratch->archive_work, logger_archive_work);
+
+	bench.log = scratch;
+	atomic_set(&bench.running, writers);
+	init_completion(&bench.done);
+
+	for (i = 0; i < writers; i++) {
+		tsk[i] = kthread_create(logger_bench_thread, &bench,
+					"logger_bench/%d", i);
+		if (IS_ERR(tsk[i])) {
+			ret = PTR_ERR(tsk[i]);
+			/* let the threads already created run and finish */
+			atomic_sub(writers - i, &bench.running);
+			writers = i;
+			break;
+		}
+	}
+
+	start = ktime_get();
+	for (i = 0; i < writers; i++)
+		wake_up_process(tsk[i]);
+	if (writers)
+		wait_for_completion(&bench.done);
+	us = ktime_us_delta(ktime_get(), start);
+
+	if (!ret)
+		ret = div_u64((u64)writers * LOGGER_BENCH_ENTRIES * USEC_PER_SEC,
+			      max_t(s64, us, 1));
+out:
+	vfree(scratch->mmap_header);
+	kfree(scratch);
+	return ret;
+}
+
+static ssize_t logger_write_bench_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+	ssize_t len = 0;
+	int writers, ret;
+
+	for (writers = 1; writers <= LOGGER_BENCH_WRITERS; writers *= 2) {
+		ret = logger_write_bench(log, writers);
+		if (ret < 0)
+			return ret;
+		len += sprintf(buf + len, "%d writer%s: %d writes/s\n",
+			       writers, writers > 1 ? "s" : "", ret);
+	}
+
+	return len;
+}
+
+static DEVICE_ATTR(write_bench, S_IRUSR, logger_write_bench_show, NULL);
+#endif
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->mmap_header = logger_alloc_ring(log->size, &log->buffer);
+	if (unlikely(!log->mmap_header)) {
+		printk(KERN_ERR "logger: failed to allocate log '%s'!\n",
+		       log->misc.name);
+		return -ENOMEM;
+	}
+	log->mmap_header->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		vfree(log->mmap_header);
+		log->mmap_header = NULL;
+		log->buffer = NULL;
 		return ret;
 	}
 
+	if (device_create_file(log->misc.this_device, &dev_attr_buffer_size) ||
+	    device_create_file(log->misc.this_device, &dev_attr_archive_size))
+		printk(KERN_ERR "logger: failed to create sysfs attributes "
+		       "for log '%s'\n", log->misc.name);
+#ifdef CONFIG_ANDROID_LOGGER_BENCHMARK
+	if (device_create_file(log->misc.this_device, &dev_attr_write_bench))
+		printk(KERN_ERR "logger: failed to create write_bench "
+		       "for log '%s'\n", log->misc.name);
+#endif
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
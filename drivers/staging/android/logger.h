@@ -30,6 +30,24 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - first page of a read-only mmap() of a log,
+ * followed by the 'size' bytes of the ring. The entry at position 'pos'
+ * starts at ring offset pos & (size - 1); positions wrap around at 2^32.
+ *
+ * To read, load 'w_off', issue a read barrier, copy the entries from the
+ * last position read up to 'w_off', issue another read barrier and load
+ * 'head'. If 'head' has moved past the start of the copy, the oldest part
+ * of it may have been overwritten and reading restarts at 'head'. 'seq'
+ * changes every time new entries become visible.
+ */
+struct logger_mmap_header {
+	__u32		seq;	/* bumped when entries are committed */
+	__u32		size;	/* size of the ring */
+	__u32		head;	/* position of the oldest entry */
+	__u32		w_off;	/* position after the newest entry */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -46,4 +64,11 @@ struct logger_entry {
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 
+/*
+ * Numbers 5 and up are taken by LOGGER_GET_VERSION, LOGGER_SET_VERSION and
+ * their successors in later kernels; our own commands start well above.
+ */
+#define LOGGER_SET_LOG_BUF_SIZE		_IO(__LOGGERIO, 64) /* resize log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 65) /* multi-entry read */
+
 #endif /* _LINUX_LOGGER_H */
@@ -15,6 +15,21 @@
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
+ * To catch that case the driver also watches reclaim efficiency: when the
+ * pages reclaimed per page scanned drops below 100 - pressure_critical
+ * percent, the highest adj level is killed even though the free memory
+ * thresholds have not been reached yet.
+ *
+ * Processes are kept in an index ordered by oom_adj, updated from the task
+ * notifier on fork, exec and oom_adj writes, so a kill only looks at the
+ * buckets at or above the adj level that tripped.  Up to "batch" victims are
+ * killed in one pass, stopping as soon as their resident size covers the
+ * shortfall against the tripped minfree level.
+ *
+ * Every kill is reported through the lowmemorykiller:lowmem_kill and
+ * lowmemorykiller:lowmem_victim_freed tracepoints, and the most recent ones
+ * together with totals per level are shown in debugfs lowmemorykiller/stats.
+ * A victim counts as freed once the last user of its mm has unmapped it.
  *
  * Copyright (C) 2007-2008 Google, Inc.
  *
@@ -35,6 +50,14 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -51,16 +74,110 @@ static size_t lowmem_minfree[6] = {
 	16 * 1024,	/* 64MB */
 };
 static int lowmem_minfree_size = 4;
+static uint32_t lowmem_batch = 1;
+static uint32_t lowmem_pressure_critical = 95;
+
+#define LOWMEM_BATCH_MAX	8
+#define LOWMEM_SCAN_CHUNK	64
+#define LOWMEM_KILL_LOG		32
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_PRESSURE_WINDOW	(SWAP_CLUSTER_MAX * 16)
+
+/*
+ * lowmem_task_lock protects the oom_adj index and the deathpending set.
+ * The free notifier runs from RCU callbacks, so it is taken irqsave.
+ */
+static DEFINE_SPINLOCK(lowmem_task_lock);
+static struct list_head lowmem_tasks[LOWMEM_ADJ_BUCKETS];
+
+/*
+ * Marks where lowmem_select() resumes the walk of a bucket after dropping
+ * lowmem_task_lock.  Only used under lowmem_shrink_lock.
+ */
+static LIST_HEAD(lowmem_cursor);
+
+struct lowmem_kill_record {
+	unsigned int seq;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	int adj;
+	int rss;
+	int other_free;
+	int other_file;
+	int level;
+	int minfree;
+	int pressure;
+	int by_pressure;
+	s64 kill_us;		/* shrinker call to SIGKILL */
+	s64 free_us;		/* SIGKILL to mm unmapped, -1 while pending */
+};
 
-static struct task_struct *lowmem_deathpending;
+struct lowmem_death {
+	struct task_struct *task;
+	struct mm_struct *mm;	/* only compared, never dereferenced */
+	ktime_t kill_time;
+	unsigned int seq;
+};
+
+static struct lowmem_death lowmem_deathpending[LOWMEM_BATCH_MAX];
+static int lowmem_deathpending_count;
 static unsigned long lowmem_deathpending_timeout;
 
+/* Kill telemetry, also protected by lowmem_task_lock */
+static struct lowmem_kill_record lowmem_kill_log[LOWMEM_KILL_LOG];
+static unsigned int lowmem_kill_seq;
+static struct {
+	unsigned long kills;
+	unsigned long pressure_kills;
+	unsigned long level_kills[ARRAY_SIZE(lowmem_adj)];
+	unsigned long freed;
+	s64 kill_us_total;
+	s64 kill_us_max;
+	s64 free_us_total;
+	s64 free_us_max;
+} lowmem_stats;
+
+static struct dentry *lowmem_debugfs_dir;
+
+/* Serializes victim selection and the reclaim pressure window */
+static DEFINE_MUTEX(lowmem_shrink_lock);
+static unsigned long lowmem_scanned;
+static unsigned long lowmem_reclaimed;
+static int lowmem_pressure;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
+
+static struct list_head *lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_tasks[oom_adj - OOM_DISABLE];
+}
+
+/*
+ * Must be called with lowmem_task_lock held on a live group leader.  Kernel
+ * threads and tasks without an mm cannot free anything and are left out;
+ * a kernel thread that execs is indexed from the exec notification.
+ */
+static void lowmem_index_task(struct task_struct *task)
+{
+	if ((task->flags & PF_KTHREAD) || !task->mm) {
+		list_del_init(&task->lowmem_entry);
+		return;
+	}
+	list_move_tail(&task->lowmem_entry,
+		       lowmem_bucket(task->signal->oom_adj));
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -72,115 +189,469 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct task_struct *leader;
+	struct lowmem_death *d;
+	struct lowmem_kill_record *rec;
+	unsigned long flags;
+	s64 free_us;
+	int i;
+
+	/* every exiting process comes through here; most are not victims */
+	if (val == TASK_NOTIFY_MM_EXIT &&
+	    !ACCESS_ONCE(lowmem_deathpending_count))
+		return NOTIFY_OK;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	switch (val) {
+	case TASK_NOTIFY_FREE:
+		list_del_init(&task->lowmem_entry);
+		/* victims whose mm exit was not seen just stop pending */
+		for (i = 0; i < LOWMEM_BATCH_MAX; i++) {
+			d = &lowmem_deathpending[i];
+			if (d->task != task)
+				continue;
+			d->task = NULL;
+			lowmem_deathpending_count--;
+		}
+		break;
+	case TASK_NOTIFY_MM_EXIT:
+		for (i = 0; i < LOWMEM_BATCH_MAX; i++) {
+			d = &lowmem_deathpending[i];
+			if (!d->task || d->mm != data)
+				continue;
+			free_us = ktime_us_delta(ktime_get(), d->kill_time);
+			lowmem_stats.freed++;
+			lowmem_stats.free_us_total += free_us;
+			if (free_us > lowmem_stats.free_us_max)
+				lowmem_stats.free_us_max = free_us;
+			rec = &lowmem_kill_log[d->seq % LOWMEM_KILL_LOG];
+			if (rec->seq == d->seq) {
+				rec->free_us = free_us;
+				trace_lowmem_victim_freed(rec);
+			}
+			d->task = NULL;
+			lowmem_deathpending_count--;
+		}
+		break;
+	case TASK_NOTIFY_LEADER:
+		if (thread_group_leader(task))
+			lowmem_index_task(task);
+		break;
+	case TASK_NOTIFY_OOM_ADJ:
+		/*
+		 * The write may come through any thread; the leader is only
+		 * safe to touch while it has not been released yet.
+		 */
+		rcu_read_lock();
+		leader = task->group_leader;
+		if (pid_alive(leader))
+			lowmem_index_task(leader);
+		rcu_read_unlock();
+		break;
+	}
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
 
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+#ifdef CONFIG_VM_EVENT_COUNTERS
+static void lowmem_reclaim_counts(unsigned long *scanned,
+				  unsigned long *reclaimed)
+{
+	unsigned long events[NR_VM_EVENT_ITEMS];
+	int i;
+
+	all_vm_events(events);
+	*scanned = 0;
+	*reclaimed = 0;
+	for (i = 0; i < MAX_NR_ZONES; i++) {
+		*scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + i];
+		*scanned += events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + i];
+		*reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + i];
+	}
+}
+#endif
+
+/*
+ * Percentage of scanned pages that reclaim failed to free, measured over
+ * windows of at least LOWMEM_PRESSURE_WINDOW scanned pages.  Called with
+ * lowmem_shrink_lock held.
+ */
+static int lowmem_reclaim_pressure(void)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long delta_scanned;
+	unsigned long delta_reclaimed;
+
+	lowmem_reclaim_counts(&scanned, &reclaimed);
+	delta_scanned = scanned - lowmem_scanned;
+	delta_reclaimed = reclaimed - lowmem_reclaimed;
+	if (delta_scanned >= LOWMEM_PRESSURE_WINDOW) {
+		if (delta_reclaimed > delta_scanned)
+			delta_reclaimed = delta_scanned;
+		lowmem_pressure = 100 * (delta_scanned - delta_reclaimed) /
+				  delta_scanned;
+		lowmem_scanned = scanned;
+		lowmem_reclaimed = reclaimed;
+	}
+#endif
+	return lowmem_pressure;
+}
+
+/*
+ * Start a new pressure window after a kill, so that the pressure measured
+ * before it cannot trigger more kills until reclaim has been seen failing
+ * again.  Called with lowmem_shrink_lock held.
+ */
+static void lowmem_reset_pressure(void)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	lowmem_reclaim_counts(&lowmem_scanned, &lowmem_reclaimed);
+#endif
+	lowmem_pressure = 0;
+}
+
+/*
+ * Pick up to @max victims with oom_adj >= @min_adj, highest adj first and
+ * largest first within an adj.  Selection stops at the first bucket that
+ * fills the set, so the low adj buckets are not even walked in the common
+ * case.  Every returned victim holds a task reference.
+ *
+ * task_lock() nests outside lowmem_task_lock (the free notifier takes the
+ * latter from softirq context), so a bucket is snapshotted under the index
+ * lock LOWMEM_SCAN_CHUNK tasks at a time and the candidates are only
+ * inspected after dropping it.  lowmem_cursor keeps the place in the bucket
+ * meanwhile.  A task that is re-indexed during the walk may be seen twice;
+ * it is only taken once.
+ */
+static int lowmem_select(int min_adj, int max, struct task_struct **victims,
+			 struct mm_struct **mms, int *sizes, int *adjs)
 {
+	struct task_struct *cand[LOWMEM_SCAN_CHUNK];
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
+	struct list_head *bucket;
+	struct list_head *pos;
+	unsigned long flags;
+	int adj;
+	int nr_cand;
+	int more;
+	int n = 0;
+	int c;
+
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && n < max; adj--) {
+		bucket = lowmem_bucket(adj);
+		spin_lock_irqsave(&lowmem_task_lock, flags);
+		pos = bucket->next;
+next_chunk:
+		nr_cand = 0;
+		while (pos != bucket && nr_cand < LOWMEM_SCAN_CHUNK) {
+			p = list_entry(pos, struct task_struct, lowmem_entry);
+			/* a zero count means the free notifier is waiting */
+			if (atomic_inc_not_zero(&p->usage))
+				cand[nr_cand++] = p;
+			pos = pos->next;
+		}
+		more = pos != bucket;
+		if (more)
+			list_add_tail(&lowmem_cursor, pos);
+		spin_unlock_irqrestore(&lowmem_task_lock, flags);
+
+		for (c = 0; c < nr_cand; c++) {
+			struct mm_struct *mm;
+			int oom_adj;
+			int tasksize;
+			int i;
+
+			p = cand[c];
+			task_lock(p);
+			mm = p->mm;
+			oom_adj = p->signal->oom_adj;
+			if (!mm || oom_adj < min_adj) {
+				task_unlock(p);
+				put_task_struct(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			for (i = 0; i < n; i++)
+				if (victims[i] == p)
+					break;
+			if (tasksize <= 0 || i < n) {
+				put_task_struct(p);
+				continue;
+			}
+
+			for (i = n; i > 0; i--) {
+				if (adjs[i - 1] > oom_adj ||
+				    (adjs[i - 1] == oom_adj &&
+				     sizes[i - 1] >= tasksize))
+					break;
+				if (i < max) {
+					victims[i] = victims[i - 1];
+					mms[i] = mms[i - 1];
+					sizes[i] = sizes[i - 1];
+					adjs[i] = adjs[i - 1];
+				} else {
+					put_task_struct(victims[i - 1]);
+				}
+			}
+			if (i >= max) {
+				put_task_struct(p);
+				continue;
+			}
+			victims[i] = p;
+			mms[i] = mm;
+			sizes[i] = tasksize;
+			adjs[i] = oom_adj;
+			if (n < max)
+				n++;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
+		}
+
+		if (more) {
+			spin_lock_irqsave(&lowmem_task_lock, flags);
+			pos = lowmem_cursor.next;
+			list_del_init(&lowmem_cursor);
+			goto next_chunk;
+		}
+	}
+	return n;
+}
+
+static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *victims[LOWMEM_BATCH_MAX];
+	struct mm_struct *mms[LOWMEM_BATCH_MAX];
+	int sizes[LOWMEM_BATCH_MAX];
+	int adjs[LOWMEM_BATCH_MAX];
+	unsigned int seqs[LOWMEM_BATCH_MAX];
+	struct lowmem_kill_record *rec;
+	struct lowmem_kill_record kill;
+	struct lowmem_death *d;
+	ktime_t start, now;
+	unsigned long flags;
 	int rem = 0;
-	int tasksize;
-	int i;
-	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int i, j;
+	int n;
+	int level;
+	int min_adj;
+	int pressure;
+	int by_pressure = 0;
+	int max_kill;
+	int deficit;
+	int freed;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
 
+	rem = global_page_state(NR_ACTIVE_ANON) +
+		global_page_state(NR_ACTIVE_FILE) +
+		global_page_state(NR_INACTIVE_ANON) +
+		global_page_state(NR_INACTIVE_FILE);
+	if (nr_to_scan <= 0) {
+		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
+			     nr_to_scan, gfp_mask, rem);
+		return rem;
+	}
+	start = ktime_get();
+
 	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
+	 * If another reclaimer is already picking victims, or we already
+	 * have deaths outstanding, then bail out right away; indicating to
+	 * vmscan that we have nothing further to offer on this pass.
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	if (!mutex_trylock(&lowmem_shrink_lock))
+		return 0;
+	if (lowmem_deathpending_count &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		mutex_unlock(&lowmem_shrink_lock);
 		return 0;
+	}
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
 	if (lowmem_minfree_size < array_size)
 		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i] &&
-		    other_file < lowmem_minfree[i]) {
-			min_adj = lowmem_adj[i];
+	for (level = 0; level < array_size; level++) {
+		if (other_free < lowmem_minfree[level] &&
+		    other_file < lowmem_minfree[level])
 			break;
-		}
 	}
-	if (nr_to_scan > 0)
-		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
-			     nr_to_scan, gfp_mask, other_free, other_file,
-			     min_adj);
-	rem = global_page_state(NR_ACTIVE_ANON) +
-		global_page_state(NR_ACTIVE_FILE) +
-		global_page_state(NR_INACTIVE_ANON) +
-		global_page_state(NR_INACTIVE_FILE);
-	if (nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
+
+	/*
+	 * Reclaim that keeps failing to free what it scans means the page
+	 * cache is mostly unreclaimable; start on the least important
+	 * processes before free memory runs into the thresholds.
+	 */
+	pressure = lowmem_reclaim_pressure();
+	if (level == array_size && array_size > 0 &&
+	    pressure >= lowmem_pressure_critical) {
+		level = array_size - 1;
+		by_pressure = 1;
+	}
+
+	lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, level %d, pressure %d\n",
+		     nr_to_scan, gfp_mask, other_free, other_file, level,
+		     pressure);
+	if (level == array_size) {
+		mutex_unlock(&lowmem_shrink_lock);
 		lowmem_print(5, "lowmem_shrink %d, %x, return %d\n",
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
+	min_adj = lowmem_adj[level];
+	deficit = (int)lowmem_minfree[level] - other_free;
+	max_kill = clamp_t(int, lowmem_batch, 1, LOWMEM_BATCH_MAX);
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
+	n = lowmem_select(min_adj, max_kill, victims, mms, sizes, adjs);
+
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	for (i = 0, freed = 0; i < n; i++) {
+		if (i > 0 && freed >= deficit)
+			break;
+		freed += sizes[i];
+
+		seqs[i] = lowmem_kill_seq++;
+		rec = &lowmem_kill_log[seqs[i] % LOWMEM_KILL_LOG];
+		rec->seq = seqs[i];
+		rec->pid = victims[i]->pid;
+		memcpy(rec->comm, victims[i]->comm, TASK_COMM_LEN);
+		rec->adj = adjs[i];
+		rec->rss = sizes[i];
+		rec->other_free = other_free;
+		rec->other_file = other_file;
+		rec->level = level;
+		rec->minfree = lowmem_minfree[level];
+		rec->pressure = pressure;
+		rec->by_pressure = by_pressure;
+		rec->kill_us = 0;
+		rec->free_us = -1;
+		lowmem_stats.kills++;
+		lowmem_stats.level_kills[level]++;
+		if (by_pressure)
+			lowmem_stats.pressure_kills++;
+
+		for (j = 0; j < LOWMEM_BATCH_MAX; j++) {
+			d = &lowmem_deathpending[j];
+			if (!d->task) {
+				d->task = victims[i];
+				d->mm = mms[i];
+				d->kill_time = start;
+				d->seq = seqs[i];
+				lowmem_deathpending_count++;
+				break;
+			}
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
+	if (i)
 		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
+	if (i)
+		lowmem_reset_pressure();
+	mutex_unlock(&lowmem_shrink_lock);
+
+	/* drop the candidates that turned out not to be needed */
+	for (j = i; j < n; j++)
+		put_task_struct(victims[j]);
+	n = i;
+
+	for (i = 0; i < n; i++) {
+		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+			     victims[i]->pid, victims[i]->comm,
+			     adjs[i], sizes[i]);
+		send_sig(SIGKILL, victims[i], 0);
+		now = ktime_get();
+
+		spin_lock_irqsave(&lowmem_task_lock, flags);
+		for (j = 0; j < LOWMEM_BATCH_MAX; j++) {
+			d = &lowmem_deathpending[j];
+			if (d->task == victims[i] && d->seq == seqs[i])
+				d->kill_time = now;
+		}
+		rec = &lowmem_kill_log[seqs[i] % LOWMEM_KILL_LOG];
+		rec->kill_us = ktime_us_delta(now, start);
+		lowmem_stats.kill_us_total += rec->kill_us;
+		if (rec->kill_us > lowmem_stats.kill_us_max)
+			lowmem_stats.kill_us_max = rec->kill_us;
+		kill = *rec;
+		spin_unlock_irqrestore(&lowmem_task_lock, flags);
+		trace_lowmem_kill(&kill);
+
+		put_task_struct(victims[i]);
+		rem -= sizes[i];
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+static s64 lowmem_avg(s64 total, unsigned long count)
+{
+	return count ? div_s64(total, count) : 0;
+}
+
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_kill_record *rec;
+	unsigned long flags;
+	unsigned int seq;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	seq_printf(m, "kills: %lu (%lu on reclaim pressure)\n",
+		   lowmem_stats.kills, lowmem_stats.pressure_kills);
+	for (i = 0; i < array_size; i++)
+		seq_printf(m, "  level %d adj %d minfree %u: %lu\n", i,
+			   lowmem_adj[i], (unsigned int)lowmem_minfree[i],
+			   lowmem_stats.level_kills[i]);
+	seq_printf(m, "kill latency: avg %lldus max %lldus\n",
+		   lowmem_avg(lowmem_stats.kill_us_total, lowmem_stats.kills),
+		   lowmem_stats.kill_us_max);
+	seq_printf(m, "free latency: avg %lldus max %lldus (%lu freed, %d pending)\n",
+		   lowmem_avg(lowmem_stats.free_us_total, lowmem_stats.freed),
+		   lowmem_stats.free_us_max, lowmem_stats.freed,
+		   lowmem_deathpending_count);
+
+	seq_puts(m, "recent kills:\n"
+		 "  pid comm adj rss free file level minfree pressure trigger kill_us free_us\n");
+	seq = lowmem_kill_seq > LOWMEM_KILL_LOG ?
+		lowmem_kill_seq - LOWMEM_KILL_LOG : 0;
+	for (; seq != lowmem_kill_seq; seq++) {
+		rec = &lowmem_kill_log[seq % LOWMEM_KILL_LOG];
+		seq_printf(m, "  %d %s %d %d %d %d %d %d %d %s %lld %lld\n",
+			   rec->pid, rec->comm, rec->adj, rec->rss,
+			   rec->other_free, rec->other_file, rec->level,
+			   rec->minfree, rec->pressure,
+			   rec->by_pressure ? "pressure" : "minfree",
+			   rec->kill_us, rec->free_us);
+	}
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, inode->i_private);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -188,15 +659,49 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_tasks[i]);
+
+	/*
+	 * Register first so nothing forked or retuned after the walk below
+	 * is missed; indexing a task twice just moves it.
+	 */
 	task_free_register(&task_nb);
+	read_lock(&tasklist_lock);
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	for_each_process(p)
+		lowmem_index_task(p);
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
+
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (lowmem_debugfs_dir)
+		debugfs_create_file("stats", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_stats_fops);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct task_struct *p, *tmp;
+	unsigned long flags;
+	int i;
+
+	debugfs_remove_recursive(lowmem_debugfs_dir);
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+
+	spin_lock_irqsave(&lowmem_task_lock, flags);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(p, tmp, &lowmem_tasks[i], lowmem_entry)
+			list_del_init(&p->lowmem_entry);
+	spin_unlock_irqrestore(&lowmem_task_lock, flags);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,9 +710,11 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(batch, lowmem_batch, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
-
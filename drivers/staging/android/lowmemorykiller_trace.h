@@ -0,0 +1,100 @@
+/* lowmemorykiller_trace.h
+ *
+ * Android low memory killer tracepoints
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+
+struct lowmem_kill_record;
+
+TRACE_EVENT(lowmem_kill,
+
+	TP_PROTO(struct lowmem_kill_record *rec),
+
+	TP_ARGS(rec),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, adj)
+		__field(int, rss)
+		__field(int, other_free)
+		__field(int, other_file)
+		__field(int, level)
+		__field(int, minfree)
+		__field(int, pressure)
+		__field(s64, kill_us)
+	),
+
+	TP_fast_assign(
+		__entry->pid = rec->pid;
+		memcpy(__entry->comm, rec->comm, TASK_COMM_LEN);
+		__entry->adj = rec->adj;
+		__entry->rss = rec->rss;
+		__entry->other_free = rec->other_free;
+		__entry->other_file = rec->other_file;
+		__entry->level = rec->level;
+		__entry->minfree = rec->minfree;
+		__entry->pressure = rec->pressure;
+		__entry->kill_us = rec->kill_us;
+	),
+
+	TP_printk("pid=%d comm=%s adj=%d rss=%d free=%d file=%d level=%d "
+		  "minfree=%d pressure=%d latency=%lldus",
+		  __entry->pid, __entry->comm, __entry->adj, __entry->rss,
+		  __entry->other_free, __entry->other_file, __entry->level,
+		  __entry->minfree, __entry->pressure, __entry->kill_us)
+);
+
+TRACE_EVENT(lowmem_victim_freed,
+
+	TP_PROTO(struct lowmem_kill_record *rec),
+
+	TP_ARGS(rec),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, adj)
+		__field(int, rss)
+		__field(s64, free_us)
+	),
+
+	TP_fast_assign(
+		__entry->pid = rec->pid;
+		memcpy(__entry->comm, rec->comm, TASK_COMM_LEN);
+		__entry->adj = rec->adj;
+		__entry->rss = rec->rss;
+		__entry->free_us = rec->free_us;
+	),
+
+	TP_printk("pid=%d comm=%s adj=%d rss=%d latency=%lldus",
+		  __entry->pid, __entry->comm, __entry->adj, __entry->rss,
+		  __entry->free_us)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
@@ -25,46 +25,279 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "zram_drv.h"
 
 /* Globals */
 static int zram_major;
 struct zram *devices;
+static struct kmem_cache *zram_dedup_cache;
+static struct workqueue_struct *zram_read_wq;
+static struct workqueue_struct *zram_wb_wq;
+static struct workqueue_struct *zram_io_wq;
+static struct dentry *zram_debugfs_root;
 
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+/*
+ * Per-CPU statistics are updated between zram_stats_begin() and
+ * zram_stats_end(), with preemption disabled.
+ */
+static struct zram_stats_cpu *zram_stats_begin(struct zram *zram)
+{
+	struct zram_stats_cpu *st = per_cpu_ptr(zram->stats_cpu, get_cpu());
+
+	write_seqcount_begin(&st->seq);
+
+	return st;
+}
+
+static void zram_stats_end(struct zram_stats_cpu *st)
+{
+	write_seqcount_end(&st->seq);
+	put_cpu();
+}
+
+/* Update the counter 'field' of struct zram_stats64 on this CPU */
+#define zram_stat64_add(zram, field, inc)				\
+	do {								\
+		struct zram_stats_cpu *__st = zram_stats_begin(zram);	\
+		__st->stats.field += (inc);				\
+		zram_stats_end(__st);					\
+	} while (0)
+
+#define zram_stat64_sub(zram, field, dec) \
+	zram_stat64_add(zram, field, -(u64)(dec))
+
+#define zram_stat64_inc(zram, field) \
+	zram_stat64_add(zram, field, 1)
+
+/*
+ * Sum over all CPUs of the struct zram_stats64 counter at 'offset'. A
+ * counter that goes down, such as compr_size, may be negative on one CPU;
+ * the sum is still right.
+ */
+u64 zram_stat64_sum(struct zram *zram, size_t offset)
+{
+	int cpu;
+	unsigned seq;
+	u64 val, sum = 0;
+	struct zram_stats_cpu *st;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(zram->stats_cpu, cpu);
+		do {
+			seq = read_seqcount_begin(&st->seq);
+			val = *(u64 *)((char *)&st->stats + offset);
+		} while (read_seqcount_retry(&st->seq, seq));
+		sum += val;
+	}
+
+	return sum;
+}
+
+/* Sum of the per-CPU statistics of backend slot 'slot' */
+void zram_backend_stats_read(struct zram *zram, int slot,
+			struct zram_backend_stats *stats)
+{
+	int cpu;
+	unsigned seq;
+	struct zram_stats_cpu *st;
+	struct zram_backend_stats val;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(zram->stats_cpu, cpu);
+		do {
+			seq = read_seqcount_begin(&st->seq);
+			val = st->backend[slot];
+		} while (read_seqcount_retry(&st->seq, seq));
+
+		stats->compr_pages += val.compr_pages;
+		stats->compr_size += val.compr_size;
+		stats->compr_ns += val.compr_ns;
+		stats->decompr_pages += val.decompr_pages;
+		stats->decompr_ns += val.decompr_ns;
+	}
+}
+
+static spinlock_t *zram_entry_lock(struct zram *zram, u32 index)
+{
+	return &zram->table_lock[index % ZRAM_TABLE_LOCKS];
+}
+
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *strm;
+
+	strm = per_cpu_ptr(zram->streams, raw_smp_processor_id());
+	mutex_lock(&strm->lock);
+
+	return strm;
+}
+
+static void zram_stream_put(struct zram_stream *strm)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	mutex_unlock(&strm->lock);
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static int zram_compress(struct zram *zram, struct zram_stream *strm,
+			const void *src, unsigned int *clen)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	int ret;
+	struct zram_stats_cpu *st;
+	struct zram_backend_stats *bs;
+	ktime_t start = ktime_get();
+
+	*clen = 2 * PAGE_SIZE;
+	ret = crypto_comp_compress(strm->tfm, src, PAGE_SIZE,
+				strm->buffer, clen);
+
+	st = zram_stats_begin(zram);
+	bs = &st->backend[zram->backend];
+	bs->compr_pages++;
+	bs->compr_size += *clen;
+	bs->compr_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	zram_stats_end(st);
+
+	return ret;
+}
+
+static int zram_decompress(struct zram *zram, struct zram_stream *strm,
+			const void *src, unsigned int slen, void *dst)
+{
+	int ret;
+	unsigned int dlen = PAGE_SIZE;
+	struct zram_stats_cpu *st;
+	struct zram_backend_stats *bs;
+	ktime_t start = ktime_get();
+
+	ret = crypto_comp_decompress(strm->tfm, src, slen, dst, &dlen);
+	if (!ret && dlen != PAGE_SIZE)
+		ret = -EINVAL;
+
+	st = zram_stats_begin(zram);
+	bs = &st->backend[zram->backend];
+	bs->decompr_pages++;
+	bs->decompr_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	zram_stats_end(st);
+
+	return ret;
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[checksum & (zram->dedup_buckets - 1)];
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+/*
+ * Look for a stored object with the same compressed contents and take a
+ * reference to it. Returns 1 and the object location on a hit.
+ */
+static int zram_dedup_get(struct zram *zram, u32 checksum, const void *data,
+			unsigned int clen, unsigned long *handle)
 {
-	zram_stat64_add(zram, v, 1);
+	int found = 0;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+	struct zobj_header *zheader;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		if (entry->checksum != checksum)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		zheader = (struct zobj_header *)cmem;
+		found = zheader->size == clen &&
+			!memcmp(cmem + sizeof(*zheader), data, clen);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (found) {
+			entry->refcount++;
+			*handle = entry->handle;
+			break;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return found;
+}
+
+/*
+ * Index a newly stored object. If no entry can be allocated the object is
+ * simply not shared.
+ */
+static void zram_dedup_add(struct zram *zram, u32 checksum,
+			unsigned long handle)
+{
+	struct zram_dedup_entry *entry;
+
+	entry = kmem_cache_alloc(zram_dedup_cache, GFP_NOIO | __GFP_NOWARN);
+	if (!entry)
+		return;
+
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, checksum));
+	spin_unlock(&zram->dedup_lock);
+}
+
+/*
+ * Drop a reference to an object. Returns the number of references left;
+ * zero (also for objects that were never indexed) means the caller frees it.
+ */
+static u32 zram_dedup_put(struct zram *zram, u32 checksum,
+			unsigned long handle)
+{
+	u32 refcount = 0;
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		if (entry->handle != handle)
+			continue;
+
+		refcount = --entry->refcount;
+		if (!refcount) {
+			hlist_del(&entry->node);
+			kmem_cache_free(zram_dedup_cache, entry);
+		}
+		break;
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return refcount;
 }
 
 static int zram_test_flag(struct zram *zram, u32 index,
@@ -129,13 +362,212 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Caller must hold the entry lock of 'index'.
+ */
+static void zram_bd_free_slots(struct zram *zram, unsigned long slot, int nr)
+{
+	spin_lock(&zram->bd_lock);
+	bitmap_clear(zram->bd_bitmap, slot, nr);
+	spin_unlock(&zram->bd_lock);
+}
+
+/*
+ * Reserve a run of at most *nr contiguous backing device pages, shrinking
+ * the run when the device is too fragmented. *nr is 0 if it is full.
+ */
+static unsigned long zram_bd_alloc_slots(struct zram *zram, int *nr)
+{
+	unsigned long slot = 0;
+
+	spin_lock(&zram->bd_lock);
+	for (; *nr; *nr /= 2) {
+		slot = bitmap_find_next_zero_area(zram->bd_bitmap,
+					zram->bd_pages, 0, *nr, 0);
+		if (slot < zram->bd_pages) {
+			bitmap_set(zram->bd_bitmap, slot, *nr);
+			break;
+		}
+	}
+	spin_unlock(&zram->bd_lock);
+
+	return slot;
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously transfer nr pages starting at backing device page slot */
+static int zram_bd_rw(struct zram *zram, int rw, unsigned long slot,
+			struct page **pages, int nr)
+{
+	int done = 0;
+
+	while (done < nr) {
+		int added = 0, uptodate;
+		struct bio *bio;
+		DECLARE_COMPLETION_ONSTACK(wait);
+
+		bio = bio_alloc(GFP_NOIO, nr - done);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = (sector_t)(slot + done) << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_bd_end_io;
+		bio->bi_private = &wait;
+
+		/* The queue limits may split the run over several bios */
+		while (done + added < nr &&
+			bio_add_page(bio, pages[done + added],
+					PAGE_SIZE, 0) == PAGE_SIZE)
+			added++;
+
+		if (unlikely(!added)) {
+			bio_put(bio);
+			return -EIO;
+		}
+
+		submit_bio(rw, bio);
+		wait_for_completion(&wait);
+
+		uptodate = test_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_put(bio);
+		if (!uptodate)
+			return -EIO;
+
+		done += added;
+	}
+
+	return 0;
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct list_head list;	/* on zram->bd_reads, under bd_lock */
+	struct zram *zram;
+	unsigned long slot;
+	struct page *page;
+	int free_slot;		/* slot was freed while being read */
+	int ret;
+};
+
+/*
+ * Release the backing device page of a ZRAM_WB entry being freed. A read
+ * of the slot may still be in flight without the entry lock; the slot
+ * then stays allocated until the last such read is done with it, so it
+ * cannot be rewritten with another page under the reader.
+ */
+static void zram_bd_put_slot(struct zram *zram, unsigned long slot)
+{
+	int busy = 0;
+	struct zram_bd_read *req;
+
+	spin_lock(&zram->bd_lock);
+	list_for_each_entry(req, &zram->bd_reads, list) {
+		if (req->slot == slot) {
+			req->free_slot = 1;
+			busy = 1;
+		}
+	}
+	if (!busy)
+		bitmap_clear(zram->bd_bitmap, slot, 1);
+	spin_unlock(&zram->bd_lock);
+}
+
+static void zram_bd_read_fn(struct work_struct *work)
+{
+	struct zram_bd_read *req = container_of(work, struct zram_bd_read,
+						work);
+
+	req->ret = zram_bd_rw(req->zram, READ_SYNC, req->slot, &req->page, 1);
+}
+
+/*
+ * Reads run in zram_make_request(), where a submitted bio is only issued
+ * after we return. Waiting for it there would deadlock, so a worker does
+ * the read instead.
+ *
+ * Called with the entry lock of a ZRAM_WB entry held, which is dropped
+ * once the slot is pinned against zram_bd_put_slot().
+ */
+static int zram_bd_read(struct zram *zram, size_t index, struct page *page,
+			spinlock_t *lock)
+{
+	struct zram_bd_read *other;
+	struct zram_bd_read req = {
+		.zram = zram,
+		.slot = zram->table[index].slot,
+		.page = page,
+	};
+
+	spin_lock(&zram->bd_lock);
+	list_add(&req.list, &zram->bd_reads);
+	spin_unlock(&zram->bd_lock);
+	spin_unlock(lock);
+
+	INIT_WORK_ON_STACK(&req.work, zram_bd_read_fn);
+	queue_work(zram_read_wq, &req.work);
+	flush_work(&req.work);
+	destroy_work_on_stack(&req.work);
+
+	spin_lock(&zram->bd_lock);
+	list_del(&req.list);
+	if (req.free_slot) {
+		/* The last reader of a freed slot releases it */
+		list_for_each_entry(other, &zram->bd_reads, list) {
+			if (other->slot == req.slot) {
+				req.free_slot = 0;
+				break;
+			}
+		}
+		if (req.free_slot)
+			bitmap_clear(zram->bd_bitmap, req.slot, 1);
+	}
+	spin_unlock(&zram->bd_lock);
+
+	return req.ret;
+}
+
+u64 zram_get_mem_used(struct zram *zram)
+{
+	return zs_get_total_size_bytes(zram->mem_pool) +
+		((u64)atomic_read(&zram->stats.pages_expand) << PAGE_SHIFT);
+}
+
+/*
+ * Writes that need new memory fail once the pool would exceed mem_limit,
+ * so that swap moves on to other devices. Dedup hits still succeed.
+ *
+ * Called after the allocation, which is already counted in the memory
+ * used: concurrent writers each see the others' allocations and give
+ * theirs back, so the limit cannot be overshot by racing checks.
+ */
+static int zram_over_limit(struct zram *zram)
+{
+	unsigned long limit = zram->limit_pages;
+
+	return limit && zram_get_mem_used(zram) > (u64)limit << PAGE_SHIFT;
+}
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	u32 clen, checksum;
+	struct zobj_header *zheader;
+	struct page *page;
+	unsigned long handle;
+
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_bd_put_slot(zram, zram->table[index].slot);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram->table[index].slot = 0;
+		zram_stat_dec(&zram->stats.bd_count);
+		return;
+	}
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	page = zram->table[index].page;
+	handle = zram->table[index].handle;
 
 	if (unlikely(!page)) {
 		/*
@@ -157,20 +589,30 @@ static void zram_free_page(struct zram *zram, size_t index)
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	zheader = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	clen = zheader->size;
+	checksum = zheader->checksum;
+	zs_unmap_object(zram->mem_pool, handle);
 
-	xv_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	/* Other table entries still share the object */
+	if (zram_dedup_put(zram, checksum, handle)) {
+		zram_stat64_sub(zram, dedup_saved, clen);
+		zram_stat_dec(&zram->stats.pages_stored);
+		goto clear;
+	}
+
+	zs_free(zram->mem_pool, handle);
+
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	zram_stat64_sub(zram, compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
+clear:
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -190,8 +632,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -200,12 +641,49 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static int zram_read(struct zram *zram, struct bio *bio)
+/* Copy out the page stored at index. Called with its entry lock held. */
+static int zram_decompress_page(struct zram *zram, struct zram_stream *strm,
+				struct page *page, u32 index)
+{
+	int ret;
+	struct zobj_header *zheader;
+	unsigned char *user_mem, *cmem;
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
+
+	zheader = (struct zobj_header *)cmem;
+	ret = zram_decompress(zram, strm,
+		cmem + sizeof(*zheader), zheader->size, user_mem);
+
+	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (likely(!ret))
+		flush_dcache_page(page);
+
+	return ret;
+}
+
+/*
+ * Decompressors may keep state, so reads need a stream as well. Batched
+ * reads pass in the stream they share; otherwise shared_strm is NULL.
+ */
+static int zram_read(struct zram *zram, struct bio *bio,
+			struct zram_stream *shared_strm)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_stream *strm = shared_strm;
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -213,26 +691,48 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		return 0;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
+	zram_stat64_inc(zram, num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	if (!shared_strm)
+		strm = zram_stream_get(zram);
+
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		spinlock_t *lock = zram_entry_lock(zram, index);
 
 		page = bvec->bv_page;
 
+		spin_lock(lock);
+		zram->table[index].atime = jiffies;
+		zram_clear_flag(zram, index, ZRAM_IDLE);
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			spin_unlock(lock);
 			handle_zero_page(page);
 			index++;
 			continue;
 		}
 
+		/* Page was written back to the backing device */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			ret = zram_bd_read(zram, index, page, lock);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat64_inc(zram, failed_reads);
+				goto out;
+			}
+
+			zram_stat64_inc(zram, bd_reads);
+			flush_dcache_page(page);
+			index++;
+			continue;
+		}
+
 		/* Requested page is not present in compressed area */
 		if (unlikely(!zram->table[index].page)) {
+			spin_unlock(lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -240,44 +740,29 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
-
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_decompress_page(zram, strm, page, index);
+		spin_unlock(lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
+			zram_stat64_inc(zram, failed_reads);
 			goto out;
 		}
 
-		flush_dcache_page(page);
 		index++;
 	}
 
+	if (!shared_strm)
+		zram_stream_put(strm);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+	if (!shared_strm)
+		zram_stream_put(strm);
 	bio_io_error(bio);
 	return 0;
 }
@@ -294,48 +779,58 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			goto out;
 	}
 
-	zram_stat64_inc(zram, &zram->stats.num_writes);
+	zram_stat64_inc(zram, num_writes);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
-		size_t clen;
+		u32 checksum = 0;
+		unsigned int clen;
+		int uncompressed = 0, shared = 0;
+		unsigned long handle = 0;
 		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		struct page *page, *page_store = NULL;
+		struct zram_stream *strm;
 		unsigned char *user_mem, *cmem, *src;
+		spinlock_t *lock = zram_entry_lock(zram, index);
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
+		 * Only the per-CPU stream is held while compressing and
+		 * allocating; the table entry is locked just long enough
+		 * to swap the old object for the new one.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		strm = zram_stream_get(zram);
+		src = strm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
+			zram_stream_put(strm);
+
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			spin_lock(lock);
+			zram_free_page(zram, index);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram->table[index].atime = jiffies;
+			spin_unlock(lock);
+
+			zram_stat_inc(&zram->stats.pages_zero);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		ret = zram_compress(zram, strm, user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_stream_put(strm);
 			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			zram_stat64_inc(zram, failed_writes);
 			goto out;
 		}
 
@@ -348,60 +843,96 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zram_stream_put(strm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
+				zram_stat64_inc(zram, failed_writes);
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			if (zram_over_limit(zram)) {
+				zram_stat_dec(&zram->stats.pages_expand);
+				__free_page(page_store);
+				zram_stream_put(strm);
+				goto over_limit;
+			}
+
+			uncompressed = 1;
+			zram_stream_put(strm);
+
+			user_mem = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, user_mem, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(user_mem, KM_USER0);
+			goto install;
+		}
+
+		/* An identical page is already stored: just share it */
+		checksum = jhash(src, clen, 0);
+		if (zram_dedup_get(zram, checksum, src, clen, &handle)) {
+			zram_stream_put(strm);
+			shared = 1;
+			goto install;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
+			zram_stream_put(strm);
 			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
+				"page: %u, size=%u\n", index, clen);
+			zram_stat64_inc(zram, failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		if (zram_over_limit(zram)) {
+			zs_free(zram->mem_pool, handle);
+			zram_stream_put(strm);
+			goto over_limit;
+		}
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
-#endif
+		zheader = (struct zobj_header *)cmem;
+		zheader->checksum = checksum;
+		zheader->size = clen;
+		memcpy(cmem + sizeof(*zheader), src, clen);
 
-		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
+		zram_stream_put(strm);
+
+		/* Index before the entry is visible to slot frees */
+		zram_dedup_add(zram, checksum, handle);
+
+install:
+		spin_lock(lock);
+		zram_free_page(zram, index);
+		if (unlikely(uncompressed)) {
+			zram->table[index].page = page_store;
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		} else {
+			zram->table[index].handle = handle;
+		}
+		zram->table[index].atime = jiffies;
+		spin_unlock(lock);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		/* Incompressible pages are better off on the backing device */
+		if (unlikely(uncompressed))
+			zram_kick_writeback(zram);
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		if (shared) {
+			zram_stat64_inc(zram, dedup_hits);
+			zram_stat64_add(zram, dedup_saved, clen);
+		} else {
+			zram_stat64_add(zram, compr_size, clen);
+		}
 		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
+		if (!uncompressed && clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -409,6 +940,9 @@ memstore:
 	bio_endio(bio, 0);
 	return 0;
 
+over_limit:
+	zram_stat64_inc(zram, limit_fails);
+	zram_stat64_inc(zram, failed_writes);
 out:
 	bio_io_error(bio);
 	return 0;
@@ -431,6 +965,158 @@ static inline int valid_io_request(struct zram *zram, struct bio *bio)
 	return 1;
 }
 
+/* A queued bio and its position in the batch, as submitted */
+struct zram_queued_bio {
+	struct bio *bio;
+	int seq;
+};
+
+/*
+ * sort() is not stable, so bios for the same sector keep their submission
+ * order through the tie-break on seq.
+ */
+static int zram_bio_cmp(const void *a, const void *b)
+{
+	const struct zram_queued_bio *x = a;
+	const struct zram_queued_bio *y = b;
+
+	if (x->bio->bi_sector != y->bio->bi_sector)
+		return x->bio->bi_sector < y->bio->bi_sector ? -1 : 1;
+	return x->seq - y->seq;
+}
+
+/* Whether bio continues prev in the same direction */
+static int zram_bio_adjacent(struct bio *prev, struct bio *bio)
+{
+	return bio_data_dir(prev) == bio_data_dir(bio) &&
+		prev->bi_sector + (prev->bi_size >> SECTOR_SHIFT) ==
+			bio->bi_sector;
+}
+
+/* Handle a run of adjacent bios; reads share one compression stream */
+static void zram_do_run(struct zram *zram, struct bio **bios, int nr)
+{
+	int i;
+	struct zram_stream *strm = NULL;
+
+	if (nr > 1)
+		zram_stat64_add(zram, async_merged, nr - 1);
+
+	if (bio_data_dir(bios[0]) == WRITE) {
+		for (i = 0; i < nr; i++)
+			zram_write(zram, bios[i]);
+		return;
+	}
+
+	if (zram->init_done)
+		strm = zram_stream_get(zram);
+	for (i = 0; i < nr; i++)
+		zram_read(zram, bios[i], strm);
+	if (strm)
+		zram_stream_put(strm);
+}
+
+/*
+ * Handle bios in batches of ZRAM_ASYNC_BATCH, sorted by sector so that
+ * adjacent requests are handled back to back.
+ */
+static void zram_handle_bios(struct zram *zram, struct bio_list *bios)
+{
+	int i, j, nr;
+	struct bio *bio;
+	struct zram_queued_bio queued[ZRAM_ASYNC_BATCH];
+	struct bio *batch[ZRAM_ASYNC_BATCH];
+
+	while (!bio_list_empty(bios)) {
+		nr = 0;
+		while (nr < ZRAM_ASYNC_BATCH && (bio = bio_list_pop(bios))) {
+			queued[nr].bio = bio;
+			queued[nr].seq = nr;
+			nr++;
+		}
+
+		sort(queued, nr, sizeof(*queued), zram_bio_cmp, NULL);
+		for (i = 0; i < nr; i++)
+			batch[i] = queued[i].bio;
+
+		for (i = 0; i < nr; i = j) {
+			for (j = i + 1; j < nr; j++)
+				if (!zram_bio_adjacent(batch[j - 1], batch[j]))
+					break;
+			zram_do_run(zram, batch + i, j - i);
+		}
+	}
+}
+
+/*
+ * Drain this CPU's queue. Bios submitted from reclaim go first and are
+ * handled with PF_MEMALLOC, like the reclaiming task would have handled
+ * them itself, so compressing them can use the reserves instead of
+ * waiting for the memory that their swap-out is meant to free.
+ */
+static void zram_queue_work(struct work_struct *work)
+{
+	unsigned long pflags;
+	struct bio_list bios, reclaim_bios;
+	struct zram_queue *q = container_of(work, struct zram_queue, work);
+
+	spin_lock_irq(&q->lock);
+	reclaim_bios = q->reclaim_bios;
+	bio_list_init(&q->reclaim_bios);
+	bios = q->bios;
+	bio_list_init(&q->bios);
+	spin_unlock_irq(&q->lock);
+
+	q->worker = current;
+	if (!bio_list_empty(&reclaim_bios)) {
+		pflags = current->flags & PF_MEMALLOC;
+		current->flags |= PF_MEMALLOC;
+		zram_handle_bios(q->zram, &reclaim_bios);
+		current->flags = (current->flags & ~PF_MEMALLOC) | pflags;
+	}
+	zram_handle_bios(q->zram, &bios);
+	q->worker = NULL;
+}
+
+/*
+ * Wait for the bios queued on this device to complete. A worker may get
+ * here itself when initialization from a queued write fails and resets
+ * the device; it must not wait for its own work.
+ */
+static void zram_flush_queues(struct zram *zram)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_queue *q = per_cpu_ptr(zram->queues, cpu);
+
+		if (q->worker != current)
+			flush_work(&q->work);
+	}
+}
+
+/*
+ * Hand bio to the worker of the submitting CPU and return at once. This
+ * allocates nothing, since bios are chained through bi_next and the
+ * worker threads exist already, so it is safe from reclaim.
+ */
+static void zram_queue_bio(struct zram *zram, struct bio *bio)
+{
+	int cpu = get_cpu();
+	unsigned long flags;
+	struct zram_queue *q = per_cpu_ptr(zram->queues, cpu);
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (current->flags & PF_MEMALLOC)
+		bio_list_add(&q->reclaim_bios, bio);
+	else
+		bio_list_add(&q->bios, bio);
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	queue_work_on(cpu, zram_io_wq, &q->work);
+	put_cpu();
+}
+
 /*
  * Handler function for all zram I/O requests.
  */
@@ -440,14 +1126,19 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	struct zram *zram = queue->queuedata;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		zram_stat64_inc(zram, invalid_io);
 		bio_io_error(bio);
 		return 0;
 	}
 
+	if (zram->async) {
+		zram_queue_bio(zram, bio);
+		return 0;
+	}
+
 	switch (bio_data_dir(bio)) {
 	case READ:
-		ret = zram_read(zram, bio);
+		ret = zram_read(zram, bio, NULL);
 		break;
 
 	case WRITE:
@@ -458,54 +1149,451 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
-void zram_reset_device(struct zram *zram)
+/* Whether the page at index should move to the backing device */
+static int zram_wb_candidate(struct zram *zram, size_t index)
+{
+	if (zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    !zram->table[index].page)
+		return 0;
+
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) ||
+	    zram_test_flag(zram, index, ZRAM_IDLE))
+		return 1;
+
+	return zram->wb_age &&
+		time_after(jiffies, zram->table[index].atime + zram->wb_age);
+}
+
+/*
+ * Copy up to nr candidate pages, scanning from *cursor, into pages and
+ * write them to the backing device with as few bios as possible. Entries
+ * rewritten or freed meanwhile lose ZRAM_UNDER_WB and are left alone.
+ * Returns the number of pages moved or a negative error.
+ */
+static int zram_writeback_batch(struct zram *zram, struct page **pages,
+				int nr, size_t *cursor)
+{
+	int i, ret, count = 0;
+	u32 batch[ZRAM_WB_BATCH];
+	unsigned long slot;
+	size_t index, num_pages = zram->disksize >> PAGE_SHIFT;
+
+	slot = zram_bd_alloc_slots(zram, &nr);
+	if (!nr)
+		return 0;
+
+	for (index = *cursor; index < num_pages && count < nr; index++) {
+		struct zram_stream *strm;
+		spinlock_t *lock = zram_entry_lock(zram, index);
+
+		cond_resched();
+
+		spin_lock(lock);
+		ret = zram_wb_candidate(zram, index);
+		spin_unlock(lock);
+		if (!ret)
+			continue;
+
+		strm = zram_stream_get(zram);
+		spin_lock(lock);
+		if (zram_wb_candidate(zram, index) &&
+		    !zram_decompress_page(zram, strm, pages[count], index)) {
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+			batch[count++] = index;
+		}
+		spin_unlock(lock);
+		zram_stream_put(strm);
+	}
+	*cursor = index;
+
+	ret = 0;
+	if (count)
+		ret = zram_bd_rw(zram, WRITE, slot, pages, count);
+
+	for (i = 0; i < count; i++) {
+		spinlock_t *lock = zram_entry_lock(zram, batch[i]);
+
+		spin_lock(lock);
+		if (ret || !zram_test_flag(zram, batch[i], ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, batch[i], ZRAM_UNDER_WB);
+			spin_unlock(lock);
+			zram_bd_free_slots(zram, slot + i, 1);
+			continue;
+		}
+
+		zram_free_page(zram, batch[i]);
+		zram->table[batch[i]].slot = slot + i;
+		zram_set_flag(zram, batch[i], ZRAM_WB);
+		spin_unlock(lock);
+
+		zram_stat_inc(&zram->stats.bd_count);
+		zram_stat64_inc(zram, bd_writes);
+	}
+
+	/* Give back the part of the run the scan did not fill */
+	if (count < nr)
+		zram_bd_free_slots(zram, slot + count, nr - count);
+
+	return ret ? ret : count;
+}
+
+/*
+ * Scan the whole table once, writing incompressible pages and pages idle
+ * for longer than wb_age to the backing device in batches.
+ */
+static void zram_writeback_work(struct work_struct *work)
+{
+	int i, nr, ret;
+	size_t cursor = 0;
+	struct page *pages[ZRAM_WB_BATCH];
+	struct zram *zram = container_of(work, struct zram, wb_work.work);
+
+	if (!zram->init_done || !zram->bdev)
+		return;
+
+	for (nr = 0; nr < ZRAM_WB_BATCH; nr++) {
+		pages[nr] = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+		if (!pages[nr])
+			break;
+	}
+
+	if (nr) {
+		do {
+			ret = zram_writeback_batch(zram, pages, nr, &cursor);
+		} while (ret > 0 && cursor < zram->disksize >> PAGE_SHIFT);
+
+		if (ret < 0)
+			pr_warning("Writeback failed: err=%d\n", ret);
+	}
+
+	for (i = 0; i < nr; i++)
+		__free_page(pages[i]);
+
+	if (zram->wb_age)
+		queue_delayed_work(zram_wb_wq, &zram->wb_work,
+				ZRAM_WB_INTERVAL);
+}
+
+/*
+ * Mark stored pages not accessed for at least age jiffies (all of them
+ * if age is 0) as idle. The mark goes away when the page is next read or
+ * written. Idle pages are written back if there is a backing device.
+ */
+void zram_mark_idle(struct zram *zram, unsigned long age)
 {
 	size_t index;
 
 	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	if (!zram->init_done)
+		goto out;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		spinlock_t *lock = zram_entry_lock(zram, index);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+		spin_lock(lock);
+		if ((zram->table[index].page ||
+		     zram_test_flag(zram, index, ZRAM_WB)) &&
+		    (!age || time_after(jiffies,
+					zram->table[index].atime + age)))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		spin_unlock(lock);
 
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		cond_resched();
+	}
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+	zram_kick_writeback(zram);
+out:
+	mutex_unlock(&zram->init_lock);
+}
 
-		if (!page)
-			continue;
+void zram_kick_writeback(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	/* Pull a pending periodic run forward instead of waiting for it */
+	cancel_delayed_work(&zram->wb_work);
+	queue_delayed_work(zram_wb_wq, &zram->wb_work, 0);
+}
+
+static void zram_put_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bd_bitmap);
+	zram->bdev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_pages = 0;
+}
+
+/*
+ * Attach the block device at path as backing device, or detach the
+ * current one if path is "none". Only possible before init.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret = 0;
+	unsigned long nr = 0;
+	unsigned long *bitmap = NULL;
+	struct block_device *bdev = NULL;
+
+	if (strcmp(path, "none")) {
+		bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE,
+					zram);
+		if (IS_ERR(bdev))
+			return PTR_ERR(bdev);
+
+		nr = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+		if (!nr) {
+			ret = -EINVAL;
+			goto fail;
+		}
+
+		bitmap = vmalloc(BITS_TO_LONGS(nr) * sizeof(long));
+		if (!bitmap) {
+			ret = -ENOMEM;
+			goto fail;
+		}
+		memset(bitmap, 0, BITS_TO_LONGS(nr) * sizeof(long));
+	}
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Cannot change backing device for initialized "
+			"device\n");
+		ret = -EBUSY;
+		goto fail;
 	}
 
+	zram_put_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->bd_bitmap = bitmap;
+	zram->bd_pages = nr;
+	mutex_unlock(&zram->init_lock);
+
+	return 0;
+
+fail:
+	vfree(bitmap);
+	if (bdev)
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+	return ret;
+}
+
+/*
+ * debugfs block_state: one line per stored page with its index, the time
+ * since its last access in milliseconds and its flags: z(ero),
+ * u(ncompressed), w(ritten back), i(dle).
+ */
+static void *zram_state_start(struct seq_file *s, loff_t *pos)
+{
+	struct zram *zram = s->private;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || *pos >= zram->disksize >> PAGE_SHIFT)
+		return NULL;
+
+	return pos;
+}
+
+static void *zram_state_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	struct zram *zram = s->private;
+
+	if (++*pos >= zram->disksize >> PAGE_SHIFT)
+		return NULL;
+
+	return pos;
+}
+
+static void zram_state_stop(struct seq_file *s, void *v)
+{
+	struct zram *zram = s->private;
+
+	mutex_unlock(&zram->init_lock);
+}
+
+static int zram_state_show(struct seq_file *s, void *v)
+{
+	u8 flags;
+	int stored;
+	unsigned long atime;
+	struct zram *zram = s->private;
+	size_t index = *(loff_t *)v;
+	spinlock_t *lock = zram_entry_lock(zram, index);
+
+	spin_lock(lock);
+	flags = zram->table[index].flags;
+	atime = zram->table[index].atime;
+	stored = zram->table[index].page ||
+		(flags & (BIT(ZRAM_ZERO) | BIT(ZRAM_WB)));
+	spin_unlock(lock);
+
+	if (!stored)
+		return 0;
+
+	seq_printf(s, "%8zu %10u %c%c%c%c\n", index,
+		jiffies_to_msecs(jiffies - atime),
+		flags & BIT(ZRAM_ZERO) ? 'z' : '.',
+		flags & BIT(ZRAM_UNCOMPRESSED) ? 'u' : '.',
+		flags & BIT(ZRAM_WB) ? 'w' : '.',
+		flags & BIT(ZRAM_IDLE) ? 'i' : '.');
+
+	return 0;
+}
+
+static const struct seq_operations zram_state_seq_ops = {
+	.start	= zram_state_start,
+	.next	= zram_state_next,
+	.stop	= zram_state_stop,
+	.show	= zram_state_show,
+};
+
+static int zram_state_open(struct inode *inode, struct file *file)
+{
+	int ret;
+
+	ret = seq_open(file, &zram_state_seq_ops);
+	if (!ret)
+		((struct seq_file *)file->private_data)->private =
+			inode->i_private;
+
+	return ret;
+}
+
+static const struct file_operations zram_state_fops = {
+	.open		= zram_state_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
+static void zram_destroy_streams(struct zram *zram)
+{
+	int cpu;
+	struct zram_stream *strm;
+
+	if (!zram->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(zram->streams, cpu);
+		if (strm->tfm)
+			crypto_free_comp(strm->tfm);
+		free_pages((unsigned long)strm->buffer, 1);
+	}
+
+	free_percpu(zram->streams);
+	zram->streams = NULL;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	int cpu;
+	struct zram_stream *strm;
+
+	zram->streams = alloc_percpu(struct zram_stream);
+	if (!zram->streams)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		strm = per_cpu_ptr(zram->streams, cpu);
+		mutex_init(&strm->lock);
+
+		strm->tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(strm->tfm)) {
+			int ret = PTR_ERR(strm->tfm);
+
+			strm->tfm = NULL;
+			return ret;
+		}
+
+		strm->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!strm->buffer)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	int cpu;
+	size_t index;
+
+	/* Queued writes may still need to initialize the device */
+	zram_flush_queues(zram);
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	cancel_delayed_work_sync(&zram->wb_work);
+
+	/* Free various per-device buffers */
+	zram_destroy_streams(zram);
+
+	/* Free all pages that are still in this zram device */
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	/* Every object has been released, so the index is empty */
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+
+	zram_put_backing_dev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu_ptr(zram->stats_cpu, cpu)->stats, 0,
+			sizeof(struct zram_stats64));
 
 	zram->disksize = 0;
 	mutex_unlock(&zram->init_lock);
 }
 
+/*
+ * Point zram->backend at the statistics slot of the configured compressor,
+ * recycling the last slot once ZRAM_MAX_BACKENDS have been used. Called
+ * before the device takes I/O, so no CPU is updating the slot.
+ */
+static void zram_select_backend(struct zram *zram)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZRAM_MAX_BACKENDS; i++) {
+		if (!strcmp(zram->backend_names[i], zram->compressor))
+			goto out;
+		if (!zram->backend_names[i][0])
+			break;
+	}
+	if (i == ZRAM_MAX_BACKENDS)
+		i--;
+
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu_ptr(zram->stats_cpu, cpu)->backend[i], 0,
+			sizeof(struct zram_backend_stats));
+	strlcpy(zram->backend_names[i], zram->compressor,
+		sizeof(zram->backend_names[i]));
+out:
+	zram->backend = i;
+}
+
 int zram_init_device(struct zram *zram)
 {
 	int ret;
-	size_t num_pages;
+	size_t num_pages, index;
 
 	mutex_lock(&zram->init_lock);
 
@@ -516,20 +1604,6 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vmalloc(num_pages * sizeof(*zram->table));
 	if (!zram->table) {
@@ -541,12 +1615,32 @@ int zram_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	zram_select_backend(zram);
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating %s compression streams\n",
+			zram->compressor);
+		goto fail;
+	}
+
+	zram->dedup_buckets = roundup_pow_of_two(max_t(size_t,
+					num_pages / 8, ZRAM_DEDUP_MIN_BUCKETS));
+	zram->dedup_table = vmalloc(zram->dedup_buckets *
+					sizeof(*zram->dedup_table));
+	if (!zram->dedup_table) {
+		pr_err("Error allocating dedup index\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (index = 0; index < zram->dedup_buckets; index++)
+		INIT_HLIST_HEAD(&zram->dedup_table[index]);
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -556,6 +1650,8 @@ int zram_init_device(struct zram *zram)
 	zram->init_done = 1;
 	mutex_unlock(&zram->init_lock);
 
+	zram_kick_writeback(zram);
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -572,10 +1668,116 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	spin_lock(zram_entry_lock(zram, index));
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	spin_unlock(zram_entry_lock(zram, index));
+	zram_stat64_inc(zram, notify_free);
+}
+
+#ifdef CONFIG_ZRAM_BENCHMARK
+/* Pages compressed by each writer, cycling over a few distinct sources */
+#define ZRAM_BENCH_PAGES	2048
+#define ZRAM_BENCH_SRC		8
+
+struct zram_bench {
+	struct zram *zram;
+	unsigned char *src;
+	atomic_t running;
+	struct completion done;
+	int error;
+};
+
+static int zram_bench_thread(void *data)
+{
+	struct zram_bench *bench = data;
+	struct zram_stream *strm;
+	unsigned int clen;
+	int i, ret;
+
+	for (i = 0; i < ZRAM_BENCH_PAGES; i++) {
+		strm = zram_stream_get(bench->zram);
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(strm->tfm, bench->src +
+				(i % ZRAM_BENCH_SRC) * PAGE_SIZE, PAGE_SIZE,
+				strm->buffer, &clen);
+		zram_stream_put(strm);
+		if (unlikely(ret))
+			bench->error = ret;
+	}
+
+	if (atomic_dec_and_test(&bench->running))
+		complete(&bench->done);
+	return 0;
 }
 
+/*
+ * Compress ZRAM_BENCH_PAGES pages in each of 'writers' threads through the
+ * device's streams and return the aggregate throughput in MB/s.
+ */
+int zram_compr_bench(struct zram *zram, int writers)
+{
+	struct task_struct *tsk[2];
+	struct zram_bench bench;
+	u32 seed = 12345;
+	ktime_t start;
+	s64 us;
+	int i, ret = 0;
+
+	if (writers < 1 || writers > ARRAY_SIZE(tsk))
+		return -EINVAL;
+
+	bench.src = vmalloc(ZRAM_BENCH_SRC * PAGE_SIZE);
+	if (!bench.src)
+		return -ENOMEM;
+
+	/* half text-like, half noise: roughly what anonymous memory gives */
+	for (i = 0; i < ZRAM_BENCH_SRC * PAGE_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		bench.src[i] = (i & 64) ? seed >> 24 : 'a' + i % 13;
+	}
+
+	bench.zram = zram;
+	bench.error = 0;
+	atomic_set(&bench.running, writers);
+	init_completion(&bench.done);
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		ret = -ENXIO;
+		goto out;
+	}
+
+	for (i = 0; i < writers; i++) {
+		tsk[i] = kthread_create(zram_bench_thread, &bench,
+					"zram_bench/%d", i);
+		if (IS_ERR(tsk[i])) {
+			ret = PTR_ERR(tsk[i]);
+			/* let the threads already created run and finish */
+			atomic_sub(writers - i, &bench.running);
+			writers = i;
+			break;
+		}
+	}
+
+	start = ktime_get();
+	for (i = 0; i < writers; i++)
+		wake_up_process(tsk[i]);
+	if (writers)
+		wait_for_completion(&bench.done);
+	us = ktime_us_delta(ktime_get(), start);
+
+	if (!ret)
+		ret = bench.error;
+	if (!ret)
+		ret = div_u64((u64)writers * ZRAM_BENCH_PAGES * PAGE_SIZE,
+			      max_t(s64, us, 1));
+out:
+	mutex_unlock(&zram->init_lock);
+	vfree(bench.src);
+	return ret;
+}
+#endif
+
 static const struct block_device_operations zram_devops = {
 	.swap_slot_free_notify = zram_slot_free_notify,
 	.owner = THIS_MODULE
@@ -583,11 +1785,44 @@ static const struct block_device_operations zram_devops = {
 
 static int create_device(struct zram *zram, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->dedup_lock);
+	spin_lock_init(&zram->bd_lock);
+	INIT_LIST_HEAD(&zram->bd_reads);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_writeback_work);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+	for (i = 0; i < ZRAM_TABLE_LOCKS; i++)
+		spin_lock_init(&zram->table_lock[i]);
+
+	zram->queues = alloc_percpu(struct zram_queue);
+	if (!zram->queues) {
+		pr_err("Error allocating request queues for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram->stats_cpu = alloc_percpu(struct zram_stats_cpu);
+	if (!zram->stats_cpu) {
+		pr_err("Error allocating statistics for device %d\n",
+			device_id);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for_each_possible_cpu(i) {
+		struct zram_queue *q = per_cpu_ptr(zram->queues, i);
+
+		spin_lock_init(&q->lock);
+		bio_list_init(&q->bios);
+		bio_list_init(&q->reclaim_bios);
+		INIT_WORK(&q->work, zram_queue_work);
+		q->zram = zram;
+		q->worker = NULL;
+	}
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -640,6 +1875,13 @@ static int create_device(struct zram *zram, int device_id)
 	}
 #endif
 
+	if (zram_debugfs_root) {
+		zram->debugfs_dir = debugfs_create_dir(zram->disk->disk_name,
+						zram_debugfs_root);
+		debugfs_create_file("block_state", S_IRUSR, zram->debugfs_dir,
+					zram, &zram_state_fops);
+	}
+
 	zram->init_done = 0;
 
 out:
@@ -648,6 +1890,11 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+	/* Complete bios still queued for the workers */
+	zram_flush_queues(zram);
+
+	debugfs_remove_recursive(zram->debugfs_dir);
+
 #ifdef CONFIG_SYSFS
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
@@ -660,6 +1907,9 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	free_percpu(zram->queues);
+	free_percpu(zram->stats_cpu);
 }
 
 static int __init zram_init(void)
@@ -673,11 +1923,30 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	zram_dedup_cache = KMEM_CACHE(zram_dedup_entry, 0);
+	if (!zram_dedup_cache) {
+		pr_warning("Unable to create dedup cache\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	zram_read_wq = create_workqueue("zram_read");
+	zram_wb_wq = create_singlethread_workqueue("zram_wb");
+	zram_io_wq = create_workqueue("zram_io");
+	if (!zram_read_wq || !zram_wb_wq || !zram_io_wq) {
+		pr_warning("Unable to create workqueues\n");
+		ret = -ENOMEM;
+		goto free_wq;
+	}
+
+	/* Optional, zram works without its debugfs files */
+	zram_debugfs_root = debugfs_create_dir("zram", NULL);
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_wq;
 	}
 
 	if (!num_devices) {
@@ -707,6 +1976,15 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+free_wq:
+	debugfs_remove(zram_debugfs_root);
+	if (zram_read_wq)
+		destroy_workqueue(zram_read_wq);
+	if (zram_wb_wq)
+		destroy_workqueue(zram_wb_wq);
+	if (zram_io_wq)
+		destroy_workqueue(zram_io_wq);
+	kmem_cache_destroy(zram_dedup_cache);
 out:
 	return ret;
 }
@@ -719,14 +1997,20 @@ static void __exit zram_exit(void)
 	for (i = 0; i < num_devices; i++) {
 		zram = &devices[i];
 
-		destroy_device(zram);
+		/* Reset uses the per-CPU queues and stats destroy frees */
 		if (zram->init_done)
 			zram_reset_device(zram);
+		destroy_device(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(devices);
+	debugfs_remove(zram_debugfs_root);
+	destroy_workqueue(zram_read_wq);
+	destroy_workqueue(zram_wb_wq);
+	destroy_workqueue(zram_io_wq);
+	kmem_cache_destroy(zram_dedup_cache);
 	pr_debug("Cleanup done!\n");
 }
 
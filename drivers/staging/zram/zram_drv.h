@@ -17,8 +17,14 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/bio.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -29,13 +35,14 @@ static const unsigned max_num_devices = 32;
 /*
  * Stored at beginning of each compressed object.
  *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
+ * An object may be shared by several table entries with identical
+ * contents, so there is no back-reference to a single entry. The header
+ * holds what dedup needs to compare objects; the number of entries
+ * sharing the object is the refcount of its zram_dedup_entry.
  */
 struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
+	u32 checksum;	/* hash of the compressed data, for dedup */
+	u32 size;	/* compressed size; the object itself is padded */
 };
 
 /*-- Configurable parameters */
@@ -43,6 +50,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression backend, any crypto API compressor can be used */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +61,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -62,6 +72,24 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define SECTORS_PER_PAGE_SHIFT	(PAGE_SHIFT - SECTOR_SHIFT)
 #define SECTORS_PER_PAGE	(1 << SECTORS_PER_PAGE_SHIFT)
 
+/* Number of hashed locks protecting the table entries */
+#define ZRAM_TABLE_LOCKS	64
+
+/* Number of compression backends a device keeps statistics for */
+#define ZRAM_MAX_BACKENDS	4
+
+/* Smallest dedup hash table; larger disks get one bucket per 8 pages */
+#define ZRAM_DEDUP_MIN_BUCKETS	256
+
+/* Pages written to the backing device with one bio */
+#define ZRAM_WB_BATCH		32
+
+/* Period of the writeback scan while a backing device is attached */
+#define ZRAM_WB_INTERVAL	(5 * HZ)
+
+/* Queued bios a worker sorts and merges at a time in async mode */
+#define ZRAM_ASYNC_BATCH	32
+
 /* Flags for zram pages (table[page_no].flags) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
@@ -70,6 +98,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page lives on the backing device, at table[page_no].slot */
+	ZRAM_WB,
+
+	/* Page is being copied to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page not accessed since userspace marked it idle */
+	ZRAM_IDLE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -77,13 +114,18 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	union {
+		struct page *page;	/* ZRAM_UNCOMPRESSED */
+		unsigned long handle;	/* zsmalloc object */
+		unsigned long slot;	/* backing device page (ZRAM_WB) */
+	};
+	u8 count;	/* unused, see zram_dedup_entry.refcount */
 	u8 flags;
+	unsigned long atime;	/* jiffies of the last read or write */
 } __attribute__((aligned(4)));
 
-struct zram_stats {
+/* 64-bit counters, kept per CPU in struct zram_stats_cpu */
+struct zram_stats64 {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
 	u64 num_writes;		/* --do-- */
@@ -91,21 +133,87 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* bytes currently saved by sharing objects */
+	u64 bd_reads;		/* pages read back from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 async_merged;	/* queued bios handled with the previous one */
+	u64 limit_fails;	/* writes failed because of mem_limit */
+};
+
+struct zram_stats {
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	atomic_t bd_count;	/* pages currently on the backing device */
+};
+
+/* Compression ratio and cost of one backend */
+struct zram_backend_stats {
+	u64 compr_pages;	/* pages compressed */
+	u64 compr_size;		/* bytes they compressed to */
+	u64 compr_ns;		/* time spent compressing */
+	u64 decompr_pages;	/* pages decompressed */
+	u64 decompr_ns;		/* time spent decompressing */
+};
+
+/*
+ * Statistics updated for every page, kept per CPU so that concurrent
+ * requests share neither a lock nor a cache line; readers add up all
+ * CPUs. 'seq' keeps a reader on a 32-bit CPU from seeing torn counters.
+ */
+struct zram_stats_cpu {
+	seqcount_t seq;
+	struct zram_stats64 stats;
+	struct zram_backend_stats backend[ZRAM_MAX_BACKENDS];
+};
+
+/*
+ * Index entry of a stored compressed object, hashed by its checksum so
+ * identical pages share one object. Protected by dedup_lock.
+ */
+struct zram_dedup_entry {
+	struct hlist_node node;
+	unsigned long handle;
+	u32 checksum;
+	u32 refcount;	/* table entries pointing at the object */
+};
+
+/*
+ * Compressor transform and output buffer. There is one per CPU so that
+ * concurrent writers compress in parallel; the mutex only matters when a
+ * task is migrated while it holds its stream.
+ */
+struct zram_stream {
+	struct mutex lock;
+	struct crypto_comp *tfm;
+	void *buffer;
+};
+
+/* Bios queued on one CPU in async mode, handled by its worker */
+struct zram_queue {
+	spinlock_t lock;
+	struct bio_list bios;
+	struct bio_list reclaim_bios;	/* from PF_MEMALLOC tasks */
+	struct work_struct work;
+	struct zram *zram;
+	struct task_struct *worker;	/* running work, if any */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_stream __percpu *streams;
 	struct table *table;
-	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/* table[i] is protected by table_lock[i % ZRAM_TABLE_LOCKS] */
+	spinlock_t table_lock[ZRAM_TABLE_LOCKS];
+	/* content index of compressed objects, nests inside table_lock */
+	struct hlist_head *dedup_table;
+	unsigned int dedup_buckets;	/* power of two */
+	spinlock_t dedup_lock;
 	struct request_queue *queue;
+	struct zram_queue __percpu *queues;
+	int async;	/* queue bios to per-CPU workers */
 	struct gendisk *disk;
 	int init_done;
 	/* Prevent concurrent execution of device init and reset */
@@ -115,8 +223,30 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* writes needing memory fail beyond this many pages, 0 = no limit */
+	unsigned long limit_pages;
+	/* crypto API name of the compressor, set before init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
 
 	struct zram_stats stats;
+	struct zram_stats_cpu __percpu *stats_cpu;
+	/* compressors with a slot in zram_stats_cpu.backend */
+	char backend_names[ZRAM_MAX_BACKENDS][CRYPTO_MAX_ALG_NAME];
+	int backend;	/* slot of 'compressor' */
+
+	/*
+	 * Optional backing device that incompressible and idle pages are
+	 * written to. It is attached before init and released on reset.
+	 */
+	struct block_device *bdev;
+	unsigned long *bd_bitmap;	/* used slots, under bd_lock */
+	unsigned long bd_pages;		/* size of bdev in pages */
+	spinlock_t bd_lock;
+	struct list_head bd_reads;	/* reads in flight, under bd_lock */
+	struct delayed_work wb_work;
+	unsigned long wb_age;	/* idle jiffies before writeback, 0 = off */
+
+	struct dentry *debugfs_dir;
 };
 
 extern struct zram *devices;
@@ -127,5 +257,19 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_kick_writeback(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram, unsigned long age);
+extern u64 zram_get_mem_used(struct zram *zram);
+extern void zram_backend_stats_read(struct zram *zram, int slot,
+			struct zram_backend_stats *stats);
+extern u64 zram_stat64_sum(struct zram *zram, size_t offset);
+
+/* Sum over all CPUs of the counter 'field' of struct zram_stats64 */
+#define zram_stat64_read(zram, field) \
+	zram_stat64_sum(zram, offsetof(struct zram_stats64, field))
+#ifdef CONFIG_ZRAM_BENCHMARK
+extern int zram_compr_bench(struct zram *zram, int writers);
+#endif
 
 #endif
@@ -14,22 +14,15 @@
 
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/crypto.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "zram_drv.h"
 
 #ifdef CONFIG_SYSFS
 
-static u64 zram_stat64_read(struct zram *zram, u64 *v)
-{
-	u64 val;
-
-	spin_lock(&zram->stat64_lock);
-	val = *v;
-	spin_unlock(&zram->stat64_lock);
-
-	return val;
-}
-
 static struct zram *dev_to_zram(struct device *dev)
 {
 	int i;
@@ -73,6 +66,89 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 }
 
+/* Backends listed by comp_algorithm when the crypto API provides them */
+static const char * const zram_known_compressors[] = {
+	"lzo",
+	"deflate",
+};
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i, found = 0;
+	ssize_t sz = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; i < ARRAY_SIZE(zram_known_compressors); i++) {
+		const char *name = zram_known_compressors[i];
+
+		if (!strcmp(name, zram->compressor)) {
+			sz += sprintf(buf + sz, "[%s] ", name);
+			found = 1;
+		} else if (crypto_has_comp(name, 0, 0)) {
+			sz += sprintf(buf + sz, "%s ", name);
+		}
+	}
+	if (!found)
+		sz += sprintf(buf + sz, "[%s] ", zram->compressor);
+
+	buf[sz - 1] = '\n';
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zram *zram = dev_to_zram(dev);
+	int ret = len;
+
+	strlcpy(name, buf, sizeof(name));
+	strim(name);
+
+	if (!crypto_has_comp(name, 0, 0))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		pr_info("Cannot change compressor for initialized device\n");
+		ret = -EBUSY;
+	} else {
+		strlcpy(zram->compressor, name, sizeof(zram->compressor));
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+static ssize_t comp_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+	struct zram_backend_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	for (i = 0; i < ZRAM_MAX_BACKENDS; i++) {
+		if (!zram->backend_names[i][0])
+			break;
+
+		zram_backend_stats_read(zram, i, &stats);
+		sz += sprintf(buf + sz, "%s: ratio %llu%% compress %llu ns/page "
+			"decompress %llu ns/page (%llu/%llu pages)\n",
+			zram->backend_names[i],
+			stats.compr_pages ? div64_u64(stats.compr_size * 100,
+				stats.compr_pages << PAGE_SHIFT) : 0,
+			stats.compr_pages ? div64_u64(stats.compr_ns,
+				stats.compr_pages) : 0,
+			stats.decompr_pages ? div64_u64(stats.decompr_ns,
+				stats.decompr_pages) : 0,
+			stats.compr_pages, stats.decompr_pages);
+	}
+
+	return sz;
+}
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -119,7 +195,7 @@ static ssize_t num_reads_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_reads));
+		zram_stat64_read(zram, num_reads));
 }
 
 static ssize_t num_writes_show(struct device *dev,
@@ -128,7 +204,7 @@ static ssize_t num_writes_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.num_writes));
+		zram_stat64_read(zram, num_writes));
 }
 
 static ssize_t invalid_io_show(struct device *dev,
@@ -137,7 +213,7 @@ static ssize_t invalid_io_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.invalid_io));
+		zram_stat64_read(zram, invalid_io));
 }
 
 static ssize_t notify_free_show(struct device *dev,
@@ -146,7 +222,7 @@ static ssize_t notify_free_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.notify_free));
+		zram_stat64_read(zram, notify_free));
 }
 
 static ssize_t zero_pages_show(struct device *dev,
@@ -154,7 +230,7 @@ static ssize_t zero_pages_show(struct device *dev,
 {
 	struct zram *zram = dev_to_zram(dev);
 
-	return sprintf(buf, "%u\n", zram->stats.pages_zero);
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.pages_zero));
 }
 
 static ssize_t orig_data_size_show(struct device *dev,
@@ -163,7 +239,7 @@ static ssize_t orig_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		(u64)(zram->stats.pages_stored) << PAGE_SHIFT);
+		(u64)atomic_read(&zram->stats.pages_stored) << PAGE_SHIFT);
 }
 
 static ssize_t compr_data_size_show(struct device *dev,
@@ -172,7 +248,144 @@ static ssize_t compr_data_size_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	return sprintf(buf, "%llu\n",
-		zram_stat64_read(zram, &zram->stats.compr_size));
+		zram_stat64_read(zram, compr_size));
+}
+
+static ssize_t async_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->async);
+}
+
+static ssize_t async_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	zram->async = !!val;
+
+	return len;
+}
+
+static ssize_t async_merged_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, async_merged));
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t sz;
+	char name[BDEVNAME_SIZE];
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->bdev)
+		sz = sprintf(buf, "%s\n", bdevname(zram->bdev, name));
+	else
+		sz = sprintf(buf, "none\n");
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	char *path;
+	struct zram *zram = dev_to_zram(dev);
+
+	path = kstrndup(buf, len, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+
+	ret = zram_set_backing_dev(zram, strim(path));
+	kfree(path);
+
+	return ret ? ret : len;
+}
+
+static ssize_t writeback_age_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%lu\n", zram->wb_age / HZ);
+}
+
+static ssize_t writeback_age_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long secs;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &secs);
+	if (ret)
+		return ret;
+
+	zram->wb_age = secs * HZ;
+	if (zram->init_done)
+		zram_kick_writeback(zram);
+
+	return len;
+}
+
+static ssize_t bd_count_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%u\n", atomic_read(&zram->stats.bd_count));
+}
+
+static ssize_t bd_reads_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, bd_reads));
+}
+
+static ssize_t bd_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, bd_writes));
+}
+
+static ssize_t dedup_hits_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, dedup_hits));
+}
+
+static ssize_t dedup_saved_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, dedup_saved));
 }
 
 static ssize_t mem_used_total_show(struct device *dev,
@@ -181,17 +394,104 @@ static ssize_t mem_used_total_show(struct device *dev,
 	u64 val = 0;
 	struct zram *zram = dev_to_zram(dev);
 
-	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
-			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
-	}
+	if (zram->init_done)
+		val = zram_get_mem_used(zram);
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t mem_limit_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n", (u64)zram->limit_pages << PAGE_SHIFT);
+}
+
+static ssize_t mem_limit_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char *end;
+	u64 limit;
+	struct zram *zram = dev_to_zram(dev);
+
+	limit = memparse(buf, &end);
+	if (end == buf)
+		return -EINVAL;
+
+	zram->limit_pages = PAGE_ALIGN(limit) >> PAGE_SHIFT;
+
+	return len;
+}
+
+static ssize_t limit_fails_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%llu\n",
+		zram_stat64_read(zram, limit_fails));
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long secs = 0;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all")) {
+		ret = strict_strtoul(buf, 10, &secs);
+		if (ret)
+			return ret;
+		if (!secs)
+			return -EINVAL;
+	}
+
+	zram_mark_idle(zram, secs * HZ);
+
+	return len;
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+#ifdef CONFIG_ZRAM_BENCHMARK
+static ssize_t compr_bench_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	int one, two;
+	struct zram *zram = dev_to_zram(dev);
+
+	one = zram_compr_bench(zram, 1);
+	if (one < 0)
+		return one;
+
+	two = zram_compr_bench(zram, 2);
+	if (two < 0)
+		return two;
+
+	return sprintf(buf, "1 writer: %d MB/s\n2 writers: %d MB/s\n",
+		one, two);
+}
+#endif
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO, initstate_show, NULL);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
+static DEVICE_ATTR(comp_stats, S_IRUGO, comp_stats_show, NULL);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
@@ -200,11 +500,32 @@ static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
+static DEVICE_ATTR(async, S_IRUGO | S_IWUSR, async_show, async_store);
+static DEVICE_ATTR(async_merged, S_IRUGO, async_merged_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback_age, S_IRUGO | S_IWUSR,
+		writeback_age_show, writeback_age_store);
+static DEVICE_ATTR(bd_count, S_IRUGO, bd_count_show, NULL);
+static DEVICE_ATTR(bd_reads, S_IRUGO, bd_reads_show, NULL);
+static DEVICE_ATTR(bd_writes, S_IRUGO, bd_writes_show, NULL);
+static DEVICE_ATTR(dedup_hits, S_IRUGO, dedup_hits_show, NULL);
+static DEVICE_ATTR(dedup_saved, S_IRUGO, dedup_saved_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(mem_limit, S_IRUGO | S_IWUSR,
+		mem_limit_show, mem_limit_store);
+static DEVICE_ATTR(limit_fails, S_IRUGO, limit_fails_show, NULL);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+#ifdef CONFIG_ZRAM_BENCHMARK
+static DEVICE_ATTR(compr_bench, S_IRUSR, compr_bench_show, NULL);
+#endif
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
 	&dev_attr_initstate.attr,
+	&dev_attr_comp_algorithm.attr,
+	&dev_attr_comp_stats.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
@@ -213,7 +534,23 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_zero_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
+	&dev_attr_async.attr,
+	&dev_attr_async_merged.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback_age.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+	&dev_attr_dedup_hits.attr,
+	&dev_attr_dedup_saved.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_mem_limit.attr,
+	&dev_attr_limit_fails.attr,
+	&dev_attr_idle.attr,
+#ifdef CONFIG_ZRAM_BENCHMARK
+	&dev_attr_compr_bench.attr,
+#endif
 	NULL,
 };
 
@@ -0,0 +1,782 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped in size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * A class carves its objects out of zspages: runs of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE pages treated as one area, so little is lost at
+ * the end of a page and an object may straddle two pages.
+ *
+ * Callers get an opaque handle rather than an address. Every object
+ * starts with its handle, which lets compaction move objects out of
+ * sparsely used zspages and update the handle, so those pages can be
+ * given back. A shrinker kicks compaction off under memory pressure.
+ */
+
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/bit_spinlock.h>
+
+#include "zsmalloc.h"
+
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_SIZE_CLASSES \
+	((PAGE_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA + 1)
+#define ZS_MAX_OBJS_PER_ZSPAGE \
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/* Bit of zs_handle.flags held while the object is mapped or moved */
+#define ZS_HANDLE_PIN		0
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	NR_ZS_FULLNESS,
+	ZS_EMPTY = NR_ZS_FULLNESS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class->fullness_list */
+	struct size_class *class;
+	unsigned int inuse;
+	enum fullness_group fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long used[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;		/* object size, handle included */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	struct list_head fullness_list[NR_ZS_FULLNESS];
+
+	/* stats, protected by lock */
+	unsigned long zspages;
+	unsigned long objs_used;
+};
+
+/* What a handle points to; only changes with the pin held */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int idx;
+	unsigned long flags;
+};
+
+/* Per-CPU state of the object mapped by zs_map_object() */
+struct zs_map_area {
+	void *vaddr;		/* kmap address, NULL if buf is used */
+	char *buf;		/* copy of an object straddling two pages */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	char *name;
+	struct size_class *classes[ZS_SIZE_CLASSES];
+	char *handle_cache_name;
+	struct kmem_cache *handle_cache;
+	struct zs_map_area __percpu *map_area;
+
+	atomic_long_t pages;		/* pages backing zspages */
+	atomic_long_t compacted;	/* pages released by compaction */
+
+	struct shrinker shrinker;
+	struct work_struct compact_work;
+	struct dentry *stat_dentry;
+};
+
+static struct dentry *zs_stat_root;
+static int zs_stat_users;
+static DEFINE_MUTEX(zs_stat_lock);
+
+static struct size_class *get_size_class(struct zs_pool *pool, size_t size)
+{
+	unsigned int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return pool->classes[idx];
+}
+
+/* Pick the zspage length that leaves the least unused at its end */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int used = zspage_size / size * size * 100 /
+					zspage_size;
+
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copy len bytes at byte pos of the zspage to or from buf, mapping one
+ * page at a time.
+ */
+static void zs_copy(struct zspage *zspage, unsigned long pos, void *buf,
+			size_t len, int write, enum km_type type)
+{
+	char *p = buf;
+
+	while (len) {
+		unsigned int off = pos & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - off);
+		char *addr = kmap_atomic(zspage->pages[pos >> PAGE_SHIFT], type);
+
+		if (write)
+			memcpy(addr + off, p, n);
+		else
+			memcpy(p, addr + off, n);
+		kunmap_atomic(addr, type);
+
+		p += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+static void free_zspage(struct zspage *zspage)
+{
+	int i;
+
+	for (i = 0; i < ZS_MAX_PAGES_PER_ZSPAGE; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+	zspage->fullness = ZS_EMPTY;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i]) {
+			free_zspage(zspage);
+			return NULL;
+		}
+	}
+
+	return zspage;
+}
+
+static struct zspage *first_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	if (list_empty(&class->fullness_list[fg]))
+		return NULL;
+	return list_first_entry(&class->fullness_list[fg], struct zspage, list);
+}
+
+static enum fullness_group get_fullness_group(struct zspage *zspage)
+{
+	unsigned int objs = zspage->class->objs_per_zspage;
+
+	if (!zspage->inuse)
+		return ZS_EMPTY;
+	if (zspage->inuse == objs)
+		return ZS_FULL;
+	if (zspage->inuse * 4 <= objs * 3)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Put the zspage on the list matching its use; empty zspages are taken
+ * off all lists. Returns the new group. Called with the class lock held.
+ */
+static enum fullness_group fix_fullness_group(struct zspage *zspage)
+{
+	enum fullness_group fg = get_fullness_group(zspage);
+
+	if (fg == zspage->fullness)
+		return fg;
+
+	list_del_init(&zspage->list);
+	if (fg != ZS_EMPTY)
+		list_add(&zspage->list, &zspage->class->fullness_list[fg]);
+	zspage->fullness = fg;
+
+	return fg;
+}
+
+/* Take a free object slot in zspage for handle */
+static unsigned int obj_alloc(struct zspage *zspage, unsigned long handle)
+{
+	unsigned int idx;
+	struct size_class *class = zspage->class;
+
+	idx = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	__set_bit(idx, zspage->used);
+	zspage->inuse++;
+	class->objs_used++;
+
+	zs_copy(zspage, (unsigned long)idx * class->size, &handle,
+		ZS_HANDLE_SIZE, 1, KM_USER0);
+
+	return idx;
+}
+
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	__clear_bit(idx, zspage->used);
+	zspage->inuse--;
+	zspage->class->objs_used--;
+}
+
+/**
+ * zs_malloc - allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: object size, at most ZS_MAX_ALLOC_SIZE
+ * @flags: flags for the pages backing new zspages
+ *
+ * Returns a handle to be passed to zs_map_object() to access the object,
+ * or 0 if no memory could be allocated.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *h;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(pool->handle_cache, flags & ~__GFP_HIGHMEM);
+	if (!h)
+		return 0;
+	h->flags = 0;
+
+	class = get_size_class(pool, size + ZS_HANDLE_SIZE);
+
+	spin_lock(&class->lock);
+	zspage = first_zspage(class, ZS_ALMOST_FULL);
+	if (!zspage)
+		zspage = first_zspage(class, ZS_ALMOST_EMPTY);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(class, flags);
+		if (!zspage) {
+			kmem_cache_free(pool->handle_cache, h);
+			return 0;
+		}
+		atomic_long_add(class->pages_per_zspage, &pool->pages);
+
+		spin_lock(&class->lock);
+		class->zspages++;
+	}
+
+	h->zspage = zspage;
+	h->idx = obj_alloc(zspage, (unsigned long)h);
+	fix_fullness_group(zspage);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+
+/**
+ * zs_free - free an object
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc(), must not be mapped
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zspage *zspage;
+	struct size_class *class;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	if (unlikely(!handle))
+		return;
+
+	/* Waits for compaction to finish moving the object */
+	bit_spin_lock(ZS_HANDLE_PIN, &h->flags);
+	zspage = h->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(zspage, h->idx);
+	if (fix_fullness_group(zspage) == ZS_EMPTY) {
+		class->zspages--;
+		spin_unlock(&class->lock);
+
+		atomic_long_sub(class->pages_per_zspage, &pool->pages);
+		free_zspage(zspage);
+	} else {
+		spin_unlock(&class->lock);
+	}
+	bit_spin_unlock(ZS_HANDLE_PIN, &h->flags);
+
+	kmem_cache_free(pool->handle_cache, h);
+}
+
+/**
+ * zs_map_object - get a pointer to the object behind a handle
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: whether the object is read, written or both
+ *
+ * The object stays pinned, and preemption disabled, until
+ * zs_unmap_object(). Only one object can be mapped at a time per CPU and
+ * the caller must not hold a KM_USER1 mapping.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	unsigned int size;
+	unsigned long pos;
+	struct zs_map_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	bit_spin_lock(ZS_HANDLE_PIN, &h->flags);
+
+	size = h->zspage->class->size;
+	pos = (unsigned long)h->idx * size;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+	area->mm = mm;
+
+	if ((pos & ~PAGE_MASK) + size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(h->zspage->pages[pos >> PAGE_SHIFT],
+					KM_USER1);
+		return area->vaddr + (pos & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* The object straddles two pages: hand out a copy */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy(h->zspage, pos + ZS_HANDLE_SIZE, area->buf,
+			size - ZS_HANDLE_SIZE, 0, KM_USER1);
+
+	return area->buf;
+}
+
+/**
+ * zs_unmap_object - release an object mapped by zs_map_object()
+ * @pool: pool the object was allocated from
+ * @handle: handle of the mapped object
+ */
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_map_area *area;
+	struct zs_handle *h = (struct zs_handle *)handle;
+
+	area = per_cpu_ptr(pool->map_area, smp_processor_id());
+
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		unsigned int size = h->zspage->class->size;
+
+		zs_copy(h->zspage, (unsigned long)h->idx * size +
+			ZS_HANDLE_SIZE, area->buf, size - ZS_HANDLE_SIZE,
+			1, KM_USER1);
+	}
+
+	bit_spin_unlock(ZS_HANDLE_PIN, &h->flags);
+}
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages) << PAGE_SHIFT;
+}
+
+/*
+ * Number of zspages the unused objects of a class add up to. The
+ * shrinker calls this without the class lock, as an estimate.
+ */
+static unsigned long zs_class_wasted(struct size_class *class)
+{
+	unsigned long alloc = class->zspages * class->objs_per_zspage;
+	unsigned long used = class->objs_used;
+
+	if (used >= alloc)
+		return 0;
+	return (alloc - used) / class->objs_per_zspage;
+}
+
+/*
+ * Move objects from src into dst until src is empty or dst is full.
+ * Objects that are mapped or being freed right now are left behind.
+ * Called with the class lock held; buf holds one object.
+ */
+static void migrate_zspage(struct zspage *src, struct zspage *dst, char *buf)
+{
+	unsigned int idx;
+	struct size_class *class = src->class;
+
+	for_each_set_bit(idx, src->used, class->objs_per_zspage) {
+		struct zs_handle *h;
+		unsigned int new;
+
+		if (dst->inuse == class->objs_per_zspage)
+			break;
+
+		zs_copy(src, (unsigned long)idx * class->size, &h,
+			ZS_HANDLE_SIZE, 0, KM_USER0);
+		if (!bit_spin_trylock(ZS_HANDLE_PIN, &h->flags))
+			continue;
+
+		zs_copy(src, (unsigned long)idx * class->size, buf,
+			class->size, 0, KM_USER0);
+
+		new = find_first_zero_bit(dst->used, class->objs_per_zspage);
+		__set_bit(new, dst->used);
+		dst->inuse++;
+		zs_copy(dst, (unsigned long)new * class->size, buf,
+			class->size, 1, KM_USER0);
+
+		__clear_bit(idx, src->used);
+		src->inuse--;
+
+		h->zspage = dst;
+		h->idx = new;
+		bit_spin_unlock(ZS_HANDLE_PIN, &h->flags);
+	}
+}
+
+/* Pick a zspage to move src's objects into: the fullest with room */
+static struct zspage *get_compact_target(struct size_class *class,
+					struct zspage *src)
+{
+	struct zspage *zspage;
+
+	zspage = first_zspage(class, ZS_ALMOST_FULL);
+	if (zspage)
+		return zspage;
+
+	list_for_each_entry(zspage, &class->fullness_list[ZS_ALMOST_EMPTY],
+				list)
+		if (zspage != src)
+			return zspage;
+
+	return NULL;
+}
+
+static unsigned long compact_class(struct zs_pool *pool,
+				struct size_class *class, char *buf)
+{
+	unsigned long nr, freed = 0;
+	struct zspage *src, *dst;
+	struct list_head *almost_empty =
+		&class->fullness_list[ZS_ALMOST_EMPTY];
+
+	spin_lock(&class->lock);
+	/* Each round empties or rotates a zspage; bound the pinned case */
+	for (nr = class->zspages; nr && zs_class_wasted(class); nr--) {
+		if (list_empty(almost_empty))
+			break;
+
+		src = list_entry(almost_empty->prev, struct zspage, list);
+		dst = get_compact_target(class, src);
+		if (!dst)
+			break;
+
+		migrate_zspage(src, dst, buf);
+		fix_fullness_group(dst);
+
+		if (fix_fullness_group(src) == ZS_EMPTY) {
+			class->zspages--;
+			spin_unlock(&class->lock);
+
+			atomic_long_sub(class->pages_per_zspage, &pool->pages);
+			freed += class->pages_per_zspage;
+			free_zspage(src);
+			cond_resched();
+
+			spin_lock(&class->lock);
+		} else if (dst->inuse != class->objs_per_zspage) {
+			/* src has pinned objects, try another one first */
+			list_move(&src->list, almost_empty);
+		}
+	}
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - release zspages by moving objects out of sparse ones
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	char *buf;
+	unsigned long freed = 0;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += compact_class(pool, pool->classes[i], buf);
+
+	kfree(buf);
+	atomic_long_add(freed, &pool->compacted);
+
+	return freed;
+}
+
+static void zs_compact_work(struct work_struct *work)
+{
+	struct zs_pool *pool = container_of(work, struct zs_pool,
+						compact_work);
+
+	zs_compact(pool);
+}
+
+/*
+ * Compaction can need to wait for mapped objects, so it is not done in
+ * reclaim context; the shrinker only starts it and reports the number
+ * of pages it could free.
+ */
+static int zs_shrink(struct shrinker *shrinker, int nr_to_scan,
+			gfp_t gfp_mask)
+{
+	int i;
+	unsigned long pages = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+						shrinker);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->classes[i];
+
+		pages += zs_class_wasted(class) * class->pages_per_zspage;
+	}
+
+	if (nr_to_scan && pages)
+		schedule_work(&pool->compact_work);
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+static int zs_stats_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+
+	seq_printf(s, "%5s %5s %6s %6s %8s %10s %10s %5s\n", "class",
+		"size", "pages", "objs", "zspages", "objs_used",
+		"objs_alloc", "frag");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->classes[i];
+		unsigned long zspages, used, alloc;
+
+		spin_lock(&class->lock);
+		zspages = class->zspages;
+		used = class->objs_used;
+		spin_unlock(&class->lock);
+
+		if (!zspages)
+			continue;
+
+		/* frag: share of allocated object slots not in use */
+		alloc = zspages * class->objs_per_zspage;
+		seq_printf(s, "%5d %5u %6u %6u %8lu %10lu %10lu %4lu%%\n",
+			i, class->size, class->pages_per_zspage,
+			class->objs_per_zspage, zspages, used, alloc,
+			(alloc - used) * 100 / alloc);
+	}
+
+	seq_printf(s, "pages: %ld\ncompacted: %ld\n",
+		atomic_long_read(&pool->pages),
+		atomic_long_read(&pool->compacted));
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.open		= zs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_stats_create(struct zs_pool *pool)
+{
+	mutex_lock(&zs_stat_lock);
+	if (!zs_stat_users++)
+		zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+	if (zs_stat_root)
+		pool->stat_dentry = debugfs_create_file(pool->name, S_IRUGO,
+					zs_stat_root, pool, &zs_stats_fops);
+	mutex_unlock(&zs_stat_lock);
+}
+
+static void zs_stats_destroy(struct zs_pool *pool)
+{
+	mutex_lock(&zs_stat_lock);
+	debugfs_remove(pool->stat_dentry);
+	if (!--zs_stat_users) {
+		debugfs_remove(zs_stat_root);
+		zs_stat_root = NULL;
+	}
+	mutex_unlock(&zs_stat_lock);
+}
+
+static void zs_free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	if (!pool->map_area)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+/**
+ * zs_create_pool - create an allocation pool
+ * @name: name of the pool's statistics file under debugfs zsmalloc/
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class;
+
+		class = kzalloc(sizeof(*class), GFP_KERNEL);
+		if (!class)
+			goto fail;
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+						class->size;
+		for (fg = 0; fg < NR_ZS_FULLNESS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+
+		pool->classes[i] = class;
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	pool->name = kstrdup(name, GFP_KERNEL);
+	pool->handle_cache_name = kasprintf(GFP_KERNEL, "zs_handle-%s", name);
+	if (!pool->name || !pool->handle_cache_name)
+		goto fail;
+
+	pool->handle_cache = kmem_cache_create(pool->handle_cache_name,
+				sizeof(struct zs_handle), 0, 0, NULL);
+	if (!pool->handle_cache)
+		goto fail;
+
+	atomic_long_set(&pool->pages, 0);
+	atomic_long_set(&pool->compacted, 0);
+	INIT_WORK(&pool->compact_work, zs_compact_work);
+
+	pool->shrinker.shrink = zs_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_stats_create(pool);
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+/**
+ * zs_destroy_pool - destroy a pool, all its objects must have been freed
+ * @pool: pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	/* A pool with a handle cache made it through zs_create_pool() */
+	if (pool->handle_cache) {
+		zs_stats_destroy(pool);
+		unregister_shrinker(&pool->shrinker);
+		cancel_work_sync(&pool->compact_work);
+		kmem_cache_destroy(pool->handle_cache);
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->classes[i];
+
+		if (class && class->zspages)
+			pr_err("zsmalloc: %s class %d still has %lu zspages\n",
+				pool->name, i, class->zspages);
+		kfree(class);
+	}
+
+	zs_free_map_areas(pool);
+	kfree(pool->handle_cache_name);
+	kfree(pool->name);
+	kfree(pool);
+}
@@ -0,0 +1,42 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+#include <asm/page.h>
+
+/* Largest object zs_malloc() can return */
+#define ZS_MAX_ALLOC_SIZE	(PAGE_SIZE - sizeof(unsigned long))
+
+/* How a mapped object is going to be accessed */
+enum zs_mapmode {
+	ZS_MM_RW,
+	ZS_MM_RO,
+	ZS_MM_WO,
+};
+
+struct zs_pool;
+
+struct zs_pool *zs_create_pool(const char *name);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+unsigned long zs_compact(struct zs_pool *pool);
+
+#endif
@@ -189,7 +189,11 @@ static void set_up_hwmem_region(struct b2r2_blt_img *img,
 static int resolve_hwmem(struct b2r2_blt_img *img,
 			struct b2r2_blt_rect *rect_2b_used, bool is_dst,
 				struct b2r2_resolved_buf *resolved_buf);
+static int bounce_hwmem(struct b2r2_blt_img *img,
+				struct b2r2_resolved_buf *resolved_buf);
+static void unpin_hwmem(struct b2r2_resolved_buf *resolved_buf);
 static void unresolve_hwmem(struct b2r2_resolved_buf *resolved_buf);
+static int sync_hwmem_bufs(struct b2r2_blt_request *request);
 
 /**
  * struct sync_args - Data for clean/flush
@@ -862,6 +866,15 @@ static int b2r2_blt(struct b2r2_blt_instance *instance,
 		goto resolve_dst_buf_failed;
 	}
 
+	ret = sync_hwmem_bufs(request);
+	if (ret < 0) {
+		b2r2_log_warn(
+			"%s: Sync hwmem bufs failed, %d\n",
+			__func__, ret);
+		ret = -EAGAIN;
+		goto sync_hwmem_bufs_failed;
+	}
+
 	/* Debug prints of resolved buffers */
 	b2r2_log_info("src.rbuf={%X,%p,%d} {%p,%X,%X,%d}\n",
 		request->src_resolved.physical_address,
@@ -1074,6 +1087,7 @@ job_add_failed:
 exit_dry_run:
 no_optimized_path:
 generate_nodes_failed:
+sync_hwmem_bufs_failed:
 	unresolve_buf(&request->user_req.dst_img.buf,
 		&request->dst_resolved);
 resolve_dst_buf_failed:
@@ -1654,6 +1668,15 @@ static int b2r2_generic_blt(struct b2r2_blt_instance *instance,
 		goto resolve_dst_buf_failed;
 	}
 
+	ret = sync_hwmem_bufs(request);
+	if (ret < 0) {
+		b2r2_log_warn(
+			"%s: Sync hwmem bufs failed, %d\n",
+			__func__, ret);
+		ret = -EAGAIN;
+		goto sync_hwmem_bufs_failed;
+	}
+
 	/* Debug prints of resolved buffers */
 	b2r2_log_info("src.rbuf={%X,%p,%d} {%p,%X,%X,%d}\n",
 		request->src_resolved.physical_address,
@@ -2153,6 +2176,7 @@ alloc_work_bufs_failed:
 	}
 
 generate_nodes_failed:
+sync_hwmem_bufs_failed:
 	unresolve_buf(&request->user_req.dst_img.buf,
 		&request->dst_resolved);
 resolve_dst_buf_failed:
@@ -2302,7 +2326,6 @@ static int resolve_hwmem(struct b2r2_blt_img *img,
 	enum hwmem_access required_access;
 	struct hwmem_mem_chunk mem_chunk;
 	size_t mem_chunk_length = 1;
-	struct hwmem_region region;
 
 	resolved_buf->hwmem_alloc =
 			hwmem_resolve_by_name(img->buf.hwmem_buf_name);
@@ -2325,12 +2348,6 @@ static int resolve_hwmem(struct b2r2_blt_img *img,
 		goto access_check_failed;
 	}
 
-	if (mem_type != HWMEM_MEM_CONTIGUOUS_SYS) {
-		b2r2_log_info("%s: Hwmem buffer is scattered.\n", __func__);
-		return_value = -EINVAL;
-		goto buf_scattered;
-	}
-
 	if (resolved_buf->file_len <
 			img->buf.offset + (__u32)b2r2_get_img_size(img)) {
 		b2r2_log_info("%s: Hwmem buffer too small.\n", __func__);
@@ -2338,34 +2355,55 @@ static int resolve_hwmem(struct b2r2_blt_img *img,
 		goto size_check_failed;
 	}
 
+	/* Prepared together with the job's other buffers in sync_hwmem_bufs */
+	set_up_hwmem_region(img, rect_2b_used, &resolved_buf->hwmem_region);
+
+	/*
+	 * Scattered buffers that happen to be physically contiguous, or that
+	 * came from contiguous memory, are used as they are.
+	 */
 	return_value = hwmem_pin(resolved_buf->hwmem_alloc, &mem_chunk,
 							 &mem_chunk_length);
-	if (return_value < 0) {
+	if (return_value == -ENOSPC && mem_type == HWMEM_MEM_SCATTERED_SYS &&
+								!is_dst) {
+		return_value = bounce_hwmem(img, resolved_buf);
+		if (return_value < 0) {
+			b2r2_log_info("%s: bounce_hwmem failed, "
+				"error code: %i\n", __func__, return_value);
+			goto pin_failed;
+		}
+	} else if (return_value < 0) {
 		b2r2_log_info("%s: hwmem_pin failed, "
 				"error code: %i\n", __func__, return_value);
 		goto pin_failed;
+	} else {
+		resolved_buf->file_physical_start = mem_chunk.paddr;
 	}
-	resolved_buf->file_physical_start = mem_chunk.paddr;
 
-	set_up_hwmem_region(img, rect_2b_used, &region);
-	return_value = hwmem_set_domain(resolved_buf->hwmem_alloc,
-				required_access, HWMEM_DOMAIN_SYNC, &region);
+	/* Lets other users of the buffer know when the blit is done */
+	resolved_buf->hwmem_access = is_dst ? HWMEM_ACCESS_WRITE :
+							HWMEM_ACCESS_READ;
+	return_value = hwmem_fence_add(resolved_buf->hwmem_alloc,
+						resolved_buf->hwmem_access);
 	if (return_value < 0) {
-		b2r2_log_info("%s: hwmem_set_domain failed, "
+		b2r2_log_info("%s: hwmem_fence_add failed, "
 				"error code: %i\n", __func__, return_value);
-		goto set_domain_failed;
+		goto fence_add_failed;
 	}
 
-	resolved_buf->physical_address =
+	if (resolved_buf->hwmem_bounce != NULL)
+		resolved_buf->physical_address =
+					resolved_buf->file_physical_start;
+	else
+		resolved_buf->physical_address =
 			resolved_buf->file_physical_start + img->buf.offset;
 
 	goto out;
 
-set_domain_failed:
-	hwmem_unpin(resolved_buf->hwmem_alloc);
+fence_add_failed:
+	unpin_hwmem(resolved_buf);
 pin_failed:
 size_check_failed:
-buf_scattered:
 access_check_failed:
 	hwmem_release(resolved_buf->hwmem_alloc);
 resolve_failed:
@@ -2374,9 +2412,149 @@ out:
 	return return_value;
 }
 
+/**
+ * bounce_hwmem() - Copies a scattered hwmem source to contiguous memory
+ *
+ * @img: The source image as supplied from user space
+ * @resolved_buf: The source, resolved up to the pin
+ *
+ * B2R2 has no MMU and can only read physically contiguous memory. The
+ * CPU copies the part of the source the blit uses to a contiguous buffer
+ * that starts at the image, and B2R2 reads the copy instead. This lets
+ * buffers that are only drawn by the CPU stay in scattered system pages.
+ *
+ * Returns 0 if OK else negative error code
+ */
+static int bounce_hwmem(struct b2r2_blt_img *img,
+		struct b2r2_resolved_buf *resolved_buf)
+{
+	struct hwmem_region *region = &resolved_buf->hwmem_region;
+	struct hwmem_region bounce_region;
+	struct hwmem_mem_chunk mem_chunk;
+	size_t mem_chunk_length = 1;
+	struct hwmem_alloc *bounce;
+	size_t size = b2r2_get_img_size(img);
+	u8 *src;
+	u8 *dst;
+	size_t i;
+	int ret;
+
+	bounce = hwmem_alloc(size, HWMEM_ALLOC_HINT_WRITE_COMBINE |
+				HWMEM_ALLOC_HINT_UNCACHED,
+				HWMEM_ACCESS_READ | HWMEM_ACCESS_WRITE,
+				HWMEM_MEM_CONTIGUOUS_SYS);
+	if (IS_ERR(bounce))
+		return PTR_ERR(bounce);
+
+	ret = hwmem_set_domain(resolved_buf->hwmem_alloc, HWMEM_ACCESS_READ,
+						HWMEM_DOMAIN_CPU, region);
+	if (ret < 0)
+		goto set_domain_failed;
+
+	src = hwmem_kmap(resolved_buf->hwmem_alloc);
+	if (src == NULL) {
+		ret = -ENOMEM;
+		goto src_kmap_failed;
+	}
+	dst = hwmem_kmap(bounce);
+	if (dst == NULL) {
+		ret = -ENOMEM;
+		goto dst_kmap_failed;
+	}
+
+	for (i = 0; i < region->count; i++) {
+		size_t offset = region->offset + i * region->size +
+								region->start;
+
+		memcpy(dst + offset - img->buf.offset, src + offset,
+					region->end - region->start);
+	}
+
+	hwmem_kunmap(bounce);
+	hwmem_kunmap(resolved_buf->hwmem_alloc);
+
+	bounce_region.offset = 0;
+	bounce_region.count = 1;
+	bounce_region.start = 0;
+	bounce_region.end = size;
+	bounce_region.size = size;
+	ret = hwmem_set_domain(bounce, HWMEM_ACCESS_READ, HWMEM_DOMAIN_SYNC,
+							&bounce_region);
+	if (ret < 0)
+		goto set_domain_failed;
+
+	ret = hwmem_pin(bounce, &mem_chunk, &mem_chunk_length);
+	if (ret < 0)
+		goto set_domain_failed;
+
+	resolved_buf->hwmem_bounce = bounce;
+	resolved_buf->file_physical_start = mem_chunk.paddr;
+
+	return 0;
+
+dst_kmap_failed:
+	hwmem_kunmap(resolved_buf->hwmem_alloc);
+src_kmap_failed:
+set_domain_failed:
+	hwmem_release(bounce);
+
+	return ret;
+}
+
+/* Undoes the pin, or the bounce, made by resolve_hwmem */
+static void unpin_hwmem(struct b2r2_resolved_buf *resolved_buf)
+{
+	if (resolved_buf->hwmem_bounce != NULL) {
+		hwmem_unpin(resolved_buf->hwmem_bounce);
+		hwmem_release(resolved_buf->hwmem_bounce);
+		resolved_buf->hwmem_bounce = NULL;
+	} else {
+		hwmem_unpin(resolved_buf->hwmem_alloc);
+	}
+}
+
+/**
+ * sync_hwmem_bufs() - Prepares the hwmem buffers of a request for the blit
+ *
+ * @request: The request, with all its buffers resolved
+ *
+ * The buffers are handed to hwmem in one batch, so that the caches are
+ * cleaned and invalidated in one go instead of once per buffer.
+ *
+ * Returns 0 if OK else negative error code
+ */
+static int sync_hwmem_bufs(struct b2r2_blt_request *request)
+{
+	struct b2r2_resolved_buf *bufs[] = {
+		&request->src_resolved,
+		&request->src_mask_resolved,
+		&request->dst_resolved,
+	};
+	struct hwmem_set_domain_op ops[ARRAY_SIZE(bufs)];
+	unsigned int i;
+	unsigned int num_ops = 0;
+
+	for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+		/* A bounced source was prepared when it was copied */
+		if (bufs[i]->hwmem_alloc == NULL ||
+					bufs[i]->hwmem_bounce != NULL)
+			continue;
+
+		ops[num_ops].alloc = bufs[i]->hwmem_alloc;
+		ops[num_ops].access = bufs[i]->hwmem_access;
+		ops[num_ops].domain = HWMEM_DOMAIN_SYNC;
+		ops[num_ops].region = &bufs[i]->hwmem_region;
+		num_ops++;
+	}
+
+	return hwmem_set_domain_batch(ops, num_ops);
+}
+
 static void unresolve_hwmem(struct b2r2_resolved_buf *resolved_buf)
 {
-	hwmem_unpin(resolved_buf->hwmem_alloc);
+	hwmem_fence_signal(resolved_buf->hwmem_alloc,
+						resolved_buf->hwmem_access);
+	unpin_hwmem(resolved_buf);
 	hwmem_release(resolved_buf->hwmem_alloc);
 }
 
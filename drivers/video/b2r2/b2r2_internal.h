@@ -15,6 +15,7 @@
 
 
 #include <linux/mutex.h>
+#include <linux/hwmem.h>
 #include <video/b2r2_blt.h>
 
 #include "b2r2_core.h"
@@ -104,6 +105,11 @@ struct b2r2_resolved_buf {
 	void                 *virtual_address;
 	bool                  is_pmem;
 	struct hwmem_alloc   *hwmem_alloc;
+	/* Access and part of the hwmem buffer the blit uses */
+	enum hwmem_access     hwmem_access;
+	struct hwmem_region   hwmem_region;
+	/* Contiguous copy B2R2 reads a scattered hwmem source from */
+	struct hwmem_alloc   *hwmem_bounce;
 	/* Data for validation below */
 	struct file          *filep;
 	u32                   file_physical_start;
@@ -1052,6 +1052,12 @@ void setup_new_exec(struct linux_binprm * bprm)
 			
 	flush_signal_handlers(current, 0);
 	flush_old_files(current->files);
+
+	/*
+	 * We lead the thread group and own the new mm now, whether we took
+	 * over from another leader or used to be a thread without an mm.
+	 */
+	task_notify(TASK_NOTIFY_LEADER, current);
 }
 EXPORT_SYMBOL(setup_new_exec);
 
@@ -32,6 +32,18 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * ASHMEM_GET_PURGED_BITMAP fills 'bitmap' with one bit per page of the given
+ * interval, bit (n % 8) of byte (n / 8) being set if page n of the interval
+ * is unpinned and has been purged.  It returns the number of purged pages and
+ * rearms the POLLIN purge notification of the region.
+ */
+struct ashmem_purged_bitmap {
+	__u32 offset;	/* offset into region, in bytes, page-aligned */
+	__u32 len;	/* length forward from offset, in bytes, page-aligned */
+	__u64 bitmap;	/* user pointer to (len / PAGE_SIZE + 7) / 8 bytes */
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +56,6 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_GET_PURGED_BITMAP	_IOW(__ASHMEMIOC, 11, struct ashmem_purged_bitmap)
 
 #endif	/* _LINUX_ASHMEM_H */
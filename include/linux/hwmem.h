@@ -95,7 +95,14 @@ enum hwmem_access {
  */
 enum hwmem_mem_type {
 	/**
-	 * @brief Scattered system memory.
+	 * @brief Scattered system memory. Write-back cached buffers are
+	 * allocated page by page and only fall back on contiguous memory when
+	 * there are no free pages, buffers with other cache settings always
+	 * use contiguous memory. Pinning returns one mem chunk per physically
+	 * contiguous run of pages. Buffers that only the CPU draws, like
+	 * software rendered window buffers, should be write-back cached
+	 * scattered buffers so they stay out of contiguous memory. B2R2 reads
+	 * such buffers through a contiguous copy.
 	 */
 	HWMEM_MEM_SCATTERED_SYS,
 	/**
@@ -292,8 +299,11 @@ struct hwmem_get_info_request {
  *
  * @brief Pins the buffer.
  *
- * Input is a pointer to a hwmem_pin_request struct. Only contiguous buffers
- * can be pinned from user space.
+ * Input is a pointer to a hwmem_pin_request struct. Only buffers that are
+ * physically contiguous can be pinned from user space, -ENOSPC is returned
+ * for scattered buffers made up of more than one run of pages. The physical
+ * address is only valid until the buffer is unpinned, after that the buffer
+ * may be moved.
  *
  * @return Zero on success, or a negative error code.
  */
@@ -304,6 +314,10 @@ struct hwmem_get_info_request {
  *
  * @brief Unpins the buffer.
  *
+ * Only undoes pins made with HWMEM_PIN_IOC on the same id of the same file,
+ * other unpins are ignored. Pins still held are dropped when the id is
+ * released or the file is closed.
+ *
  * @return Zero on success, or a negative error code.
  */
 #define HWMEM_UNPIN_IOC _IO('W', 7)
@@ -359,6 +373,24 @@ struct hwmem_get_info_request {
  */
 #define HWMEM_IMPORT_FD_IOC _IO('W', 12)
 
+/**
+ * Polling
+ *
+ * A hwmem fd that has a buffer associated with it (@see HWMEM_ALLOC_FD_IOC and
+ * HWMEM_IMPORT_FD_IOC) can be polled to find out when hardware is done with
+ * the buffer. POLLIN is signalled when no hardware is writing to the buffer,
+ * ie the buffer can be read, and POLLOUT when no hardware is accessing the
+ * buffer at all, ie the buffer can be written. Polling an fd without a buffer
+ * returns POLLERR.
+ *
+ * Only operations that drivers register with hwmem_fence_add are seen, and
+ * currently only B2R2 does so. Display scanout and camera capture are not
+ * fenced: the MCDE framebuffer is one buffer that is scanned out all the
+ * time, with its frames selected by panning, so a fence on it would never be
+ * signalled. Polling a buffer that is being scanned out or captured into
+ * reports it as idle; synchronize with those through their own drivers.
+ */
+
 #ifdef __KERNEL__
 
 /* Kernel API */
@@ -466,6 +498,34 @@ void hwmem_release(struct hwmem_alloc *alloc);
 int hwmem_set_domain(struct hwmem_alloc *alloc, enum hwmem_access access,
 		enum hwmem_domain domain, struct hwmem_region *region);
 
+/**
+ * @brief Arguments of one hwmem_set_domain call in a batch.
+ */
+struct hwmem_set_domain_op {
+	struct hwmem_alloc *alloc;
+	enum hwmem_access access;
+	enum hwmem_domain domain;
+	/**
+	 * @brief Region to prepare, NULL means the entire buffer.
+	 */
+	struct hwmem_region *region;
+};
+
+/**
+ * @brief Set the domain of several buffers at once.
+ *
+ * Equivalent to calling hwmem_set_domain for each op but considerably
+ * cheaper when many buffers change domain together, eg when composing a
+ * frame, as the cache maintenance of all buffers is combined.
+ *
+ * @param ops Array of domain changes.
+ * @param num_ops Length of <ops>.
+ *
+ * @return Zero on success, or a negative error code.
+ */
+int hwmem_set_domain_batch(struct hwmem_set_domain_op *ops,
+						unsigned int num_ops);
+
 /**
  * @brief Pins the buffer.
  *
@@ -476,7 +536,9 @@ int hwmem_set_domain(struct hwmem_alloc *alloc, enum hwmem_access access,
  * two ways of handling this situation, keep redoing the pin procedure till it
  * succeeds or allocate enough mem chunks for the worst case ("buffer size" /
  * "page size" mem chunks). Contiguous buffers always require only one mem
- * chunk.
+ * chunk. Unnamed buffers that are not pinned, kmapped or mmapped and have no
+ * hardware operation in flight may be moved to defragment memory so the
+ * physical address is only valid while pinned.
  *
  * @param alloc Buffer to be pinned.
  * @param mem_chunks Pointer to array of mem chunks.
@@ -569,10 +631,67 @@ s32 hwmem_get_name(struct hwmem_alloc *alloc);
  */
 struct hwmem_alloc *hwmem_resolve_by_name(s32 name);
 
+struct file;
+struct poll_table_struct;
+
+/**
+ * @brief Register a hardware operation on the buffer.
+ *
+ * Drivers call this when they queue a job that reads or writes the buffer
+ * and hwmem_fence_signal when the hardware is done with it. Other users of
+ * the buffer can then wait for the job without knowing about the driver.
+ * The caller should hold a reference to the buffer until the fence has been
+ * signalled. A buffer whose last reference is dropped earlier is neither
+ * reused nor freed before all its fences have been signalled.
+ *
+ * @param alloc Buffer the hardware will access.
+ * @param access HWMEM_ACCESS_WRITE if the hardware writes to the buffer,
+ * HWMEM_ACCESS_READ if it only reads from it.
+ *
+ * @return Zero on success, or a negative error code.
+ */
+int hwmem_fence_add(struct hwmem_alloc *alloc, enum hwmem_access access);
+
+/**
+ * @brief Signal that a hardware operation registered with hwmem_fence_add
+ * has completed. May be called from interrupt context.
+ *
+ * @param alloc Buffer the hardware accessed.
+ * @param access Same value as passed to hwmem_fence_add.
+ */
+void hwmem_fence_signal(struct hwmem_alloc *alloc, enum hwmem_access access);
+
+/**
+ * @brief Wait until the buffer can be accessed.
+ *
+ * Reading requires all hardware writes to have completed, writing requires
+ * all hardware reads and writes to have completed.
+ *
+ * @param alloc Buffer to wait for.
+ * @param access Intended access.
+ * @param timeout Timeout in jiffies, MAX_SCHEDULE_TIMEOUT to wait forever.
+ *
+ * @return Zero on success, -ETIME on timeout, or a negative error code.
+ */
+int hwmem_fence_wait(struct hwmem_alloc *alloc, enum hwmem_access access,
+								long timeout);
+
+/**
+ * @brief Poll helper, POLLIN is reported when the buffer can be read and
+ * POLLOUT when it can be written, @see hwmem_fence_wait.
+ */
+unsigned int hwmem_fence_poll(struct hwmem_alloc *alloc, struct file *file,
+					struct poll_table_struct *wait);
+
 /* Integration */
 
 struct hwmem_allocator_api {
 	void *(*alloc)(void *instance, size_t size);
+	/*
+	 * Optional. Allocates <size> bytes ending at or below <limit>, used to
+	 * compact the memory type by moving allocs that are not pinned.
+	 */
+	void *(*alloc_below)(void *instance, size_t size, phys_addr_t limit);
 	void (*free)(void *instance, void *alloc);
 	phys_addr_t (*get_alloc_paddr)(void *alloc);
 	void *(*get_alloc_kaddr)(void *instance, void *alloc);
@@ -1217,6 +1217,9 @@ struct task_struct {
 
 	struct list_head tasks;
 	struct plist_node pushable_tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_entry;	/* lowmemorykiller oom_adj index */
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #if defined(SPLIT_RSS_COUNTING)
@@ -1680,8 +1683,20 @@ static inline void put_task_struct(struct task_struct *t)
 extern void task_times(struct task_struct *p, cputime_t *ut, cputime_t *st);
 extern void thread_group_times(struct task_struct *p, cputime_t *ut, cputime_t *st);
 
+/*
+ * Events passed to the task_free_register() notifiers.  Only
+ * TASK_NOTIFY_FREE is sent from atomic context with the task already
+ * unhashed; the others are sent while the task is alive.  The data of
+ * TASK_NOTIFY_MM_EXIT is the mm_struct, not a task.
+ */
+#define TASK_NOTIFY_FREE	0	/* task struct is being freed */
+#define TASK_NOTIFY_LEADER	1	/* task became a group leader or exec'd */
+#define TASK_NOTIFY_OOM_ADJ	2	/* signal->oom_adj was changed */
+#define TASK_NOTIFY_MM_EXIT	3	/* last user of an mm unmapped it */
+
 extern int task_free_register(struct notifier_block *n);
 extern int task_free_unregister(struct notifier_block *n);
+extern void task_notify(unsigned long event, struct task_struct *tsk);
 
 /*
  * Per process flags
@@ -147,7 +147,7 @@ struct kmem_cache *vm_area_cachep;
 /* SLAB cache for mm_struct structures (tsk->mm) */
 static struct kmem_cache *mm_cachep;
 
-/* Notifier list called when a task struct is freed */
+/* Notifier list called when a task struct is freed or changes group state */
 static ATOMIC_NOTIFIER_HEAD(task_free_notifier);
 
 static void account_kernel_stack(struct thread_info *ti, int account)
@@ -192,6 +192,11 @@ int task_free_unregister(struct notifier_block *n)
 }
 EXPORT_SYMBOL(task_free_unregister);
 
+void task_notify(unsigned long event, struct task_struct *tsk)
+{
+	atomic_notifier_call_chain(&task_free_notifier, event, tsk);
+}
+
 void __put_task_struct(struct task_struct *tsk)
 {
 	WARN_ON(!tsk->exit_state);
@@ -202,7 +207,7 @@ void __put_task_struct(struct task_struct *tsk)
 	delayacct_tsk_free(tsk);
 	put_signal_struct(tsk->signal);
 
-	atomic_notifier_call_chain(&task_free_notifier, 0, tsk);
+	task_notify(TASK_NOTIFY_FREE, tsk);
 	if (!profile_handoff_task(tsk))
 		free_task(tsk);
 }
@@ -288,6 +293,9 @@ static struct task_struct *dup_task_struct(struct task_struct *orig)
 
 	setup_thread_stack(tsk, orig);
 	clear_user_return_notifier(tsk);
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	INIT_LIST_HEAD(&tsk->lowmem_entry);
+#endif
 	stackend = end_of_stack(tsk);
 	*stackend = STACK_END_MAGIC;	/* for overflow detection */
 
@@ -556,6 +564,8 @@ void mmput(struct mm_struct *mm)
 		exit_aio(mm);
 		ksm_exit(mm);
 		exit_mmap(mm);
+		atomic_notifier_call_chain(&task_free_notifier,
+					   TASK_NOTIFY_MM_EXIT, mm);
 		set_mm_exe_file(mm, NULL);
 		if (!list_empty(&mm->mmlist)) {
 			spin_lock(&mmlist_lock);
@@ -1303,6 +1313,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
 	perf_event_fork(p);
+	if (thread_group_leader(p))
+		task_notify(TASK_NOTIFY_LEADER, p);
 	return p;
 
 bad_fork_free_pid:
@@ -27,6 +27,10 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/jiffies.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -34,10 +38,16 @@
 #define ASHMEM_NAME_PREFIX_LEN (sizeof(ASHMEM_NAME_PREFIX) - 1)
 #define ASHMEM_FULL_NAME_LEN (ASHMEM_NAME_LEN + ASHMEM_NAME_PREFIX_LEN)
 
+/* most pages purged from one range per area lock hold */
+#define ASHMEM_PURGE_BATCH	128
+
+/* ranges unpinned more recently than this are purged last */
+#define ASHMEM_MIN_AGE		(HZ / 10)
+
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its own `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +56,15 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects the area and its ranges */
+	wait_queue_head_t purge_wait;	/* pollers waiting for a purge */
+	int purge_pending;		/* purged since last bitmap query */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' also by ashmem_lru_lock
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -60,20 +73,25 @@ struct ashmem_range {
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	unsigned long unpin_time;	/* jiffies when unpinned */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, oldest first, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and lru_count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock, and
+ *                asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker walks the LRU under ashmem_lru_lock and only trylocks the
+ * owning area, so a busy area never stalls reclaim or other areas.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -104,14 +122,18 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 /*
@@ -122,16 +144,17 @@ static inline void lru_del(struct ashmem_range *range)
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
+ * 'gfp' - allocation flags for the range structure
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
-		       size_t start, size_t end)
+		       size_t start, size_t end, gfp_t gfp)
 {
 	struct ashmem_range *range;
 
-	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
+	range = kmem_cache_zalloc(ashmem_range_cachep, gfp);
 	if (unlikely(!range))
 		return -ENOMEM;
 
@@ -139,6 +162,7 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgstart = start;
 	range->pgend = end;
 	range->purged = purged;
+	range->unpin_time = jiffies;
 
 	list_add_tail(&range->unpinned, &prev_range->unpinned);
 
@@ -148,6 +172,26 @@ static int range_alloc(struct ashmem_area *asma,
 	return 0;
 }
 
+/*
+ * range_split_age - give the range just split off 'range' by range_alloc()
+ * the unpin time of 'range' and the place next to it on the LRU, so that
+ * splitting an old range does not make part of it look newly unpinned.
+ *
+ * Caller must hold asma->mutex.
+ */
+static void range_split_age(struct ashmem_range *range)
+{
+	struct ashmem_range *split = list_entry(range->unpinned.prev,
+						struct ashmem_range, unpinned);
+
+	split->unpin_time = range->unpin_time;
+	if (range_on_lru(split)) {
+		spin_lock(&ashmem_lru_lock);
+		list_move(&split->lru, &range->lru);
+		spin_unlock(&ashmem_lru_lock);
+	}
+}
+
 static void range_del(struct ashmem_range *range)
 {
 	list_del(&range->unpinned);
@@ -159,7 +203,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +213,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +234,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	init_waitqueue_head(&asma->purge_wait);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +248,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +266,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +287,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +296,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,10 +317,26 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_poll - POLLIN is reported once any unpinned page of the area has been
+ * purged, until the next ASHMEM_GET_PURGED_BITMAP.
+ */
+static unsigned int ashmem_poll(struct file *file, poll_table *wait)
+{
+	struct ashmem_area *asma = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &asma->purge_wait, wait);
+	if (asma->purge_pending)
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
 static inline unsigned long
 calc_vm_may_flags(unsigned long prot)
 {
@@ -285,7 +350,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,10 +393,81 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_lru_oldest - find the least-recently-unpinned range whose area can be
+ * locked without waiting, skipping ranges younger than ASHMEM_MIN_AGE unless
+ * 'young' is set.  Returns the range with its area's mutex held, or NULL.
+ */
+static struct ashmem_range *ashmem_lru_oldest(int young)
+{
+	struct ashmem_range *range, *found = NULL;
+
+	spin_lock(&ashmem_lru_lock);
+	list_for_each_entry(range, &ashmem_lru_list, lru) {
+		/* the LRU is in unpin order, so everything after is younger */
+		if (!young &&
+		    time_before(jiffies, range->unpin_time + ASHMEM_MIN_AGE))
+			break;
+		if (mutex_trylock(&range->asma->mutex)) {
+			found = range;
+			break;
+		}
+	}
+	spin_unlock(&ashmem_lru_lock);
+
+	return found;
+}
+
+/*
+ * ashmem_purge_range - purge at most 'nr' pages from the top of 'range'
+ *
+ * The purged pages are split off into an ASHMEM_WAS_PURGED range (merged
+ * with an adjacent purged range when there is one) and the rest stays at its
+ * place on the LRU.  If the split cannot be allocated the whole range goes.
+ * Returns the number of pages purged.
+ *
+ * Caller must hold asma->mutex.
+ */
+static size_t ashmem_purge_range(struct ashmem_range *range, size_t nr)
+{
+	struct ashmem_area *asma = range->asma;
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *prev;
+	size_t start;
+
+	if (nr < range_size(range)) {
+		start = range->pgend - nr + 1;
+		prev = list_entry(range->unpinned.prev, struct ashmem_range,
+				  unpinned);
+		if (&prev->unpinned != &asma->unpinned_list &&
+		    prev->purged && prev->pgstart == range->pgend + 1)
+			prev->pgstart = start;
+		else if (range_alloc(asma, range, ASHMEM_WAS_PURGED, start,
+				     range->pgend, GFP_NOWAIT | __GFP_NOWARN))
+			nr = range_size(range);
+	}
+
+	start = range->pgend - nr + 1;
+	vmtruncate_range(inode, start * PAGE_SIZE,
+			 (range->pgend + 1) * PAGE_SIZE - 1);
+
+	if (nr == range_size(range)) {
+		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+	} else {
+		range_shrink(range, range->pgstart, start - 1);
+	}
+
+	asma->purge_pending = 1;
+	wake_up_interruptible(&asma->purge_wait);
+
+	return nr;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -343,13 +479,18 @@ out:
  * Return value is the number of objects (pages) remaining, or -1 if we cannot
  * proceed without risk of deadlock (due to gfp_mask).
  *
- * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * We approximate LRU via least-recently-unpinned, jettisoning unpinned pages
+ * LRU-wise in batches of at most ASHMEM_PURGE_BATCH until we hit 'nr_to_scan'
+ * pages freed.  Only the owning area is locked while a batch is truncated,
+ * and a range is split rather than purged whole when it is larger than what
+ * is still asked for.  Recently unpinned ranges are left for last, since a
+ * pin/unpin cycle is likely to pin them again.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	int young = 0;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -357,21 +498,20 @@ static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	while (nr_to_scan > 0) {
+		range = ashmem_lru_oldest(young);
+		if (!range) {
+			if (young)
+				break;
+			young = 1;
+			continue;
+		}
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
+		asma = range->asma;
+		nr_to_scan -= ashmem_purge_range(range,
+				min_t(size_t, nr_to_scan, ASHMEM_PURGE_BATCH));
+		mutex_unlock(&asma->mutex);
 	}
-	mutex_unlock(&ashmem_mutex);
 
 	return lru_count;
 }
@@ -385,7 +525,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +540,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +548,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +562,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +571,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +588,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,7 +597,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -510,8 +650,9 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			if (!range_alloc(asma, range, range->purged,
+					 pgend + 1, range->pgend, GFP_KERNEL))
+				range_split_age(range);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
@@ -523,7 +664,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -551,14 +692,14 @@ restart:
 		}
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, range, purged, pgstart, pgend, GFP_KERNEL);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -578,6 +719,32 @@ static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 	return ret;
 }
 
+/*
+ * ashmem_page_range - validate a byte interval of the area and convert it to
+ * an inclusive page interval.  Returns zero on success.
+ */
+static int ashmem_page_range(struct ashmem_area *asma, __u32 offset, __u32 len,
+			     size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!len)
+		len = PAGE_ALIGN(asma->size) - offset;
+
+	if (unlikely((offset | len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - offset < len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < offset + len))
+		return -EINVAL;
+
+	*pgstart = offset / PAGE_SIZE;
+	*pgend = *pgstart + (len / PAGE_SIZE) - 1;
+
+	return 0;
+}
+
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
@@ -591,23 +758,11 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
-		return -EINVAL;
-
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
+	ret = ashmem_page_range(asma, pin.offset, pin.len, &pgstart, &pgend);
+	if (unlikely(ret))
+		return ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,11 +776,89 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
 
+/*
+ * ashmem_fill_purged - set the bits of 'bitmap' for the purged pages between
+ * 'pgstart' and 'pgend', inclusive, bit 0 being 'pgstart'.  Returns the
+ * number of purged pages.
+ *
+ * Caller must hold asma->mutex.
+ */
+static size_t ashmem_fill_purged(struct ashmem_area *asma, u8 *bitmap,
+				 size_t pgstart, size_t pgend)
+{
+	struct ashmem_range *range;
+	size_t start, end, pg;
+	size_t nr = 0;
+
+	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
+		if (range_before_page(range, pgstart))
+			break;
+		if (!range->purged || range->pgstart > pgend)
+			continue;
+		start = max_t(size_t, range->pgstart, pgstart);
+		end = min_t(size_t, range->pgend, pgend);
+		for (pg = start; pg <= end; pg++)
+			bitmap[(pg - pgstart) / 8] |= 1 << ((pg - pgstart) % 8);
+		nr += end - start + 1;
+	}
+
+	return nr;
+}
+
+/*
+ * ashmem_get_purged_bitmap - report the purged state of many pages at once,
+ * a page-sized chunk of the bitmap per hold of the area's mutex.
+ */
+static long ashmem_get_purged_bitmap(struct ashmem_area *asma, void __user *p)
+{
+	struct ashmem_purged_bitmap req;
+	u8 __user *ubitmap;
+	u8 *bitmap;
+	size_t pgstart, pgend, chunk_end;
+	size_t chunk = PAGE_SIZE * 8;
+	long nr = 0;
+	int ret;
+
+	if (unlikely(!asma->file))
+		return -EINVAL;
+
+	if (unlikely(copy_from_user(&req, p, sizeof(req))))
+		return -EFAULT;
+
+	ret = ashmem_page_range(asma, req.offset, req.len, &pgstart, &pgend);
+	if (unlikely(ret))
+		return ret;
+
+	bitmap = (u8 *) __get_free_page(GFP_KERNEL);
+	if (unlikely(!bitmap))
+		return -ENOMEM;
+
+	ubitmap = (u8 __user *) (unsigned long) req.bitmap;
+	asma->purge_pending = 0;
+	for (; pgstart <= pgend; pgstart += chunk, ubitmap += PAGE_SIZE) {
+		chunk_end = min_t(size_t, pgend, pgstart + chunk - 1);
+		memset(bitmap, 0, PAGE_SIZE);
+
+		mutex_lock(&asma->mutex);
+		nr += ashmem_fill_purged(asma, bitmap, pgstart, chunk_end);
+		mutex_unlock(&asma->mutex);
+
+		if (copy_to_user(ubitmap, bitmap,
+				 (chunk_end - pgstart) / 8 + 1)) {
+			nr = -EFAULT;
+			break;
+		}
+	}
+
+	free_page((unsigned long) bitmap);
+	return nr;
+}
+
 static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct ashmem_area *asma = file->private_data;
@@ -659,6 +892,9 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_GET_PURGED_BITMAP:
+		ret = ashmem_get_purged_bitmap(asma, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -678,6 +914,7 @@ static struct file_operations ashmem_fops = {
         .read = ashmem_read,
         .llseek = ashmem_llseek,
 	.mmap = ashmem_mmap,
+	.poll = ashmem_poll,
 	.unlocked_ioctl = ashmem_ioctl,
 	.compat_ioctl = ashmem_ioctl,
 };